@@ -0,0 +1,688 @@
+/*
+ * archive - lossless compressed captures with random access
+ * Copyright (c) 2014 Jonathan Bisson <bjonnh-owon@bjonnh.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "archive.h"
+#include "owon.h"
+
+OWON_ON_DISK(ARCHIVE_HEADER_st, 56);
+OWON_ON_DISK(ARCHIVE_CHANNEL_st, 32);
+
+// Workers of the coding and decoding
+#define ARCHIVE_MAX_THREADS 16
+// Ones of a Rice code after which the value follows in raw bits
+#define ARCHIVE_ESCAPE 24
+// Largest block a reader accepts
+#define ARCHIVE_MAX_BLOCK (1 << 24)
+
+// First byte of a block
+#define ARCHIVE_CODED 0
+#define ARCHIVE_STORED 1
+
+static inline int16_t load_s16(const unsigned char *p)
+{
+	return (int16_t)(p[1] << 8 | p[0]);
+}
+
+static inline uint64_t load_u64(const unsigned char *p)
+{
+	uint64_t value;
+	memcpy(&value, p, sizeof(value));
+	return value;
+}
+
+// The difference of two samples takes one more bit than them
+static inline int raw_bits(size_t sample_size)
+{
+	return sample_size == 2 ? 17 : 9;
+}
+
+// Coding
+
+typedef struct {
+	unsigned char *p;
+	unsigned char *end;
+	uint64_t bits;
+	int fill;
+	int overflow;
+} WRITER_st;
+
+static inline void put_bits(WRITER_st *w, uint32_t value, int count)
+{
+	w->bits |= (uint64_t) value << w->fill;
+	w->fill += count;
+	if (w->fill >= 32) {
+		if (w->end - w->p < 4) {
+			w->overflow = 1;
+		} else {
+			w->p[0] = w->bits;
+			w->p[1] = w->bits >> 8;
+			w->p[2] = w->bits >> 16;
+			w->p[3] = w->bits >> 24;
+			w->p += 4;
+		}
+		w->bits >>= 32;
+		w->fill -= 32;
+	}
+}
+
+static void flush_bits(WRITER_st *w)
+{
+	for (; w->fill > 0 && !w->overflow; w->fill -= 8) {
+		if (w->p == w->end)
+			w->overflow = 1;
+		else
+			*w->p++ = w->bits;
+		w->bits >>= 8;
+	}
+}
+
+// dst holds 1 + count * size bytes, the size of a stored block
+static size_t encode_block(const unsigned char *src, size_t count, size_t size, unsigned char *dst)
+{
+	size_t stored = 1 + count * size, i, j, n;
+	WRITER_st w = { dst + 1, dst + stored, 0, 0, 0 };
+	uint32_t z[OWON_ARCHIVE_GROUP], q;
+	int32_t previous = 0, value, delta;
+	int bits = raw_bits(size), k;
+	uint64_t sum;
+
+	dst[0] = ARCHIVE_CODED;
+	for (i = 0; i < count && !w.overflow; i += n) {
+		n = count - i < OWON_ARCHIVE_GROUP ? count - i : OWON_ARCHIVE_GROUP;
+		sum = 0;
+		for (j = 0; j < n; j++) {
+			value = size == 2 ? load_s16(src + 2 * (i + j)) : (int8_t) src[i + j];
+			delta = value - previous;
+			previous = value;
+			z[j] = (uint32_t) delta << 1 ^ (uint32_t)(delta >> 31);
+			sum += z[j];
+		}
+		// About log2 of the mean
+		for (k = 0; k < bits && ((uint64_t) n << (k + 1)) <= sum; k++)
+			;
+		put_bits(&w, k, 5);
+		for (j = 0; j < n; j++) {
+			q = z[j] >> k;
+			if (q < ARCHIVE_ESCAPE) {
+				put_bits(&w, (1u << q) - 1, q + 1);
+				put_bits(&w, z[j] & ((1u << k) - 1), k);
+			} else {
+				put_bits(&w, (1u << ARCHIVE_ESCAPE) - 1, ARCHIVE_ESCAPE);
+				put_bits(&w, z[j], bits);
+			}
+		}
+	}
+	flush_bits(&w);
+
+	if (w.overflow || (size_t)(w.p - dst) >= stored) {
+		dst[0] = ARCHIVE_STORED;
+		memcpy(dst + 1, src, count * size);
+		return stored;
+	}
+	return w.p - dst;
+}
+
+// Decoding
+
+typedef struct {
+	const unsigned char *p;
+	const unsigned char *end;
+	uint64_t bits;
+	int fill;
+	int padding;     // zero bits added past the end
+} READER_st;
+
+// At least 56 bits in the buffer
+static inline void refill(READER_st *r)
+{
+	if (r->end - r->p >= 8) {
+		r->bits |= load_u64(r->p) << r->fill;
+		r->p += (63 - r->fill) >> 3;
+		r->fill |= 56;
+		return;
+	}
+	for (; r->fill <= 56; r->fill += 8) {
+		if (r->p < r->end)
+			r->bits |= (uint64_t) *r->p++ << r->fill;
+		else
+			r->padding += 8;
+	}
+}
+
+static inline uint32_t get_bits(READER_st *r, int count)
+{
+	uint32_t value = r->bits & ((1ull << count) - 1);
+	r->bits >>= count;
+	r->fill -= count;
+	return value;
+}
+
+static int decode_block(const unsigned char *src, size_t len, size_t count, size_t size,
+			unsigned char *dst)
+{
+	READER_st r = { src + 1, src + len, 0, 0, 0 };
+	int bits = raw_bits(size), k, q;
+	uint32_t z, previous = 0;
+	size_t i, j, n;
+
+	if (len < 1)
+		return OWON_ERROR_HEADER;
+	if (src[0] == ARCHIVE_STORED) {
+		if (len != 1 + count * size)
+			return OWON_ERROR_HEADER;
+		memcpy(dst, src + 1, count * size);
+		return OWON_SUCCESS;
+	}
+	if (src[0] != ARCHIVE_CODED)
+		return OWON_ERROR_HEADER;
+
+	for (i = 0; i < count; i += n) {
+		n = count - i < OWON_ARCHIVE_GROUP ? count - i : OWON_ARCHIVE_GROUP;
+		refill(&r);
+		k = get_bits(&r, 5);
+		if (k > bits)
+			return OWON_ERROR_HEADER;
+		for (j = 0; j < n; j++) {
+			refill(&r);
+			q = ~r.bits ? __builtin_ctzll(~r.bits) : 64;
+			if (q < ARCHIVE_ESCAPE) {
+				get_bits(&r, q + 1);
+				z = (uint32_t) q << k | get_bits(&r, k);
+			} else {
+				get_bits(&r, ARCHIVE_ESCAPE);
+				z = get_bits(&r, bits);
+			}
+			// Wraps around like the samples, also on a damaged block
+			previous += (z >> 1) ^ -(z & 1);
+			if (size == 2) {
+				dst[2 * (i + j)] = previous;
+				dst[2 * (i + j) + 1] = previous >> 8;
+			} else {
+				dst[i + j] = previous;
+			}
+		}
+	}
+	return r.padding > r.fill ? OWON_ERROR_HEADER : OWON_SUCCESS;
+}
+
+// Blocks go to a pool of workers, the calling thread being one of them
+
+typedef struct {
+	const unsigned char *src;
+	size_t src_len;            // decoding
+	size_t count;              // samples
+	size_t size;               // bytes per sample
+	unsigned char *dst;
+	size_t length;             // coding: bytes of the block
+	size_t skip;               // decoding: samples of the block left out
+	size_t keep;               // decoding: samples of the block wanted
+} BLOCK_st;
+
+struct archive_job {
+	BLOCK_st *blocks;
+	size_t count;
+	int encode;
+	size_t block_samples;
+	size_t next;
+	int ret;
+};
+
+static void *archive_thread(void *arg)
+{
+	struct archive_job *job = arg;
+	unsigned char *partial = NULL;
+	BLOCK_st *block;
+	size_t index;
+	int ret;
+
+	while ((index = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->count) {
+		block = &job->blocks[index];
+		if (job->encode) {
+			block->length = encode_block(block->src, block->count, block->size, block->dst);
+			continue;
+		}
+		if (block->skip == 0 && block->keep == block->count) {
+			ret = decode_block(block->src, block->src_len, block->count, block->size, block->dst);
+		} else {
+			// Only a part of it is wanted
+			if (partial == NULL)
+				partial = malloc(job->block_samples * sizeof(int16_t));
+			ret = partial == NULL ? OWON_ERROR_MEMORY :
+				decode_block(block->src, block->src_len, block->count, block->size, partial);
+			if (ret == OWON_SUCCESS)
+				memcpy(block->dst, partial + block->skip * block->size, block->keep * block->size);
+		}
+		if (ret < 0)
+			__atomic_store_n(&job->ret, ret, __ATOMIC_RELAXED);
+	}
+	free(partial);
+	return NULL;
+}
+
+static int run_job(struct archive_job *job, int threads)
+{
+	pthread_t workers[ARCHIVE_MAX_THREADS];
+	int started = 0, i;
+
+	if (threads > (int) job->count)
+		threads = job->count;
+	if (threads > ARCHIVE_MAX_THREADS)
+		threads = ARCHIVE_MAX_THREADS;
+
+	for (i = 1; i < threads; i++)
+		if (pthread_create(&workers[started], NULL, archive_thread, job) == 0)
+			started++;
+	archive_thread(job);
+	for (i = 0; i < started; i++)
+		pthread_join(workers[i], NULL);
+	return job->ret;
+}
+
+// Writer
+
+static int write_u64(FILE *file, uint64_t value)
+{
+	return fwrite(&value, sizeof(value), 1, file) == 1 ? OWON_SUCCESS : OWON_ERROR;
+}
+
+int owon_output_archive(const HEADER_st *header, const unsigned char *capture, size_t len,
+			FILE *file, int threads)
+{
+	ARCHIVE_HEADER_st archive;
+	ARCHIVE_CHANNEL_st *records = NULL;
+	const CHANNEL_st **channels = NULL;
+	struct archive_job job;
+	BLOCK_st *blocks = NULL;
+	unsigned char *coded = NULL;
+	size_t channels_count = header->channels_count, blocks_count = 0, coded_len = 0;
+	size_t i, j, b, position;
+	uint64_t offset, end;
+	int ret = OWON_SUCCESS;
+
+	memset(&job, 0, sizeof(job));
+	memset(&archive, 0, sizeof(archive));
+	memcpy(archive.magic, OWON_ARCHIVE_MAGIC, sizeof(OWON_ARCHIVE_MAGIC));
+	archive.version = OWON_ARCHIVE_VERSION;
+	archive.channels_count = channels_count;
+	archive.header_size = sizeof(ARCHIVE_HEADER_st);
+	archive.channel_size = sizeof(ARCHIVE_CHANNEL_st);
+	archive.block_samples = OWON_ARCHIVE_BLOCK;
+	archive.capture_length = len;
+	archive.raw_offset = sizeof(ARCHIVE_HEADER_st) + channels_count * sizeof(ARCHIVE_CHANNEL_st);
+	archive.raw_length = len;
+
+	records = calloc(channels_count ? channels_count : 1, sizeof(ARCHIVE_CHANNEL_st));
+	channels = calloc(channels_count ? channels_count : 1, sizeof(CHANNEL_st *));
+	if (records == NULL || channels == NULL) {
+		ret = OWON_ERROR_MEMORY;
+		goto out;
+	}
+
+	// The records follow the samples in the capture
+	for (i = 0; i < channels_count; i++) {
+		for (j = i; j > 0 && channels[j - 1]->samples_offset > header->channels[i]->samples_offset; j--)
+			channels[j] = channels[j - 1];
+		channels[j] = header->channels[i];
+	}
+	for (i = 0, end = 0; i < channels_count; i++) {
+		records[i].capture_offset = channels[i]->samples_offset;
+		records[i].samples = channels[i]->samples_file;
+		records[i].sample_size = owon_channel_sample_size(channels[i]);
+		records[i].blocks_count = (records[i].samples + OWON_ARCHIVE_BLOCK - 1) / OWON_ARCHIVE_BLOCK;
+		if (records[i].capture_offset < end || records[i].capture_offset > len ||
+		    records[i].samples > (len - records[i].capture_offset) / records[i].sample_size) {
+			ret = OWON_ERROR_HEADER;
+			goto out;
+		}
+		end = records[i].capture_offset + records[i].samples * records[i].sample_size;
+		archive.raw_length -= records[i].samples * records[i].sample_size;
+		blocks_count += records[i].blocks_count;
+		coded_len += records[i].blocks_count + records[i].samples * records[i].sample_size;
+	}
+
+	blocks = calloc(blocks_count ? blocks_count : 1, sizeof(BLOCK_st));
+	coded = malloc(coded_len ? coded_len : 1);
+	if (blocks == NULL || coded == NULL) {
+		ret = OWON_ERROR_MEMORY;
+		goto out;
+	}
+	for (i = 0, b = 0, position = 0; i < channels_count; i++) {
+		for (j = 0; j < records[i].blocks_count; j++, b++) {
+			blocks[b].size = records[i].sample_size;
+			blocks[b].src = capture + records[i].capture_offset + j * OWON_ARCHIVE_BLOCK * blocks[b].size;
+			blocks[b].count = records[i].samples - j * OWON_ARCHIVE_BLOCK;
+			if (blocks[b].count > OWON_ARCHIVE_BLOCK)
+				blocks[b].count = OWON_ARCHIVE_BLOCK;
+			blocks[b].dst = coded + position;
+			position += 1 + blocks[b].count * blocks[b].size;
+		}
+	}
+
+	job.blocks = blocks;
+	job.count = blocks_count;
+	job.encode = 1;
+	run_job(&job, threads);
+
+	// Now that the blocks have their size
+	offset = archive.raw_offset + archive.raw_length;
+	for (i = 0, b = 0; i < channels_count; i++) {
+		records[i].index_offset = offset;
+		offset += (records[i].blocks_count + 1) * sizeof(uint64_t);
+		for (j = 0; j < records[i].blocks_count; j++, b++)
+			offset += blocks[b].length;
+	}
+
+	if (fwrite(&archive, sizeof(archive), 1, file) != 1 ||
+	    fwrite(records, sizeof(ARCHIVE_CHANNEL_st), channels_count, file) != channels_count) {
+		ret = OWON_ERROR;
+		goto out;
+	}
+	// What is around the samples
+	for (i = 0, position = 0; i <= channels_count && ret == OWON_SUCCESS; i++) {
+		end = i < channels_count ? records[i].capture_offset : len;
+		if (end > position && fwrite(capture + position, 1, end - position, file) != end - position)
+			ret = OWON_ERROR;
+		if (i < channels_count)
+			position = end + records[i].samples * records[i].sample_size;
+	}
+	for (i = 0, b = 0; i < channels_count && ret == OWON_SUCCESS; i++) {
+		offset = records[i].index_offset + (records[i].blocks_count + 1) * sizeof(uint64_t);
+		for (j = 0; j < records[i].blocks_count && ret == OWON_SUCCESS; j++) {
+			ret = write_u64(file, offset);
+			offset += blocks[b + j].length;
+		}
+		if (ret == OWON_SUCCESS)
+			ret = write_u64(file, offset);
+		for (j = 0; j < records[i].blocks_count && ret == OWON_SUCCESS; j++, b++)
+			if (fwrite(blocks[b].dst, 1, blocks[b].length, file) != blocks[b].length)
+				ret = OWON_ERROR;
+	}
+
+out:
+	free(coded);
+	free(blocks);
+	free(channels);
+	free(records);
+	return ret;
+}
+
+// Reader
+
+int owon_archive_from_buffer(const void *buf, size_t len, ARCHIVE_st *archive)
+{
+	const ARCHIVE_HEADER_st *header = buf;
+	const ARCHIVE_CHANNEL_st *channel;
+	const unsigned char *index;
+	uint64_t end = 0, samples_bytes = 0, previous, offset;
+	size_t i, j;
+
+	memset(archive, 0, sizeof(ARCHIVE_st));
+	if (len < sizeof(ARCHIVE_HEADER_st) ||
+	    memcmp(header->magic, OWON_ARCHIVE_MAGIC, sizeof(OWON_ARCHIVE_MAGIC)) != 0)
+		return OWON_ERROR_HEADER;
+	if (header->version != OWON_ARCHIVE_VERSION)
+		return OWON_ERROR_UNSUPPORTED;
+	if (header->channel_size < sizeof(ARCHIVE_CHANNEL_st) || header->channel_size % 8 != 0 ||
+	    header->header_size < sizeof(ARCHIVE_HEADER_st) || header->header_size % 8 != 0 ||
+	    header->header_size > len ||
+	    header->channels_count > (len - header->header_size) / header->channel_size ||
+	    header->block_samples == 0 || header->block_samples > ARCHIVE_MAX_BLOCK ||
+	    header->raw_offset > len || header->raw_length > len - header->raw_offset)
+		return OWON_ERROR_HEADER;
+
+	archive->data = buf;
+	archive->len = len;
+	archive->header = header;
+
+	// Everything the readers rely on is checked once here
+	for (i = 0; i < header->channels_count; i++) {
+		channel = owon_archive_channel(archive, i);
+		if ((channel->sample_size != 1 && channel->sample_size != 2) ||
+		    channel->capture_offset < end || channel->capture_offset > header->capture_length ||
+		    channel->samples > (header->capture_length - channel->capture_offset) / channel->sample_size ||
+		    channel->blocks_count != channel->samples / header->block_samples +
+		    (channel->samples % header->block_samples != 0) ||
+		    channel->index_offset > len ||
+		    (uint64_t) channel->blocks_count + 1 > (len - channel->index_offset) / sizeof(uint64_t))
+			goto invalid;
+		end = channel->capture_offset + channel->samples * channel->sample_size;
+		samples_bytes += channel->samples * channel->sample_size;
+
+		index = archive->data + channel->index_offset;
+		previous = load_u64(index);
+		for (j = 1; j <= channel->blocks_count; j++) {
+			offset = load_u64(index + j * sizeof(uint64_t));
+			if (offset <= previous || offset > len)
+				goto invalid;
+			previous = offset;
+		}
+	}
+	if (header->raw_length != header->capture_length - samples_bytes)
+		goto invalid;
+	return OWON_SUCCESS;
+
+invalid:
+	memset(archive, 0, sizeof(ARCHIVE_st));
+	return OWON_ERROR_HEADER;
+}
+
+int owon_archive_open(const char *path, ARCHIVE_st *archive)
+{
+	char magic[sizeof(OWON_ARCHIVE_MAGIC)];
+	MAP_st map;
+	int fd, ret;
+
+	// Captures are tried as archives first, mapping one would read it all
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return OWON_ERROR_READ;
+	ret = pread(fd, magic, sizeof(magic), 0) == (ssize_t) sizeof(magic) &&
+		memcmp(magic, OWON_ARCHIVE_MAGIC, sizeof(magic)) == 0;
+	close(fd);
+	if (!ret)
+		return OWON_ERROR_HEADER;
+
+	ret = owon_map_file(path, &map);
+	if (ret < 0)
+		return ret;
+	ret = owon_archive_from_buffer(map.data, map.len, archive);
+	if (ret < 0) {
+		owon_unmap_file(&map);
+		return ret;
+	}
+	archive->mapped = 1;
+	return OWON_SUCCESS;
+}
+
+const ARCHIVE_CHANNEL_st *owon_archive_channel(const ARCHIVE_st *archive, size_t channel)
+{
+	if (channel >= archive->header->channels_count)
+		return NULL;
+	return (const ARCHIVE_CHANNEL_st *)(archive->data + archive->header->header_size +
+					    channel * archive->header->channel_size);
+}
+
+// Block b of channel, decoding skip samples from its start and keeping keep
+static void describe_block(const ARCHIVE_st *archive, const ARCHIVE_CHANNEL_st *channel, size_t b,
+			   BLOCK_st *block)
+{
+	const unsigned char *index = archive->data + channel->index_offset + b * sizeof(uint64_t);
+	uint64_t start = load_u64(index), end = load_u64(index + sizeof(uint64_t));
+	size_t block_samples = archive->header->block_samples;
+
+	block->src = archive->data + start;
+	block->src_len = end - start;
+	block->size = channel->sample_size;
+	block->count = channel->samples - b * block_samples;
+	if (block->count > block_samples)
+		block->count = block_samples;
+	block->skip = 0;
+	block->keep = block->count;
+}
+
+int owon_archive_read(const ARCHIVE_st *archive, size_t channel, size_t first, size_t count,
+		      unsigned char *destination, int threads)
+{
+	const ARCHIVE_CHANNEL_st *record = owon_archive_channel(archive, channel);
+	size_t block_samples = archive->header->block_samples, b, start, i;
+	struct archive_job job;
+	int ret;
+
+	if (record == NULL || first > record->samples || count > record->samples - first)
+		return OWON_ERROR;
+	if (count == 0)
+		return OWON_SUCCESS;
+
+	memset(&job, 0, sizeof(job));
+	start = first / block_samples;
+	job.count = (first + count - 1) / block_samples - start + 1;
+	job.block_samples = block_samples;
+	job.blocks = malloc(job.count * sizeof(BLOCK_st));
+	if (job.blocks == NULL)
+		return OWON_ERROR_MEMORY;
+
+	for (i = 0; i < job.count; i++) {
+		BLOCK_st *block = &job.blocks[i];
+		b = start + i;
+		describe_block(archive, record, b, block);
+		if (first > b * block_samples)
+			block->skip = first - b * block_samples;
+		block->keep = block->count - block->skip;
+		if (b * block_samples + block->count > first + count)
+			block->keep -= b * block_samples + block->count - (first + count);
+		block->dst = destination + (b * block_samples + block->skip - first) * record->sample_size;
+	}
+
+	ret = run_job(&job, threads);
+	free(job.blocks);
+	return ret;
+}
+
+// The raw parts between the samples, in their place in the capture
+static void copy_raw(const ARCHIVE_st *archive, unsigned char *destination)
+{
+	const ARCHIVE_HEADER_st *header = archive->header;
+	const ARCHIVE_CHANNEL_st *channel;
+	const unsigned char *raw = archive->data + header->raw_offset;
+	uint64_t position = 0, end;
+	size_t i;
+
+	for (i = 0; i <= header->channels_count; i++) {
+		channel = i < header->channels_count ? owon_archive_channel(archive, i) : NULL;
+		end = channel != NULL ? channel->capture_offset : header->capture_length;
+		memcpy(destination + position, raw, end - position);
+		raw += end - position;
+		if (channel == NULL)
+			break;
+		position = end + channel->samples * channel->sample_size;
+	}
+}
+
+int owon_archive_extract(const ARCHIVE_st *archive, unsigned char *destination, int threads)
+{
+	const ARCHIVE_HEADER_st *header = archive->header;
+	const ARCHIVE_CHANNEL_st *channel;
+	struct archive_job job;
+	size_t i, j, b;
+	int ret;
+
+	memset(&job, 0, sizeof(job));
+	job.block_samples = header->block_samples;
+	for (i = 0; i < header->channels_count; i++)
+		job.count += owon_archive_channel(archive, i)->blocks_count;
+	job.blocks = malloc((job.count ? job.count : 1) * sizeof(BLOCK_st));
+	if (job.blocks == NULL)
+		return OWON_ERROR_MEMORY;
+
+	// The blocks go where copy_raw leaves room for them
+	copy_raw(archive, destination);
+	for (i = 0, b = 0; i < header->channels_count; i++) {
+		channel = owon_archive_channel(archive, i);
+		for (j = 0; j < channel->blocks_count; j++, b++) {
+			describe_block(archive, channel, j, &job.blocks[b]);
+			job.blocks[b].dst = destination + channel->capture_offset +
+				j * header->block_samples * channel->sample_size;
+		}
+	}
+
+	ret = run_job(&job, threads);
+	free(job.blocks);
+	return ret;
+}
+
+int owon_archive_parse(const ARCHIVE_st *archive, HEADER_st *header, int threads)
+{
+	size_t len = archive->header->capture_length;
+	unsigned char *capture;
+	int ret;
+
+	memset(header, 0, sizeof(HEADER_st));
+	if (len == 0)
+		return OWON_ERROR_HEADER;
+	// Anonymous mapping, released by owon_free_header like a mapped file
+	capture = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (capture == MAP_FAILED)
+		return OWON_ERROR_MEMORY;
+
+	ret = owon_archive_extract(archive, capture, threads);
+	if (ret == OWON_SUCCESS)
+		ret = owon_parse((const char *) capture, len, header);
+	header->map = capture;
+	header->map_len = len;
+	if (ret < 0)
+		owon_free_header(header);
+	return ret;
+}
+
+int owon_archive_probe(const ARCHIVE_st *archive, HEADER_st *header)
+{
+	size_t len = archive->header->capture_length, i;
+	unsigned char *capture;
+	int ret;
+
+	memset(header, 0, sizeof(HEADER_st));
+	if (len == 0)
+		return OWON_ERROR_HEADER;
+	// The pages of the samples are never written nor read by the parser,
+	// they are not even allocated
+	capture = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (capture == MAP_FAILED)
+		return OWON_ERROR_MEMORY;
+
+	copy_raw(archive, capture);
+	ret = owon_parse((const char *) capture, len, header);
+	for (i = 0; ret == OWON_SUCCESS && i < header->channels_count; i++)
+		header->channels[i]->samples = NULL;
+	munmap(capture, len);
+	return ret;
+}
+
+void owon_archive_close(ARCHIVE_st *archive)
+{
+	if (archive->mapped) {
+		MAP_st map = { archive->data, archive->len };
+		owon_unmap_file(&map);
+	}
+	memset(archive, 0, sizeof(ARCHIVE_st));
+}
@@ -0,0 +1,102 @@
+/*
+ * archive - lossless compressed captures with random access
+ * Copyright (c) 2014 Jonathan Bisson <bjonnh-owon@bjonnh.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef _ARCHIVE_H_
+#define _ARCHIVE_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include "parse.h"
+
+// File layout, in host byte order (see owon.h):
+//
+//   ARCHIVE_HEADER_st      56 bytes at offset 0
+//   ARCHIVE_CHANNEL_st     channel_size bytes per channel, right after,
+//                          in the order of the samples in the capture
+//   raw                    the capture without the samples of the channels:
+//                          its headers, channel headers and anything else,
+//                          stored as they are
+//   per channel            blocks_count + 1 offsets of its blocks in the
+//                          archive (the last one is the end of the last
+//                          block), then the blocks
+//
+// A block holds up to block_samples samples and is decoded on its own.
+// Its first byte tells how:
+//   0  the samples, from 0 at the start of the block, are replaced by their
+//      difference to the previous one, zigzag encoded to unsigned and Rice
+//      coded in groups of OWON_ARCHIVE_GROUP, each group starting with its
+//      Rice parameter in 5 bits. Bits go from the least significant one.
+//   1  the raw samples, when coding doesn't make them smaller
+// The capture comes back byte for byte.
+
+#define OWON_ARCHIVE_MAGIC "OWONARC"
+#define OWON_ARCHIVE_VERSION 1
+#define OWON_ARCHIVE_BLOCK 65536
+#define OWON_ARCHIVE_GROUP 32
+
+typedef struct {
+  char magic[8];            // "OWONARC\0"
+  uint32_t version;
+  uint32_t channels_count;
+  uint32_t header_size;     // offset of the first channel record
+  uint32_t channel_size;    // size of a channel record
+  uint32_t block_samples;
+  uint32_t reserved;
+  uint64_t capture_length;
+  uint64_t raw_offset;
+  uint64_t raw_length;
+} ARCHIVE_HEADER_st;
+
+typedef struct {
+  uint64_t capture_offset;  // of the samples in the capture
+  uint64_t samples;
+  uint32_t sample_size;
+  uint32_t blocks_count;
+  uint64_t index_offset;
+} ARCHIVE_CHANNEL_st;
+
+typedef struct {
+  const unsigned char *data;
+  size_t len;
+  int mapped;
+  const ARCHIVE_HEADER_st *header;
+} ARCHIVE_st;
+
+// header is the parse of capture, the blocks are coded by threads workers
+int owon_output_archive(const HEADER_st *header, const unsigned char *capture, size_t len,
+			FILE *file, int threads);
+
+// Reader, the records point into the file, checked when it is opened
+int owon_archive_open(const char *path, ARCHIVE_st *archive);
+int owon_archive_from_buffer(const void *buf, size_t len, ARCHIVE_st *archive);
+const ARCHIVE_CHANNEL_st *owon_archive_channel(const ARCHIVE_st *archive, size_t channel);
+// count raw samples of channel from first, as they were in the capture
+// (count * sample_size bytes). Only the blocks holding them are decoded.
+int owon_archive_read(const ARCHIVE_st *archive, size_t channel, size_t first, size_t count,
+		      unsigned char *destination, int threads);
+// The original capture, capture_length bytes
+int owon_archive_extract(const ARCHIVE_st *archive, unsigned char *destination, int threads);
+// Restores the capture in memory and parses it. The header owns the
+// restored capture as owon_parse_file's owns its mapped file.
+int owon_archive_parse(const ARCHIVE_st *archive, HEADER_st *header, int threads);
+// Same header without the samples, as owon_probe_file: only the raw part
+// of the archive is read
+int owon_archive_probe(const ARCHIVE_st *archive, HEADER_st *header);
+void owon_archive_close(ARCHIVE_st *archive);
+
+#endif
@@ -0,0 +1,182 @@
+/*
+ * columnar - binary columnar export of parsed captures
+ * Copyright (c) 2014 Jonathan Bisson <bjonnh-owon@bjonnh.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "columnar.h"
+#include "owon.h"
+
+OWON_ON_DISK(COLUMNAR_HEADER_st, 64);
+OWON_ON_DISK(COLUMNAR_CHANNEL_st, 80);
+
+static uint64_t align_up(uint64_t offset)
+{
+	return (offset + OWON_COLUMNAR_ALIGN - 1) & ~(uint64_t)(OWON_COLUMNAR_ALIGN - 1);
+}
+
+static int write_padding(FILE *file, uint64_t from, uint64_t to)
+{
+	static const char zeros[OWON_COLUMNAR_ALIGN];
+	if (to > from && fwrite(zeros, 1, to - from, file) != to - from)
+		return OWON_ERROR;
+	return OWON_SUCCESS;
+}
+
+void owon_columnar_describe(const CHANNEL_st *channel, COLUMNAR_CHANNEL_st *record)
+{
+	memset(record, 0, sizeof(COLUMNAR_CHANNEL_st));
+	memcpy(record->name, channel->name, sizeof(record->name));
+	record->datatype = channel->datatype;
+	record->sample_size = owon_channel_sample_size(channel);
+	record->samples_count = channel->samples_count;
+	record->samples_file = channel->samples_file;
+	record->offsety = channel->offsety;
+	record->timediv = channel->timediv;
+	record->volts_per_count = owon_channel_volts_per_count(channel);
+	record->voltsdiv = channel->voltsdiv;
+	record->attenuation = channel->attenuation;
+	record->time_mul = channel->time_mul;
+	record->frequency = channel->frequency;
+	record->period = channel->period;
+	record->volts_mul = channel->volts_mul;
+	record->data_length = (uint64_t) channel->samples_file * record->sample_size;
+}
+
+int owon_output_columnar(HEADER_st *header, FILE *file)
+{
+	COLUMNAR_HEADER_st file_header;
+	COLUMNAR_CHANNEL_st *records;
+	uint64_t offset;
+	size_t i;
+	int ret = OWON_SUCCESS;
+
+	records = calloc(header->channels_count ? header->channels_count : 1, sizeof(COLUMNAR_CHANNEL_st));
+	if (records == NULL)
+		return OWON_ERROR_MEMORY;
+
+	memset(&file_header, 0, sizeof(file_header));
+	memcpy(file_header.magic, OWON_COLUMNAR_MAGIC, sizeof(OWON_COLUMNAR_MAGIC));
+	file_header.version = OWON_COLUMNAR_VERSION;
+	file_header.channels_count = header->channels_count;
+	file_header.header_size = sizeof(COLUMNAR_HEADER_st);
+	file_header.channel_size = sizeof(COLUMNAR_CHANNEL_st);
+	strncpy(file_header.model, header->model, sizeof(file_header.model) - 1);
+	strncpy(file_header.serial, header->serial, sizeof(file_header.serial) - 1);
+
+	offset = sizeof(COLUMNAR_HEADER_st) + header->channels_count * sizeof(COLUMNAR_CHANNEL_st);
+	for (i = 0; i < header->channels_count; i++) {
+		COLUMNAR_CHANNEL_st *record = &records[i];
+
+		owon_columnar_describe(header->channels[i], record);
+		record->data_offset = align_up(offset);
+		offset = record->data_offset + record->data_length;
+	}
+
+	if (fwrite(&file_header, sizeof(file_header), 1, file) != 1 ||
+	    fwrite(records, sizeof(COLUMNAR_CHANNEL_st), header->channels_count, file) != header->channels_count)
+		ret = OWON_ERROR;
+
+	// The samples are stored in the capture as they are in the file
+	offset = sizeof(COLUMNAR_HEADER_st) + header->channels_count * sizeof(COLUMNAR_CHANNEL_st);
+	for (i = 0; i < header->channels_count && ret == OWON_SUCCESS; i++) {
+		ret = write_padding(file, offset, records[i].data_offset);
+		if (ret == OWON_SUCCESS && records[i].data_length > 0 &&
+		    fwrite(header->channels[i]->samples, 1, records[i].data_length, file) != records[i].data_length)
+			ret = OWON_ERROR;
+		offset = records[i].data_offset + records[i].data_length;
+	}
+
+	free(records);
+	return ret;
+}
+
+int owon_columnar_from_buffer(const void *buf, size_t len, COLUMNAR_st *col)
+{
+	const COLUMNAR_HEADER_st *header = buf;
+	size_t i;
+
+	memset(col, 0, sizeof(COLUMNAR_st));
+	if (len < sizeof(COLUMNAR_HEADER_st) ||
+	    memcmp(header->magic, OWON_COLUMNAR_MAGIC, sizeof(OWON_COLUMNAR_MAGIC)) != 0)
+		return OWON_ERROR_HEADER;
+	if (header->version != OWON_COLUMNAR_VERSION)
+		return OWON_ERROR_UNSUPPORTED;
+	if (header->channel_size < sizeof(COLUMNAR_CHANNEL_st) || header->channel_size % 8 != 0 ||
+	    header->header_size < sizeof(COLUMNAR_HEADER_st) || header->header_size % 8 != 0 ||
+	    header->header_size > len ||
+	    header->channels_count > (len - header->header_size) / header->channel_size)
+		return OWON_ERROR_HEADER;
+
+	col->data = buf;
+	col->len = len;
+	col->header = header;
+
+	for (i = 0; i < header->channels_count; i++) {
+		const COLUMNAR_CHANNEL_st *channel = owon_columnar_channel(col, i);
+		if ((channel->sample_size != 1 && channel->sample_size != 2) ||
+		    channel->data_offset % OWON_COLUMNAR_ALIGN != 0 ||
+		    channel->data_offset > len || channel->data_length > len - channel->data_offset ||
+		    channel->data_length != (uint64_t) channel->samples_file * channel->sample_size) {
+			memset(col, 0, sizeof(COLUMNAR_st));
+			return OWON_ERROR_HEADER;
+		}
+	}
+	return OWON_SUCCESS;
+}
+
+int owon_columnar_open(const char *path, COLUMNAR_st *col)
+{
+	MAP_st map;
+	int ret;
+
+	ret = owon_map_file(path, &map);
+	if (ret < 0)
+		return ret;
+	ret = owon_columnar_from_buffer(map.data, map.len, col);
+	if (ret < 0) {
+		owon_unmap_file(&map);
+		return ret;
+	}
+	col->mapped = 1;
+	return OWON_SUCCESS;
+}
+
+const COLUMNAR_CHANNEL_st *owon_columnar_channel(const COLUMNAR_st *col, size_t channel)
+{
+	if (channel >= col->header->channels_count)
+		return NULL;
+	return (const COLUMNAR_CHANNEL_st *)(col->data + col->header->header_size +
+					     channel * col->header->channel_size);
+}
+
+const void *owon_columnar_samples(const COLUMNAR_st *col, size_t channel)
+{
+	const COLUMNAR_CHANNEL_st *record = owon_columnar_channel(col, channel);
+	if (record == NULL)
+		return NULL;
+	return col->data + record->data_offset;
+}
+
+void owon_columnar_close(COLUMNAR_st *col)
+{
+	if (col->mapped) {
+		MAP_st map = { col->data, col->len };
+		owon_unmap_file(&map);
+	}
+	memset(col, 0, sizeof(COLUMNAR_st));
+}
@@ -0,0 +1,90 @@
+/*
+ * columnar - binary columnar export of parsed captures
+ * Copyright (c) 2014 Jonathan Bisson <bjonnh-owon@bjonnh.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef _COLUMNAR_H_
+#define _COLUMNAR_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include "parse.h"
+
+// File layout, in host byte order (see owon.h):
+//
+//   COLUMNAR_HEADER_st     64 bytes at offset 0
+//   COLUMNAR_CHANNEL_st    channel_size bytes per channel, right after
+//   samples                one array per channel, at data_offset which is a
+//                          multiple of OWON_COLUMNAR_ALIGN
+//
+// The arrays hold the raw ADC counts, int16_t when sample_size is 2 and
+// int8_t when it is 1. volts = count * volts_per_count, and sample i is at
+// time timediv * 10 * i / samples_count.
+// With numpy: np.memmap(path, dtype='<i2', offset=data_offset, shape=(samples_file,))
+
+#define OWON_COLUMNAR_MAGIC "OWONCOL"
+#define OWON_COLUMNAR_VERSION 1
+#define OWON_COLUMNAR_ALIGN 64
+
+typedef struct {
+  char magic[8];            // "OWONCOL\0"
+  uint32_t version;
+  uint32_t channels_count;
+  uint32_t header_size;     // offset of the first channel record
+  uint32_t channel_size;    // size of a channel record
+  char model[8];
+  char serial[32];
+} COLUMNAR_HEADER_st;
+
+typedef struct {
+  char name[4];
+  int32_t datatype;
+  uint32_t sample_size;
+  uint32_t samples_count;
+  uint32_t samples_file;
+  int32_t offsety;
+  double timediv;
+  double volts_per_count;
+  float voltsdiv;
+  uint32_t attenuation;
+  float time_mul;
+  float frequency;
+  float period;
+  float volts_mul;
+  uint64_t data_offset;
+  uint64_t data_length;
+} COLUMNAR_CHANNEL_st;
+
+typedef struct {
+  const unsigned char *data;
+  size_t len;
+  int mapped;
+  const COLUMNAR_HEADER_st *header;
+} COLUMNAR_st;
+
+int owon_output_columnar(HEADER_st *header, FILE *file);
+// Fills the record of a channel, but for data_offset which is left to 0
+void owon_columnar_describe(const CHANNEL_st *channel, COLUMNAR_CHANNEL_st *record);
+
+// Reader, nothing is copied: records and samples point into the file
+int owon_columnar_open(const char *path, COLUMNAR_st *col);
+int owon_columnar_from_buffer(const void *buf, size_t len, COLUMNAR_st *col);
+const COLUMNAR_CHANNEL_st *owon_columnar_channel(const COLUMNAR_st *col, size_t channel);
+// int8_t or int16_t array depending on the channel sample_size
+const void *owon_columnar_samples(const COLUMNAR_st *col, size_t channel);
+void owon_columnar_close(COLUMNAR_st *col);
+
+#endif
@@ -0,0 +1,268 @@
+/*
+ * daemon - protocol of the owon-daemon acquisition server
+ * Copyright (c) 2014 Jonathan Bisson <bjonnh-owon@bjonnh.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "daemon.h"
+#include "owon.h"
+
+int owon_daemon_read_all(int fd, void *buf, size_t len)
+{
+	unsigned char *position = buf;
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = read(fd, position, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return OWON_ERROR_READ;
+		position += ret;
+		len -= ret;
+	}
+	return OWON_SUCCESS;
+}
+
+int owon_daemon_write_all(int fd, const void *buf, size_t len)
+{
+	const unsigned char *position = buf;
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = send(fd, position, len, MSG_NOSIGNAL);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return OWON_ERROR;
+		position += ret;
+		len -= ret;
+	}
+	return OWON_SUCCESS;
+}
+
+// The memfd, when there is one (>= 0), rides along the response header
+int owon_daemon_send_response(int fd, const OWON_DAEMON_RESPONSE_st *response, int memfd)
+{
+	union {
+		struct cmsghdr header;
+		char space[CMSG_SPACE(sizeof(int))];
+	} control;
+	struct iovec iov = { (void *)response, sizeof(OWON_DAEMON_RESPONSE_st) };
+	struct msghdr message;
+	struct cmsghdr *cmsg;
+	ssize_t ret;
+
+	if (memfd < 0)
+		return owon_daemon_write_all(fd, response, sizeof(OWON_DAEMON_RESPONSE_st));
+
+	memset(&message, 0, sizeof(message));
+	memset(&control, 0, sizeof(control));
+	message.msg_iov = &iov;
+	message.msg_iovlen = 1;
+	message.msg_control = control.space;
+	message.msg_controllen = sizeof(control.space);
+	cmsg = CMSG_FIRSTHDR(&message);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &memfd, sizeof(int));
+
+	do {
+		ret = sendmsg(fd, &message, MSG_NOSIGNAL);
+	} while (ret < 0 && errno == EINTR);
+	// A stream socket takes a 24 bytes message whole
+	if (ret != sizeof(OWON_DAEMON_RESPONSE_st))
+		return OWON_ERROR;
+	return OWON_SUCCESS;
+}
+
+int owon_daemon_recv_response(int fd, OWON_DAEMON_RESPONSE_st *response, int *memfd)
+{
+	union {
+		struct cmsghdr header;
+		char space[CMSG_SPACE(sizeof(int))];
+	} control;
+	struct iovec iov = { response, sizeof(OWON_DAEMON_RESPONSE_st) };
+	struct msghdr message;
+	struct cmsghdr *cmsg;
+	ssize_t ret;
+
+	*memfd = -1;
+	memset(&message, 0, sizeof(message));
+	message.msg_iov = &iov;
+	message.msg_iovlen = 1;
+	message.msg_control = control.space;
+	message.msg_controllen = sizeof(control.space);
+
+	do {
+		ret = recvmsg(fd, &message, MSG_CMSG_CLOEXEC);
+	} while (ret < 0 && errno == EINTR);
+	if (ret <= 0)
+		return OWON_ERROR_READ;
+
+	for (cmsg = CMSG_FIRSTHDR(&message); cmsg != NULL; cmsg = CMSG_NXTHDR(&message, cmsg))
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+			memcpy(memfd, CMSG_DATA(cmsg), sizeof(int));
+
+	// The rest of the header without ancillary data
+	if ((size_t) ret < sizeof(OWON_DAEMON_RESPONSE_st) &&
+	    owon_daemon_read_all(fd, (char *)response + ret, sizeof(OWON_DAEMON_RESPONSE_st) - ret) != 0)
+		goto error;
+	if (response->magic != OWON_DAEMON_MAGIC)
+		goto error;
+	return OWON_SUCCESS;
+
+error:
+	if (*memfd >= 0)
+		close(*memfd);
+	*memfd = -1;
+	return OWON_ERROR_READ;
+}
+
+int owon_daemon_socket_path(char *path, size_t size)
+{
+	const char *dir = getenv("XDG_RUNTIME_DIR");
+	int len;
+
+	if (dir == NULL || dir[0] != '/')
+		dir = OWON_DAEMON_DIR;
+	len = snprintf(path, size, "%s/%s", dir, OWON_DAEMON_SOCKET_NAME);
+	return len < 0 || (size_t) len >= size ? OWON_ERROR : OWON_SUCCESS;
+}
+
+int owon_daemon_connect(const char *path)
+{
+	struct sockaddr_un address;
+	char default_path[sizeof(address.sun_path)];
+	int fd;
+
+	if (path == NULL) {
+		if (owon_daemon_socket_path(default_path, sizeof(default_path)) != OWON_SUCCESS)
+			return OWON_ERROR;
+		path = default_path;
+	}
+	if (strlen(path) >= sizeof(address.sun_path))
+		return OWON_ERROR;
+
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return OWON_ERROR;
+	if (connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0) {
+		close(fd);
+		return OWON_ERROR;
+	}
+	return fd;
+}
+
+static int send_request(int fd, int device, const char *serial,
+			enum owon_start_command_type type, enum owon_output_type output)
+{
+	OWON_DAEMON_REQUEST_st request;
+
+	memset(&request, 0, sizeof(request));
+	request.magic = OWON_DAEMON_MAGIC;
+	request.command = type;
+	request.output = output;
+	request.device = device;
+	if (serial != NULL)
+		snprintf(request.serial, sizeof(request.serial), "%s", serial);
+	return owon_daemon_write_all(fd, &request, sizeof(request));
+}
+
+long owon_daemon_capture(int fd, int device, const char *serial,
+			 enum owon_start_command_type type, unsigned char **buffer)
+{
+	OWON_DAEMON_RESPONSE_st response;
+	int memfd;
+
+	if (send_request(fd, device, serial, type, DUMP_OUTPUT_RAW) != 0 ||
+	    owon_daemon_recv_response(fd, &response, &memfd) != 0)
+		return OWON_ERROR_READ;
+	if (memfd >= 0)
+		close(memfd);
+	if (response.status < 0)
+		return response.status;
+
+	*buffer = malloc(response.length ? response.length : 1);
+	if (*buffer == NULL)
+		return OWON_ERROR_MEMORY;
+	if (owon_daemon_read_all(fd, *buffer, response.length) != 0) {
+		free(*buffer);
+		*buffer = NULL;
+		return OWON_ERROR_READ;
+	}
+	return response.length;
+}
+
+int owon_daemon_capture_columnar(int fd, int device, const char *serial,
+				 enum owon_start_command_type type, COLUMNAR_st *col)
+{
+	OWON_DAEMON_RESPONSE_st response;
+	struct stat stbuf;
+	void *data;
+	int memfd, seals, ret;
+
+	if (send_request(fd, device, serial, type, DUMP_OUTPUT_COLUMNAR) != 0 ||
+	    owon_daemon_recv_response(fd, &response, &memfd) != 0)
+		return OWON_ERROR_READ;
+	if (response.status < 0) {
+		if (memfd >= 0)
+			close(memfd);
+		return response.status;
+	}
+	if (memfd < 0 || response.length == 0) {
+		if (memfd >= 0)
+			close(memfd);
+		return OWON_ERROR_READ;
+	}
+
+	// Mapping past the end, or a file that shrinks under us, would SIGBUS
+	seals = fcntl(memfd, F_GET_SEALS);
+	if (fstat(memfd, &stbuf) != 0 || (uint64_t) stbuf.st_size < response.length ||
+	    response.length > SIZE_MAX || seals < 0 ||
+	    (seals & (F_SEAL_SHRINK | F_SEAL_WRITE)) != (F_SEAL_SHRINK | F_SEAL_WRITE)) {
+		close(memfd);
+		return OWON_ERROR_READ;
+	}
+
+	data = mmap(NULL, response.length, PROT_READ, MAP_SHARED, memfd, 0);
+	close(memfd);
+	if (data == MAP_FAILED)
+		return OWON_ERROR_MEMORY;
+
+	ret = owon_columnar_from_buffer(data, response.length, col);
+	if (ret < 0) {
+		munmap(data, response.length);
+		return ret;
+	}
+	col->mapped = 1;
+	return OWON_SUCCESS;
+}
@@ -0,0 +1,77 @@
+/*
+ * daemon - protocol of the owon-daemon acquisition server
+ * Copyright (c) 2014 Jonathan Bisson <bjonnh-owon@bjonnh.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef _DAEMON_H_
+#define _DAEMON_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include "usb.h"
+#include "columnar.h"
+
+// owon-daemon keeps the devices open and serves captures on a Unix stream
+// socket. A connection carries any number of exchanges, each one is a
+// request followed by a response, both in host byte order:
+//
+//   OWON_DAEMON_REQUEST_st   from the client
+//   OWON_DAEMON_RESPONSE_st  from the daemon
+//   length bytes             the capture, for DUMP_OUTPUT_RAW
+//
+// For DUMP_OUTPUT_COLUMNAR nothing follows the response: it carries a
+// sealed memfd of length bytes holding the capture in the columnar format
+// (columnar.h), ready to be mapped.
+
+// The socket is $XDG_RUNTIME_DIR/owon-daemon.sock, private to the user, or
+// /run/owon/owon-daemon.sock for a daemon shared by a group
+#define OWON_DAEMON_SOCKET_NAME "owon-daemon.sock"
+#define OWON_DAEMON_DIR "/run/owon"
+#define OWON_DAEMON_MAGIC 0x4e4f574f // "OWON"
+
+typedef struct {
+	uint32_t magic;
+	uint32_t command;   // enum owon_start_command_type
+	uint32_t output;    // DUMP_OUTPUT_RAW or DUMP_OUTPUT_COLUMNAR
+	int32_t device;     // index of the device, used when serial is empty
+	char serial[OWON_USB_SERIAL_LENGTH];
+} OWON_DAEMON_REQUEST_st;
+
+typedef struct {
+	uint32_t magic;
+	int32_t status;     // OWON_SUCCESS or an OWON_ERROR_* code
+	uint64_t length;
+} OWON_DAEMON_RESPONSE_st;
+
+// Transport, shared by the daemon and the clients
+int owon_daemon_read_all(int fd, void *buf, size_t len);
+int owon_daemon_write_all(int fd, const void *buf, size_t len);
+int owon_daemon_send_response(int fd, const OWON_DAEMON_RESPONSE_st *response, int memfd);
+int owon_daemon_recv_response(int fd, OWON_DAEMON_RESPONSE_st *response, int *memfd);
+
+// Default path of the socket into path, of size bytes
+int owon_daemon_socket_path(char *path, size_t size);
+
+// Client, path is NULL for the default socket
+int owon_daemon_connect(const char *path);
+// Returns the capture length and sets buffer, to be freed, or an error
+long owon_daemon_capture(int fd, int device, const char *serial,
+			 enum owon_start_command_type type, unsigned char **buffer);
+// Maps the capture, released with owon_columnar_close
+int owon_daemon_capture_columnar(int fd, int device, const char *serial,
+				 enum owon_start_command_type type, COLUMNAR_st *col);
+
+#endif
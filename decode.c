@@ -0,0 +1,390 @@
+/*
+ * decode - bulk conversion of raw samples into volts
+ * Copyright (c) 2014 Jonathan Bisson <bjonnh-owon@bjonnh.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include "decode.h"
+#include "owon.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define DECODE_X86
+#include <immintrin.h>
+#endif
+
+static inline int16_t load_s16(const unsigned char *p)
+{
+	return (int16_t)(p[1] << 8 | p[0]);
+}
+
+// Scalar versions, also used for the tails of the vector ones
+
+static void decode_s8_f32_scalar(const unsigned char *src, size_t count, double scale, float *dst)
+{
+	size_t i;
+	for (i = 0; i < count; i++)
+		dst[i] = (int8_t) src[i] * scale;
+}
+
+static void decode_s16_f32_scalar(const unsigned char *src, size_t count, double scale, float *dst)
+{
+	size_t i;
+	for (i = 0; i < count; i++)
+		dst[i] = load_s16(src + 2 * i) * scale;
+}
+
+static void decode_s8_f64_scalar(const unsigned char *src, size_t count, double scale, double *dst)
+{
+	size_t i;
+	for (i = 0; i < count; i++)
+		dst[i] = (int8_t) src[i] * scale;
+}
+
+static void decode_s16_f64_scalar(const unsigned char *src, size_t count, double scale, double *dst)
+{
+	size_t i;
+	for (i = 0; i < count; i++)
+		dst[i] = load_s16(src + 2 * i) * scale;
+}
+
+#ifdef DECODE_X86
+
+// SSE2: widen to int32 with unpack + arithmetic shift, 2 doubles at a time
+
+__attribute__((target("sse2")))
+static inline void sse2_store_f32(__m128i v, __m128d scale, float *dst)
+{
+	__m128d lo = _mm_mul_pd(_mm_cvtepi32_pd(v), scale);
+	__m128d hi = _mm_mul_pd(_mm_cvtepi32_pd(_mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2))), scale);
+	_mm_storeu_ps(dst, _mm_movelh_ps(_mm_cvtpd_ps(lo), _mm_cvtpd_ps(hi)));
+}
+
+__attribute__((target("sse2")))
+static inline void sse2_store_f64(__m128i v, __m128d scale, double *dst)
+{
+	_mm_storeu_pd(dst, _mm_mul_pd(_mm_cvtepi32_pd(v), scale));
+	_mm_storeu_pd(dst + 2, _mm_mul_pd(_mm_cvtepi32_pd(_mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2))), scale));
+}
+
+__attribute__((target("sse2")))
+static void decode_s8_f32_sse2(const unsigned char *src, size_t count, double scale, float *dst)
+{
+	__m128d s = _mm_set1_pd(scale);
+	size_t i;
+
+	for (i = 0; i + 16 <= count; i += 16) {
+		__m128i b = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i w0 = _mm_srai_epi16(_mm_unpacklo_epi8(b, b), 8);
+		__m128i w1 = _mm_srai_epi16(_mm_unpackhi_epi8(b, b), 8);
+		sse2_store_f32(_mm_srai_epi32(_mm_unpacklo_epi16(w0, w0), 16), s, dst + i);
+		sse2_store_f32(_mm_srai_epi32(_mm_unpackhi_epi16(w0, w0), 16), s, dst + i + 4);
+		sse2_store_f32(_mm_srai_epi32(_mm_unpacklo_epi16(w1, w1), 16), s, dst + i + 8);
+		sse2_store_f32(_mm_srai_epi32(_mm_unpackhi_epi16(w1, w1), 16), s, dst + i + 12);
+	}
+	decode_s8_f32_scalar(src + i, count - i, scale, dst + i);
+}
+
+__attribute__((target("sse2")))
+static void decode_s16_f32_sse2(const unsigned char *src, size_t count, double scale, float *dst)
+{
+	__m128d s = _mm_set1_pd(scale);
+	size_t i;
+
+	for (i = 0; i + 8 <= count; i += 8) {
+		__m128i w = _mm_loadu_si128((const __m128i *)(src + 2 * i));
+		sse2_store_f32(_mm_srai_epi32(_mm_unpacklo_epi16(w, w), 16), s, dst + i);
+		sse2_store_f32(_mm_srai_epi32(_mm_unpackhi_epi16(w, w), 16), s, dst + i + 4);
+	}
+	decode_s16_f32_scalar(src + 2 * i, count - i, scale, dst + i);
+}
+
+__attribute__((target("sse2")))
+static void decode_s8_f64_sse2(const unsigned char *src, size_t count, double scale, double *dst)
+{
+	__m128d s = _mm_set1_pd(scale);
+	size_t i;
+
+	for (i = 0; i + 16 <= count; i += 16) {
+		__m128i b = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i w0 = _mm_srai_epi16(_mm_unpacklo_epi8(b, b), 8);
+		__m128i w1 = _mm_srai_epi16(_mm_unpackhi_epi8(b, b), 8);
+		sse2_store_f64(_mm_srai_epi32(_mm_unpacklo_epi16(w0, w0), 16), s, dst + i);
+		sse2_store_f64(_mm_srai_epi32(_mm_unpackhi_epi16(w0, w0), 16), s, dst + i + 4);
+		sse2_store_f64(_mm_srai_epi32(_mm_unpacklo_epi16(w1, w1), 16), s, dst + i + 8);
+		sse2_store_f64(_mm_srai_epi32(_mm_unpackhi_epi16(w1, w1), 16), s, dst + i + 12);
+	}
+	decode_s8_f64_scalar(src + i, count - i, scale, dst + i);
+}
+
+__attribute__((target("sse2")))
+static void decode_s16_f64_sse2(const unsigned char *src, size_t count, double scale, double *dst)
+{
+	__m128d s = _mm_set1_pd(scale);
+	size_t i;
+
+	for (i = 0; i + 8 <= count; i += 8) {
+		__m128i w = _mm_loadu_si128((const __m128i *)(src + 2 * i));
+		sse2_store_f64(_mm_srai_epi32(_mm_unpacklo_epi16(w, w), 16), s, dst + i);
+		sse2_store_f64(_mm_srai_epi32(_mm_unpackhi_epi16(w, w), 16), s, dst + i + 4);
+	}
+	decode_s16_f64_scalar(src + 2 * i, count - i, scale, dst + i);
+}
+
+// AVX2: sign extension instructions, 4 doubles at a time
+
+__attribute__((target("avx2")))
+static inline void avx2_store_f32(__m256i v, __m256d scale, float *dst)
+{
+	__m256d lo = _mm256_mul_pd(_mm256_cvtepi32_pd(_mm256_castsi256_si128(v)), scale);
+	__m256d hi = _mm256_mul_pd(_mm256_cvtepi32_pd(_mm256_extracti128_si256(v, 1)), scale);
+	_mm_storeu_ps(dst, _mm256_cvtpd_ps(lo));
+	_mm_storeu_ps(dst + 4, _mm256_cvtpd_ps(hi));
+}
+
+__attribute__((target("avx2")))
+static inline void avx2_store_f64(__m256i v, __m256d scale, double *dst)
+{
+	_mm256_storeu_pd(dst, _mm256_mul_pd(_mm256_cvtepi32_pd(_mm256_castsi256_si128(v)), scale));
+	_mm256_storeu_pd(dst + 4, _mm256_mul_pd(_mm256_cvtepi32_pd(_mm256_extracti128_si256(v, 1)), scale));
+}
+
+__attribute__((target("avx2")))
+static void decode_s8_f32_avx2(const unsigned char *src, size_t count, double scale, float *dst)
+{
+	__m256d s = _mm256_set1_pd(scale);
+	size_t i;
+
+	for (i = 0; i + 16 <= count; i += 16) {
+		__m128i b = _mm_loadu_si128((const __m128i *)(src + i));
+		avx2_store_f32(_mm256_cvtepi8_epi32(b), s, dst + i);
+		avx2_store_f32(_mm256_cvtepi8_epi32(_mm_srli_si128(b, 8)), s, dst + i + 8);
+	}
+	decode_s8_f32_scalar(src + i, count - i, scale, dst + i);
+}
+
+__attribute__((target("avx2")))
+static void decode_s16_f32_avx2(const unsigned char *src, size_t count, double scale, float *dst)
+{
+	__m256d s = _mm256_set1_pd(scale);
+	size_t i;
+
+	for (i = 0; i + 16 <= count; i += 16) {
+		__m256i w = _mm256_loadu_si256((const __m256i *)(src + 2 * i));
+		avx2_store_f32(_mm256_cvtepi16_epi32(_mm256_castsi256_si128(w)), s, dst + i);
+		avx2_store_f32(_mm256_cvtepi16_epi32(_mm256_extracti128_si256(w, 1)), s, dst + i + 8);
+	}
+	decode_s16_f32_scalar(src + 2 * i, count - i, scale, dst + i);
+}
+
+__attribute__((target("avx2")))
+static void decode_s8_f64_avx2(const unsigned char *src, size_t count, double scale, double *dst)
+{
+	__m256d s = _mm256_set1_pd(scale);
+	size_t i;
+
+	for (i = 0; i + 16 <= count; i += 16) {
+		__m128i b = _mm_loadu_si128((const __m128i *)(src + i));
+		avx2_store_f64(_mm256_cvtepi8_epi32(b), s, dst + i);
+		avx2_store_f64(_mm256_cvtepi8_epi32(_mm_srli_si128(b, 8)), s, dst + i + 8);
+	}
+	decode_s8_f64_scalar(src + i, count - i, scale, dst + i);
+}
+
+__attribute__((target("avx2")))
+static void decode_s16_f64_avx2(const unsigned char *src, size_t count, double scale, double *dst)
+{
+	__m256d s = _mm256_set1_pd(scale);
+	size_t i;
+
+	for (i = 0; i + 16 <= count; i += 16) {
+		__m256i w = _mm256_loadu_si256((const __m256i *)(src + 2 * i));
+		avx2_store_f64(_mm256_cvtepi16_epi32(_mm256_castsi256_si128(w)), s, dst + i);
+		avx2_store_f64(_mm256_cvtepi16_epi32(_mm256_extracti128_si256(w, 1)), s, dst + i + 8);
+	}
+	decode_s16_f64_scalar(src + 2 * i, count - i, scale, dst + i);
+}
+
+#endif
+
+// Runtime selection
+
+static int cpu_level = OWON_CPU_SCALAR;
+static pthread_once_t cpu_once = PTHREAD_ONCE_INIT;
+
+static void detect_cpu(void)
+{
+#ifdef DECODE_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		cpu_level = OWON_CPU_AVX2;
+	else if (__builtin_cpu_supports("sse2"))
+		cpu_level = OWON_CPU_SSE2;
+#endif
+}
+
+int owon_cpu_level(void)
+{
+	pthread_once(&cpu_once, detect_cpu);
+	return cpu_level;
+}
+
+const char *owon_cpu_level_name(int level)
+{
+	static const char *names[] = { "scalar", "sse2", "avx2" };
+
+	if (level < OWON_CPU_SCALAR || level > OWON_CPU_AVX2)
+		return "unknown";
+	return names[level];
+}
+
+struct decode_kernels {
+	void (*s8_f32)(const unsigned char *, size_t, double, float *);
+	void (*s16_f32)(const unsigned char *, size_t, double, float *);
+	void (*s8_f64)(const unsigned char *, size_t, double, double *);
+	void (*s16_f64)(const unsigned char *, size_t, double, double *);
+};
+
+// Indexed by owon_cpu_level
+static const struct decode_kernels implementations[] = {
+	{ decode_s8_f32_scalar, decode_s16_f32_scalar,
+	  decode_s8_f64_scalar, decode_s16_f64_scalar },
+#ifdef DECODE_X86
+	{ decode_s8_f32_sse2, decode_s16_f32_sse2,
+	  decode_s8_f64_sse2, decode_s16_f64_sse2 },
+	{ decode_s8_f32_avx2, decode_s16_f32_avx2,
+	  decode_s8_f64_avx2, decode_s16_f64_avx2 },
+#endif
+};
+
+static const struct decode_kernels *kernels = &implementations[OWON_CPU_SCALAR];
+static pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+
+static void select_kernels(void)
+{
+	kernels = &implementations[owon_cpu_level()];
+}
+
+void owon_decode_s8_f32(const unsigned char *src, size_t count, double scale, float *dst)
+{
+	pthread_once(&kernels_once, select_kernels);
+	kernels->s8_f32(src, count, scale, dst);
+}
+
+void owon_decode_s16_f32(const unsigned char *src, size_t count, double scale, float *dst)
+{
+	pthread_once(&kernels_once, select_kernels);
+	kernels->s16_f32(src, count, scale, dst);
+}
+
+void owon_decode_s8_f64(const unsigned char *src, size_t count, double scale, double *dst)
+{
+	pthread_once(&kernels_once, select_kernels);
+	kernels->s8_f64(src, count, scale, dst);
+}
+
+void owon_decode_s16_f64(const unsigned char *src, size_t count, double scale, double *dst)
+{
+	pthread_once(&kernels_once, select_kernels);
+	kernels->s16_f64(src, count, scale, dst);
+}
+
+const char *owon_decode_implementation(void)
+{
+	pthread_once(&kernels_once, select_kernels);
+	return owon_cpu_level_name(kernels - implementations);
+}
+
+// Self-check
+
+#define DECODE_CHECK_SAMPLES 300
+#define DECODE_CHECK_OFFSETS 32
+
+// The outputs start filled alike, so a kernel writing past count differs too
+static int check_f32(void (*reference)(const unsigned char *, size_t, double, float *),
+		     void (*tested)(const unsigned char *, size_t, double, float *),
+		     const unsigned char *src, size_t count, size_t shift)
+{
+	float expected[DECODE_CHECK_SAMPLES + DECODE_CHECK_OFFSETS];
+	float result[DECODE_CHECK_SAMPLES + DECODE_CHECK_OFFSETS];
+	size_t i;
+
+	for (i = 0; i < DECODE_CHECK_SAMPLES + DECODE_CHECK_OFFSETS; i++)
+		expected[i] = result[i] = -1.0e30f;
+	reference(src, count, 0.0390625 / 3.0, expected + shift);
+	tested(src, count, 0.0390625 / 3.0, result + shift);
+	return memcmp(expected, result, sizeof(result)) == 0;
+}
+
+static int check_f64(void (*reference)(const unsigned char *, size_t, double, double *),
+		     void (*tested)(const unsigned char *, size_t, double, double *),
+		     const unsigned char *src, size_t count, size_t shift)
+{
+	double expected[DECODE_CHECK_SAMPLES + DECODE_CHECK_OFFSETS];
+	double result[DECODE_CHECK_SAMPLES + DECODE_CHECK_OFFSETS];
+	size_t i;
+
+	for (i = 0; i < DECODE_CHECK_SAMPLES + DECODE_CHECK_OFFSETS; i++)
+		expected[i] = result[i] = -1.0e300;
+	reference(src, count, 0.0390625 / 3.0, expected + shift);
+	tested(src, count, 0.0390625 / 3.0, result + shift);
+	return memcmp(expected, result, sizeof(result)) == 0;
+}
+
+int owon_decode_check(void)
+{
+	const struct decode_kernels *scalar = &implementations[OWON_CPU_SCALAR], *tested;
+	unsigned char src[2 * DECODE_CHECK_SAMPLES + DECODE_CHECK_OFFSETS];
+	const char *kernel = NULL;
+	uint32_t seed = 1;
+	size_t offset, count, i;
+	int level, best = owon_cpu_level();
+
+	// Random samples, with the extremes of both sample sizes
+	for (i = 0; i < sizeof(src); i++) {
+		seed = seed * 1103515245 + 12345;
+		src[i] = seed >> 16;
+	}
+	src[7] = 0x80;
+	src[8] = 0x7f;
+	src[9] = 0x00;
+	src[10] = 0x80;
+
+	for (level = OWON_CPU_SCALAR + 1; level <= best; level++) {
+		tested = &implementations[level];
+		for (offset = 0; offset < DECODE_CHECK_OFFSETS; offset++) {
+			for (count = 0; count <= DECODE_CHECK_SAMPLES; count++) {
+				if (!check_f32(scalar->s8_f32, tested->s8_f32, src + offset, count, offset))
+					kernel = "s8_f32";
+				else if (!check_f32(scalar->s16_f32, tested->s16_f32, src + offset, count, offset))
+					kernel = "s16_f32";
+				else if (!check_f64(scalar->s8_f64, tested->s8_f64, src + offset, count, offset))
+					kernel = "s8_f64";
+				else if (!check_f64(scalar->s16_f64, tested->s16_f64, src + offset, count, offset))
+					kernel = "s16_f64";
+				if (kernel != NULL) {
+					fprintf(stderr, "Error: the %s %s kernel differs from the scalar one"
+						" (%zu samples at offset %zu)\n", owon_cpu_level_name(level), kernel,
+						count, offset);
+					return OWON_ERROR;
+				}
+			}
+		}
+	}
+	return best + 1;
+}
@@ -0,0 +1,57 @@
+/*
+ * decode - bulk conversion of raw samples into volts
+ * Copyright (c) 2014 Jonathan Bisson <bjonnh-owon@bjonnh.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef _DECODE_H_
+#define _DECODE_H_
+
+#include <stddef.h>
+
+// Instruction sets the kernels of the library come in. decode, measure and
+// trigger each keep a table of their kernels indexed by this level and
+// pick the entry of owon_cpu_level() once.
+enum owon_cpu_level {
+	OWON_CPU_SCALAR = 0,
+	OWON_CPU_SSE2,
+	OWON_CPU_AVX2
+};
+
+// Best level the CPU runs, detected at the first call. Always
+// OWON_CPU_SCALAR when the library isn't built for x86.
+int owon_cpu_level(void);
+// "scalar", "sse2" or "avx2"
+const char *owon_cpu_level_name(int level);
+
+// Each kernel converts count samples from src (int8_t, or unaligned
+// little-endian int16_t) into sample * scale. The product is computed in
+// double precision for every variant, so the float kernels give the same
+// result as rounding the double one.
+// SSE2 or AVX2 versions are picked at first use from owon_cpu_level().
+
+void owon_decode_s8_f32(const unsigned char *src, size_t count, double scale, float *dst);
+void owon_decode_s16_f32(const unsigned char *src, size_t count, double scale, float *dst);
+void owon_decode_s8_f64(const unsigned char *src, size_t count, double scale, double *dst);
+void owon_decode_s16_f64(const unsigned char *src, size_t count, double scale, double *dst);
+
+// Name of the selected implementation ("scalar", "sse2" or "avx2")
+const char *owon_decode_implementation(void);
+// Runs every implementation the CPU has on unaligned samples and outputs
+// and on every tail length, and compares them to the scalar one. Returns
+// how many were run, scalar included, or OWON_ERROR when one differs.
+int owon_decode_check(void);
+
+#endif
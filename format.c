@@ -0,0 +1,154 @@
+/*
+ * format - buffered text output
+ * Copyright (c) 2014 Jonathan Bisson <bjonnh-owon@bjonnh.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <math.h>
+#include "format.h"
+#include "owon.h"
+
+static const double _power10_table[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12
+};
+
+static const uint64_t _power10_int_table[] = {
+	1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL, 10000000ULL,
+	100000000ULL, 1000000000ULL, 10000000000ULL, 100000000000ULL, 1000000000000ULL
+};
+
+int owon_outbuf_init(OUTBUF_st *out, FILE *file, size_t size)
+{
+	out->buf = malloc(size);
+	out->len = 0;
+	out->size = out->buf != NULL ? size : 0;
+	out->file = file;
+	out->error = out->buf != NULL ? 0 : OWON_ERROR_MEMORY;
+	return out->error;
+}
+
+int owon_outbuf_flush(OUTBUF_st *out)
+{
+	if (out->file != NULL && out->len > 0) {
+		if (fwrite(out->buf, 1, out->len, out->file) != out->len)
+			out->error = OWON_ERROR;
+		out->len = 0;
+	}
+	return out->error;
+}
+
+int owon_outbuf_reserve(OUTBUF_st *out, size_t len)
+{
+	char *buf;
+	size_t size;
+
+	if (out->error)
+		return out->error;
+	if (out->len + len <= out->size)
+		return 0;
+
+	if (out->file != NULL) {
+		owon_outbuf_flush(out);
+		if (len <= out->size)
+			return out->error;
+	}
+
+	size = out->size ? out->size : OWON_OUTBUF_SIZE;
+	while (size < out->len + len)
+		size *= 2;
+	buf = realloc(out->buf, size);
+	if (buf == NULL) {
+		out->error = OWON_ERROR_MEMORY;
+		return out->error;
+	}
+	out->buf = buf;
+	out->size = size;
+	return 0;
+}
+
+void owon_outbuf_free(OUTBUF_st *out)
+{
+	free(out->buf);
+	out->buf = NULL;
+	out->len = out->size = 0;
+}
+
+// Fixed notation without printf.
+// A float promoted to double has a 24 bits significand, and 10^p is 5^p * 2^p
+// with 5^12 < 2^28, so for such values value * 10^p is computed exactly and
+// rounding it with the current rounding mode gives exactly what printf prints.
+// Anything else goes through snprintf.
+
+size_t owon_format_fixed(char *destination, size_t size, double value, int precision)
+{
+	char digits[24];
+	double scaled;
+	uint64_t rounded, integer, fraction;
+	size_t len = 0, n = 0;
+	int i;
+
+	if (size < OWON_FORMAT_FIXED_MAX || precision < 0 ||
+	    precision >= (int)(sizeof(_power10_table) / sizeof(*_power10_table)) ||
+	    !isfinite(value) || (double)(float)value != value)
+		return snprintf(destination, size, "%.*f", precision, value);
+
+	scaled = fabs(value) * _power10_table[precision];
+	if (scaled >= 1e18)
+		return snprintf(destination, size, "%.*f", precision, value);
+
+	rounded = (uint64_t) llrint(scaled);
+	integer = rounded / _power10_int_table[precision];
+	fraction = rounded % _power10_int_table[precision];
+
+	if (signbit(value))
+		destination[len++] = '-';
+
+	do {
+		digits[n++] = '0' + integer % 10;
+		integer /= 10;
+	} while (integer);
+	while (n)
+		destination[len++] = digits[--n];
+
+	if (precision > 0) {
+		destination[len++] = '.';
+		for (i = precision - 1; i >= 0; i--) {
+			destination[len + i] = '0' + fraction % 10;
+			fraction /= 10;
+		}
+		len += precision;
+	}
+	destination[len] = 0;
+	return len;
+}
+
+void owon_outbuf_fixed(OUTBUF_st *out, double value, int precision)
+{
+	size_t len;
+
+	if (out->len + OWON_FORMAT_FIXED_MAX > out->size &&
+	    owon_outbuf_reserve(out, OWON_FORMAT_FIXED_MAX) != 0)
+		return;
+	len = owon_format_fixed(out->buf + out->len, out->size - out->len, value, precision);
+	if (len >= out->size - out->len) {
+		// Huge value, snprintf was cut short
+		if (owon_outbuf_reserve(out, len + 1) != 0)
+			return;
+		len = owon_format_fixed(out->buf + out->len, out->size - out->len, value, precision);
+	}
+	out->len += len;
+}
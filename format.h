@@ -0,0 +1,66 @@
+/*
+ * format - buffered text output
+ * Copyright (c) 2014 Jonathan Bisson <bjonnh-owon@bjonnh.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef _FORMAT_H_
+#define _FORMAT_H_
+
+#include <stdio.h>
+#include <string.h>
+
+#define OWON_OUTBUF_SIZE (1 << 20)
+// Room owon_format_fixed needs to use its fast path
+#define OWON_FORMAT_FIXED_MAX 40
+
+// Output buffer, flushed to file in large writes.
+// Without a file it only grows and keeps everything in memory.
+typedef struct {
+  char *buf;
+  size_t len;
+  size_t size;
+  FILE *file;
+  int error;
+} OUTBUF_st;
+
+int owon_outbuf_init(OUTBUF_st *out, FILE *file, size_t size);
+// Make room for len more bytes, flushing or growing the buffer
+int owon_outbuf_reserve(OUTBUF_st *out, size_t len);
+int owon_outbuf_flush(OUTBUF_st *out);
+void owon_outbuf_free(OUTBUF_st *out);
+
+// Same text and return value as snprintf(destination, size, "%.*f", precision, value)
+size_t owon_format_fixed(char *destination, size_t size, double value, int precision);
+
+static inline void owon_outbuf_char(OUTBUF_st *out, char c)
+{
+	if (out->len + 1 > out->size && owon_outbuf_reserve(out, 1) != 0)
+		return;
+	out->buf[out->len++] = c;
+}
+
+static inline void owon_outbuf_string(OUTBUF_st *out, const char *string)
+{
+	size_t len = strlen(string);
+	if (out->len + len > out->size && owon_outbuf_reserve(out, len) != 0)
+		return;
+	memcpy(out->buf + out->len, string, len);
+	out->len += len;
+}
+
+void owon_outbuf_fixed(OUTBUF_st *out, double value, int precision);
+
+#endif
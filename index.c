@@ -0,0 +1,600 @@
+/*
+ * index - one row per capture, queried without parsing the captures
+ * Copyright (c) 2014 Jonathan Bisson <bjonnh-owon@bjonnh.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <math.h>
+#include <time.h>
+#include <fnmatch.h>
+#include "index.h"
+#include "owon.h"
+
+OWON_ON_DISK(INDEX_HEADER_st, 48);
+OWON_ON_DISK(INDEX_COLUMN_st, 40);
+
+#define CHANNEL_NAMES(n) "ch" #n ".timediv", "ch" #n ".voltsdiv", "ch" #n ".attenuation", \
+	"ch" #n ".frequency", "ch" #n ".period", "ch" #n ".samples", \
+	"ch" #n ".min", "ch" #n ".max", "ch" #n ".rms"
+
+static const char *const column_names[OWON_INDEX_COLUMNS] = {
+	"path", "serial", "model", "time", "size", "channels",
+	CHANNEL_NAMES(1), CHANNEL_NAMES(2), CHANNEL_NAMES(3), CHANNEL_NAMES(4)
+};
+
+const char *owon_index_column_name(int column)
+{
+	return column >= 0 && column < OWON_INDEX_COLUMNS ? column_names[column] : NULL;
+}
+
+int owon_index_column_type(int column)
+{
+	return column < OWON_INDEX_TIME ? OWON_INDEX_STRING : OWON_INDEX_NUMBER;
+}
+
+static uint64_t align_up(uint64_t offset)
+{
+	return (offset + OWON_INDEX_ALIGN - 1) & ~(uint64_t)(OWON_INDEX_ALIGN - 1);
+}
+
+static int write_padding(FILE *file, uint64_t from, uint64_t to)
+{
+	static const char zeros[OWON_INDEX_ALIGN];
+	if (to > from && fwrite(zeros, 1, to - from, file) != to - from)
+		return OWON_ERROR;
+	return OWON_SUCCESS;
+}
+
+// CH1 to CH4 keep their place when other channels are off
+static int channel_slot(const CHANNEL_st *channel, size_t position, unsigned int used)
+{
+	int slot = -1;
+
+	if ((channel->name[0] | 0x20) == 'c' && (channel->name[1] | 0x20) == 'h' &&
+	    channel->name[2] >= '1' && channel->name[2] < '1' + OWON_INDEX_CHANNELS_MAX &&
+	    channel->name[3] == 0)
+		slot = channel->name[2] - '1';
+	else if (position < OWON_INDEX_CHANNELS_MAX)
+		slot = position;
+	return slot >= 0 && !(used & 1u << slot) ? slot : -1;
+}
+
+void owon_index_describe(const HEADER_st *header, const OWON_MEASURE_st *measures,
+			 const char *path, double time, double size, OWON_INDEX_ROW_st *row)
+{
+	const CHANNEL_st *channel;
+	unsigned int used = 0;
+	double *values;
+	size_t i;
+	int slot;
+
+	for (i = 0; i < OWON_INDEX_COLUMNS; i++)
+		row->values[i] = NAN;
+	row->path = path;
+	snprintf(row->serial, sizeof(row->serial), "%.*s", (int) sizeof(header->serial), header->serial);
+	snprintf(row->model, sizeof(row->model), "%.*s", (int) sizeof(header->model), header->model);
+	row->values[OWON_INDEX_TIME] = time;
+	row->values[OWON_INDEX_SIZE] = size;
+	row->values[OWON_INDEX_CHANNELS] = header->channels_count;
+
+	for (i = 0; i < header->channels_count; i++) {
+		channel = header->channels[i];
+		slot = channel_slot(channel, i, used);
+		if (slot < 0)
+			continue;
+		used |= 1u << slot;
+		values = row->values + OWON_INDEX_CHANNEL + slot * OWON_INDEX_FIELDS;
+		values[OWON_INDEX_TIMEDIV] = channel->timediv;
+		values[OWON_INDEX_VOLTSDIV] = channel->voltsdiv;
+		values[OWON_INDEX_ATTENUATION] = channel->attenuation;
+		values[OWON_INDEX_FREQUENCY] = channel->frequency;
+		values[OWON_INDEX_PERIOD] = channel->period;
+		values[OWON_INDEX_SAMPLES] = channel->samples_file;
+		if (measures != NULL) {
+			values[OWON_INDEX_MIN] = measures[i].min;
+			values[OWON_INDEX_MAX] = measures[i].max;
+			values[OWON_INDEX_RMS] = measures[i].rms;
+		}
+	}
+}
+
+// Writer
+
+void owon_index_builder_init(OWON_INDEX_BUILDER_st *builder)
+{
+	memset(builder, 0, sizeof(OWON_INDEX_BUILDER_st));
+}
+
+static uint64_t hash_string(const char *string)
+{
+	uint64_t hash = 14695981039346656037ull;
+	for (; *string; string++)
+		hash = (hash ^ (unsigned char) *string) * 1099511628211ull;
+	return hash;
+}
+
+static int grow_slots(OWON_INDEX_BUILDER_st *builder)
+{
+	size_t count = builder->slots_count ? 2 * builder->slots_count : 1024, i, j;
+	uint64_t *slots = calloc(count, sizeof(uint64_t));
+
+	if (slots == NULL)
+		return OWON_ERROR_MEMORY;
+	for (i = 0; i < builder->slots_count; i++) {
+		if (builder->slots[i] == 0)
+			continue;
+		j = hash_string(builder->strings + builder->slots[i] - 1) & (count - 1);
+		while (slots[j] != 0)
+			j = (j + 1) & (count - 1);
+		slots[j] = builder->slots[i];
+	}
+	free(builder->slots);
+	builder->slots = slots;
+	builder->slots_count = count;
+	return OWON_SUCCESS;
+}
+
+// Offset of string in the strings, added when it isn't there yet
+static int intern(OWON_INDEX_BUILDER_st *builder, const char *string, uint64_t *offset)
+{
+	size_t len = strlen(string) + 1, size, i;
+	char *strings;
+
+	if (2 * (builder->slots_used + 1) > builder->slots_count && grow_slots(builder) != OWON_SUCCESS)
+		return OWON_ERROR_MEMORY;
+	for (i = hash_string(string) & (builder->slots_count - 1); builder->slots[i] != 0;
+	     i = (i + 1) & (builder->slots_count - 1)) {
+		if (strcmp(builder->strings + builder->slots[i] - 1, string) == 0) {
+			*offset = builder->slots[i] - 1;
+			return OWON_SUCCESS;
+		}
+	}
+
+	if (builder->strings_length + len > builder->strings_size) {
+		size = builder->strings_size ? 2 * builder->strings_size : 1 << 16;
+		while (size < builder->strings_length + len)
+			size *= 2;
+		strings = realloc(builder->strings, size);
+		if (strings == NULL)
+			return OWON_ERROR_MEMORY;
+		builder->strings = strings;
+		builder->strings_size = size;
+	}
+	memcpy(builder->strings + builder->strings_length, string, len);
+	*offset = builder->strings_length;
+	builder->strings_length += len;
+	builder->slots[i] = *offset + 1;
+	builder->slots_used++;
+	return OWON_SUCCESS;
+}
+
+static const char *row_string(const OWON_INDEX_ROW_st *row, int column)
+{
+	switch (column) {
+	case OWON_INDEX_PATH:
+		return row->path != NULL ? row->path : "";
+	case OWON_INDEX_SERIAL:
+		return row->serial;
+	default:
+		return row->model;
+	}
+}
+
+int owon_index_add(OWON_INDEX_BUILDER_st *builder, const OWON_INDEX_ROW_st *row)
+{
+	size_t size, column;
+	void *values;
+	int ret;
+
+	if (builder->rows == builder->size) {
+		size = builder->size ? 2 * builder->size : 1024;
+		// Both kinds of columns hold 8 bytes values
+		for (column = 0; column < OWON_INDEX_COLUMNS; column++) {
+			values = realloc(builder->columns[column], size * sizeof(double));
+			if (values == NULL)
+				return OWON_ERROR_MEMORY;
+			builder->columns[column] = values;
+		}
+		builder->size = size;
+	}
+
+	for (column = 0; column < OWON_INDEX_COLUMNS; column++) {
+		if (owon_index_column_type(column) == OWON_INDEX_STRING) {
+			ret = intern(builder, row_string(row, column),
+				     (uint64_t *) builder->columns[column] + builder->rows);
+			if (ret != OWON_SUCCESS)
+				return ret;
+		} else {
+			((double *) builder->columns[column])[builder->rows] = row->values[column];
+		}
+	}
+	builder->rows++;
+	return OWON_SUCCESS;
+}
+
+int owon_output_index(const OWON_INDEX_BUILDER_st *builder, FILE *file)
+{
+	INDEX_HEADER_st header;
+	INDEX_COLUMN_st records[OWON_INDEX_COLUMNS];
+	uint64_t offset, data_length = builder->rows * sizeof(double);
+	size_t column;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, OWON_INDEX_MAGIC, sizeof(OWON_INDEX_MAGIC));
+	header.version = OWON_INDEX_VERSION;
+	header.columns_count = OWON_INDEX_COLUMNS;
+	header.header_size = sizeof(INDEX_HEADER_st);
+	header.column_size = sizeof(INDEX_COLUMN_st);
+	header.rows = builder->rows;
+
+	memset(records, 0, sizeof(records));
+	offset = align_up(sizeof(INDEX_HEADER_st) + sizeof(records));
+	for (column = 0; column < OWON_INDEX_COLUMNS; column++) {
+		strncpy(records[column].name, column_names[column], sizeof(records[column].name) - 1);
+		records[column].type = owon_index_column_type(column);
+		records[column].data_offset = offset;
+		offset = align_up(offset + data_length);
+	}
+	header.strings_offset = offset;
+	header.strings_length = builder->strings_length;
+
+	if (fwrite(&header, sizeof(header), 1, file) != 1 ||
+	    fwrite(records, sizeof(records), 1, file) != 1 ||
+	    write_padding(file, sizeof(header) + sizeof(records), records[0].data_offset) != OWON_SUCCESS)
+		return OWON_ERROR;
+	for (column = 0; column < OWON_INDEX_COLUMNS; column++) {
+		if (builder->rows > 0 &&
+		    fwrite(builder->columns[column], sizeof(double), builder->rows, file) != builder->rows)
+			return OWON_ERROR;
+		offset = records[column].data_offset + data_length;
+		if (write_padding(file, offset, align_up(offset)) != OWON_SUCCESS)
+			return OWON_ERROR;
+	}
+	if (builder->strings_length > 0 &&
+	    fwrite(builder->strings, 1, builder->strings_length, file) != builder->strings_length)
+		return OWON_ERROR;
+	return OWON_SUCCESS;
+}
+
+void owon_index_builder_free(OWON_INDEX_BUILDER_st *builder)
+{
+	size_t column;
+
+	for (column = 0; column < OWON_INDEX_COLUMNS; column++)
+		free(builder->columns[column]);
+	free(builder->strings);
+	free(builder->slots);
+	memset(builder, 0, sizeof(OWON_INDEX_BUILDER_st));
+}
+
+// Reader
+
+int owon_index_from_buffer(const void *buf, size_t len, INDEX_st *index)
+{
+	const INDEX_HEADER_st *header = buf;
+	const INDEX_COLUMN_st *column;
+	const uint64_t *offsets;
+	size_t i, row;
+
+	memset(index, 0, sizeof(INDEX_st));
+	if (len < sizeof(INDEX_HEADER_st) ||
+	    memcmp(header->magic, OWON_INDEX_MAGIC, sizeof(OWON_INDEX_MAGIC)) != 0)
+		return OWON_ERROR_HEADER;
+	if (header->version != OWON_INDEX_VERSION)
+		return OWON_ERROR_UNSUPPORTED;
+	if (header->column_size < sizeof(INDEX_COLUMN_st) || header->column_size % 8 != 0 ||
+	    header->header_size < sizeof(INDEX_HEADER_st) || header->header_size % 8 != 0 ||
+	    header->header_size > len ||
+	    header->columns_count > (len - header->header_size) / header->column_size ||
+	    header->rows > UINT32_MAX || header->rows > len / sizeof(double) ||
+	    header->strings_offset > len || header->strings_length > len - header->strings_offset ||
+	    (header->strings_length > 0 &&
+	     ((const char *) buf)[header->strings_offset + header->strings_length - 1] != 0))
+		return OWON_ERROR_HEADER;
+
+	index->data = buf;
+	index->len = len;
+	index->header = header;
+
+	// The queries trust the columns and string offsets from here on
+	for (i = 0; i < header->columns_count; i++) {
+		column = owon_index_column(index, i);
+		if (memchr(column->name, 0, sizeof(column->name)) == NULL ||
+		    column->type > OWON_INDEX_STRING || column->data_offset % 8 != 0 ||
+		    column->data_offset > len ||
+		    header->rows > (len - column->data_offset) / sizeof(double))
+			goto invalid;
+		if (column->type != OWON_INDEX_STRING)
+			continue;
+		offsets = owon_index_offsets(index, i);
+		for (row = 0; row < header->rows; row++)
+			if (offsets[row] >= header->strings_length)
+				goto invalid;
+	}
+	return OWON_SUCCESS;
+
+invalid:
+	memset(index, 0, sizeof(INDEX_st));
+	return OWON_ERROR_HEADER;
+}
+
+int owon_index_open(const char *path, INDEX_st *index)
+{
+	MAP_st map;
+	int ret;
+
+	ret = owon_map_file(path, &map);
+	if (ret < 0)
+		return ret;
+	ret = owon_index_from_buffer(map.data, map.len, index);
+	if (ret < 0) {
+		owon_unmap_file(&map);
+		return ret;
+	}
+	index->mapped = 1;
+	return OWON_SUCCESS;
+}
+
+int owon_index_find(const INDEX_st *index, const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < index->header->columns_count; i++)
+		if (strcasecmp(owon_index_column(index, i)->name, name) == 0)
+			return i;
+	return -1;
+}
+
+const INDEX_COLUMN_st *owon_index_column(const INDEX_st *index, size_t column)
+{
+	if (column >= index->header->columns_count)
+		return NULL;
+	return (const INDEX_COLUMN_st *)(index->data + index->header->header_size +
+					 column * index->header->column_size);
+}
+
+const double *owon_index_numbers(const INDEX_st *index, size_t column)
+{
+	const INDEX_COLUMN_st *record = owon_index_column(index, column);
+	if (record == NULL || record->type != OWON_INDEX_NUMBER)
+		return NULL;
+	return (const double *)(index->data + record->data_offset);
+}
+
+const uint64_t *owon_index_offsets(const INDEX_st *index, size_t column)
+{
+	const INDEX_COLUMN_st *record = owon_index_column(index, column);
+	if (record == NULL || record->type != OWON_INDEX_STRING)
+		return NULL;
+	return (const uint64_t *)(index->data + record->data_offset);
+}
+
+const char *owon_index_string(const INDEX_st *index, uint64_t offset)
+{
+	if (offset >= index->header->strings_length)
+		return "";
+	return (const char *)(index->data + index->header->strings_offset + offset);
+}
+
+int owon_index_row(const INDEX_st *index, size_t row, OWON_INDEX_ROW_st *destination)
+{
+	const uint64_t *offsets;
+	const double *numbers;
+	int column, found;
+
+	if (row >= index->header->rows)
+		return OWON_ERROR;
+	memset(destination, 0, sizeof(OWON_INDEX_ROW_st));
+	destination->path = "";
+	for (column = 0; column < OWON_INDEX_COLUMNS; column++) {
+		destination->values[column] = NAN;
+		// Where this version writes it, else wherever it is
+		found = (size_t) column < index->header->columns_count &&
+			strcmp(owon_index_column(index, column)->name, column_names[column]) == 0 ?
+			column : owon_index_find(index, column_names[column]);
+		if (found < 0)
+			continue;
+		if (owon_index_column_type(column) == OWON_INDEX_NUMBER) {
+			numbers = owon_index_numbers(index, found);
+			if (numbers != NULL)
+				destination->values[column] = numbers[row];
+			continue;
+		}
+		offsets = owon_index_offsets(index, found);
+		if (offsets == NULL)
+			continue;
+		if (column == OWON_INDEX_PATH)
+			destination->path = owon_index_string(index, offsets[row]);
+		else if (column == OWON_INDEX_SERIAL)
+			snprintf(destination->serial, sizeof(destination->serial), "%s",
+				 owon_index_string(index, offsets[row]));
+		else
+			snprintf(destination->model, sizeof(destination->model), "%s",
+				 owon_index_string(index, offsets[row]));
+	}
+	return OWON_SUCCESS;
+}
+
+void owon_index_close(INDEX_st *index)
+{
+	if (index->mapped) {
+		MAP_st map = { index->data, index->len };
+		owon_unmap_file(&map);
+	}
+	memset(index, 0, sizeof(INDEX_st));
+}
+
+// Queries
+
+static const struct {
+	const char *text;
+	int op;
+} operators[] = {
+	// Longest first
+	{ "!=", OWON_INDEX_NE }, { "<=", OWON_INDEX_LE }, { ">=", OWON_INDEX_GE },
+	{ "==", OWON_INDEX_EQ }, { "=", OWON_INDEX_EQ }, { "<", OWON_INDEX_LT },
+	{ ">", OWON_INDEX_GT }, { "~", OWON_INDEX_MATCH }
+};
+
+static int parse_number(const char *text, int column_is_time, double *number)
+{
+	struct tm tm;
+	const char *end;
+	char *number_end;
+
+	if (column_is_time && strchr(text, '-') != NULL && text[0] != '-') {
+		memset(&tm, 0, sizeof(tm));
+		end = strptime(text, "%Y-%m-%dT%H:%M:%S", &tm);
+		if (end == NULL)
+			end = strptime(text, "%Y-%m-%d", &tm);
+		if (end == NULL || (*end != 0 && strcmp(end, "Z") != 0))
+			return OWON_ERROR;
+		*number = timegm(&tm);
+		return OWON_SUCCESS;
+	}
+	*number = strtod(text, &number_end);
+	return number_end != text && *number_end == 0 ? OWON_SUCCESS : OWON_ERROR;
+}
+
+int owon_index_condition(const INDEX_st *index, const char *text, OWON_INDEX_CONDITION_st *condition)
+{
+	char name[OWON_INDEX_NAME];
+	const char *position, *value;
+	size_t len, i;
+
+	len = strcspn(text, "!<>=~");
+	if (text[len] == 0 || len == 0 || len >= sizeof(name))
+		return OWON_ERROR;
+	memcpy(name, text, len);
+	name[len] = 0;
+	position = text + len;
+	for (i = 0; i < sizeof(operators) / sizeof(operators[0]); i++)
+		if (strncmp(position, operators[i].text, strlen(operators[i].text)) == 0)
+			break;
+	if (i == sizeof(operators) / sizeof(operators[0]))
+		return OWON_ERROR;
+	value = position + strlen(operators[i].text);
+
+	memset(condition, 0, sizeof(OWON_INDEX_CONDITION_st));
+	condition->column = owon_index_find(index, name);
+	condition->op = operators[i].op;
+	if (condition->column < 0)
+		return OWON_ERROR;
+	if (owon_index_column(index, condition->column)->type == OWON_INDEX_STRING) {
+		// Strings are equal or not, or match
+		if (condition->op != OWON_INDEX_EQ && condition->op != OWON_INDEX_NE &&
+		    condition->op != OWON_INDEX_MATCH)
+			return OWON_ERROR;
+		condition->text = value;
+		return OWON_SUCCESS;
+	}
+	if (condition->op == OWON_INDEX_MATCH)
+		return OWON_ERROR;
+	return parse_number(value, strcasecmp(name, "time") == 0, &condition->number);
+}
+
+// Keeps the rows whose value passes, a comparison with NaN never does
+#define FILTER(test) \
+	for (i = 0; i < count; i++) { \
+		row = rows[i]; \
+		value = numbers[row]; \
+		rows[kept] = row; \
+		kept += (test); \
+	}
+
+static size_t filter_numbers(const double *numbers, int op, double number, uint32_t *rows, size_t count)
+{
+	size_t i, kept = 0;
+	uint32_t row;
+	double value;
+
+	switch (op) {
+	case OWON_INDEX_EQ:
+		FILTER(value == number);
+		break;
+	case OWON_INDEX_NE:
+		FILTER(value < number || value > number);
+		break;
+	case OWON_INDEX_LT:
+		FILTER(value < number);
+		break;
+	case OWON_INDEX_LE:
+		FILTER(value <= number);
+		break;
+	case OWON_INDEX_GT:
+		FILTER(value > number);
+		break;
+	case OWON_INDEX_GE:
+		FILTER(value >= number);
+		break;
+	}
+	return kept;
+}
+
+static size_t filter_strings(const INDEX_st *index, const uint64_t *offsets, int op,
+			     const char *text, uint32_t *rows, size_t count)
+{
+	const char *strings = (const char *)(index->data + index->header->strings_offset);
+	uint64_t hit = UINT64_MAX, miss = UINT64_MAX;
+	size_t i, kept = 0;
+	uint32_t row;
+	int match;
+
+	for (i = 0; i < count; i++) {
+		row = rows[i];
+		// Many rows share their serial or model, their string is tested once
+		if (offsets[row] == hit) {
+			match = 1;
+		} else if (offsets[row] == miss) {
+			match = 0;
+		} else {
+			if (op == OWON_INDEX_MATCH)
+				match = fnmatch(text, strings + offsets[row], 0) == 0;
+			else
+				match = strcmp(text, strings + offsets[row]) == 0;
+			if (match)
+				hit = offsets[row];
+			else
+				miss = offsets[row];
+		}
+		rows[kept] = row;
+		kept += op == OWON_INDEX_NE ? !match : match;
+	}
+	return kept;
+}
+
+size_t owon_index_select(const INDEX_st *index, const OWON_INDEX_CONDITION_st *conditions,
+			 size_t count, uint32_t *rows)
+{
+	const OWON_INDEX_CONDITION_st *condition;
+	size_t selected = index->header->rows, i;
+
+	for (i = 0; i < selected; i++)
+		rows[i] = i;
+	for (i = 0; i < count && selected > 0; i++) {
+		condition = &conditions[i];
+		if (owon_index_column(index, condition->column)->type == OWON_INDEX_STRING)
+			selected = filter_strings(index, owon_index_offsets(index, condition->column),
+						  condition->op, condition->text, rows, selected);
+		else
+			selected = filter_numbers(owon_index_numbers(index, condition->column),
+						  condition->op, condition->number, rows, selected);
+	}
+	return selected;
+}
@@ -0,0 +1,179 @@
+/*
+ * index - one row per capture, queried without parsing the captures
+ * Copyright (c) 2014 Jonathan Bisson <bjonnh-owon@bjonnh.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef _INDEX_H_
+#define _INDEX_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include "parse.h"
+#include "measure.h"
+
+// File layout, in host byte order (see owon.h):
+//
+//   INDEX_HEADER_st        48 bytes at offset 0
+//   INDEX_COLUMN_st        column_size bytes per column, right after
+//   columns                rows values per column, at data_offset which is
+//                          a multiple of OWON_INDEX_ALIGN
+//   strings                NUL terminated, each stored once
+//
+// Numeric columns are doubles, NaN where there is no value (a channel that
+// isn't in the capture, measures that weren't computed). String columns
+// hold uint64_t offsets in the strings.
+// A query scans only the columns of its conditions, straight from the
+// mapped file.
+
+#define OWON_INDEX_MAGIC "OWONIDX"
+#define OWON_INDEX_VERSION 1
+#define OWON_INDEX_ALIGN 64
+#define OWON_INDEX_NAME 24
+
+enum owon_index_type {
+	OWON_INDEX_NUMBER = 0,
+	OWON_INDEX_STRING
+};
+
+// Columns written by this version, the channel columns repeat for ch1 to ch4
+enum owon_index_column {
+	OWON_INDEX_PATH = 0,
+	OWON_INDEX_SERIAL,
+	OWON_INDEX_MODEL,
+	OWON_INDEX_TIME,         // modification time of the file, seconds since the epoch
+	OWON_INDEX_SIZE,         // bytes of the file
+	OWON_INDEX_CHANNELS,
+	OWON_INDEX_CHANNEL
+};
+
+enum owon_index_field {
+	OWON_INDEX_TIMEDIV = 0,
+	OWON_INDEX_VOLTSDIV,
+	OWON_INDEX_ATTENUATION,
+	OWON_INDEX_FREQUENCY,    // as measured by the oscilloscope
+	OWON_INDEX_PERIOD,
+	OWON_INDEX_SAMPLES,
+	OWON_INDEX_MIN,          // volts, from measure.h when asked for
+	OWON_INDEX_MAX,
+	OWON_INDEX_RMS,
+	OWON_INDEX_FIELDS
+};
+
+#define OWON_INDEX_CHANNELS_MAX 4
+#define OWON_INDEX_COLUMNS (OWON_INDEX_CHANNEL + OWON_INDEX_CHANNELS_MAX * OWON_INDEX_FIELDS)
+
+typedef struct {
+  char magic[8];            // "OWONIDX\0"
+  uint32_t version;
+  uint32_t columns_count;
+  uint32_t header_size;     // offset of the first column record
+  uint32_t column_size;     // size of a column record
+  uint64_t rows;
+  uint64_t strings_offset;
+  uint64_t strings_length;
+} INDEX_HEADER_st;
+
+typedef struct {
+  char name[OWON_INDEX_NAME]; // "serial", "ch1.frequency"...
+  uint32_t type;
+  uint32_t reserved;
+  uint64_t data_offset;
+} INDEX_COLUMN_st;
+
+typedef struct {
+  const unsigned char *data;
+  size_t len;
+  int mapped;
+  const INDEX_HEADER_st *header;
+} INDEX_st;
+
+// A capture, for the writer
+typedef struct {
+  double values[OWON_INDEX_COLUMNS];      // numeric columns
+  const char *path;
+  char serial[32];
+  char model[8];
+} OWON_INDEX_ROW_st;
+
+// Strings are kept once, in a hash table of their offsets
+typedef struct {
+  size_t rows;
+  size_t size;              // rows allocated
+  void *columns[OWON_INDEX_COLUMNS]; // double or uint64_t arrays
+  char *strings;
+  size_t strings_length;
+  size_t strings_size;
+  uint64_t *slots;          // offset + 1 of a string, 0 when free
+  size_t slots_count;
+  size_t slots_used;
+} OWON_INDEX_BUILDER_st;
+
+const char *owon_index_column_name(int column);
+int owon_index_column_type(int column);
+
+// Row of a parsed capture. The channels go to ch1 to ch4 after their name,
+// measures is NULL or holds header->channels_count results. path stays
+// owned by the caller until the row is added.
+void owon_index_describe(const HEADER_st *header, const OWON_MEASURE_st *measures,
+			 const char *path, double time, double size, OWON_INDEX_ROW_st *row);
+
+void owon_index_builder_init(OWON_INDEX_BUILDER_st *builder);
+int owon_index_add(OWON_INDEX_BUILDER_st *builder, const OWON_INDEX_ROW_st *row);
+int owon_output_index(const OWON_INDEX_BUILDER_st *builder, FILE *file);
+void owon_index_builder_free(OWON_INDEX_BUILDER_st *builder);
+
+// Reader, nothing is copied: columns and strings point into the file
+int owon_index_open(const char *path, INDEX_st *index);
+int owon_index_from_buffer(const void *buf, size_t len, INDEX_st *index);
+// Column of that name (case doesn't matter) in the file, -1 if there is none
+int owon_index_find(const INDEX_st *index, const char *name);
+const INDEX_COLUMN_st *owon_index_column(const INDEX_st *index, size_t column);
+const double *owon_index_numbers(const INDEX_st *index, size_t column);
+const uint64_t *owon_index_offsets(const INDEX_st *index, size_t column);
+const char *owon_index_string(const INDEX_st *index, uint64_t offset);
+// The row as the writer takes it, strings point into the file
+int owon_index_row(const INDEX_st *index, size_t row, OWON_INDEX_ROW_st *destination);
+void owon_index_close(INDEX_st *index);
+
+// Queries
+
+enum owon_index_op {
+	OWON_INDEX_EQ = 0,
+	OWON_INDEX_NE,
+	OWON_INDEX_LT,
+	OWON_INDEX_LE,
+	OWON_INDEX_GT,
+	OWON_INDEX_GE,
+	OWON_INDEX_MATCH         // strings, shell wildcards
+};
+
+typedef struct {
+	int column;
+	int op;
+	double number;
+	const char *text;        // string columns, points into the condition
+} OWON_INDEX_CONDITION_st;
+
+// "ch1.frequency>1000", "serial=SDS7102V00001", "path~*/run3/*",
+// "time>=2014-05-01T12:00:00" (UTC, or seconds since the epoch).
+// Operators: = != < <= > >= and ~. A missing value matches nothing.
+int owon_index_condition(const INDEX_st *index, const char *text, OWON_INDEX_CONDITION_st *condition);
+// Stores the rows matching every condition in rows, of header->rows
+// entries, in order and returns how many
+size_t owon_index_select(const INDEX_st *index, const OWON_INDEX_CONDITION_st *conditions,
+			 size_t count, uint32_t *rows);
+
+#endif
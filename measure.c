@@ -0,0 +1,503 @@
+/*
+ * measure - measurements computed from the channel samples
+ * Copyright (c) 2014 Jonathan Bisson <bjonnh-owon@bjonnh.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include "measure.h"
+#include "decode.h"
+#include "owon.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define MEASURE_X86
+#include <immintrin.h>
+#endif
+
+// Vector iterations summed in 32 bits before they go to the 64 bits sums
+#define MEASURE_BLOCK 4096
+// Workers of owon_measure_header
+#define MEASURE_MAX_THREADS 16
+
+typedef struct {
+	int32_t min;
+	int32_t max;
+	int64_t sum;
+	uint64_t squares;
+} STATS_st;
+
+static inline int16_t load_s16(const unsigned char *p)
+{
+	return (int16_t)(p[1] << 8 | p[0]);
+}
+
+// First pass, scalar versions also used for the tails of the vector ones
+
+static void stats_s8_scalar(const unsigned char *src, size_t count, STATS_st *stats)
+{
+	size_t i;
+	int32_t value;
+
+	for (i = 0; i < count; i++) {
+		value = (int8_t) src[i];
+		stats->min = value < stats->min ? value : stats->min;
+		stats->max = value > stats->max ? value : stats->max;
+		stats->sum += value;
+		stats->squares += value * value;
+	}
+}
+
+static void stats_s16_scalar(const unsigned char *src, size_t count, STATS_st *stats)
+{
+	size_t i;
+	int32_t value;
+
+	for (i = 0; i < count; i++) {
+		value = load_s16(src + 2 * i);
+		stats->min = value < stats->min ? value : stats->min;
+		stats->max = value > stats->max ? value : stats->max;
+		stats->sum += value;
+		stats->squares += (uint32_t)(value * value);
+	}
+}
+
+#ifdef MEASURE_X86
+
+// The squares of a pair of int16 go up to 2^31: _mm_madd_epi16 gives them
+// right as unsigned 32 bits, they are zero extended to 64 bits at once.
+// The sums of pairs stay under 2^17 and wait MEASURE_BLOCK iterations.
+
+typedef struct {
+	__m128i min, max, sum32, sum64, squares64;
+} SSE2_ACC_st;
+
+__attribute__((target("sse2")))
+static inline void sse2_add(SSE2_ACC_st *acc, __m128i w)
+{
+	__m128i zero = _mm_setzero_si128();
+	__m128i squares = _mm_madd_epi16(w, w);
+
+	acc->min = _mm_min_epi16(acc->min, w);
+	acc->max = _mm_max_epi16(acc->max, w);
+	acc->sum32 = _mm_add_epi32(acc->sum32, _mm_madd_epi16(w, _mm_set1_epi16(1)));
+	acc->squares64 = _mm_add_epi64(acc->squares64, _mm_unpacklo_epi32(squares, zero));
+	acc->squares64 = _mm_add_epi64(acc->squares64, _mm_unpackhi_epi32(squares, zero));
+}
+
+__attribute__((target("sse2")))
+static inline void sse2_flush(SSE2_ACC_st *acc)
+{
+	__m128i sign = _mm_cmpgt_epi32(_mm_setzero_si128(), acc->sum32);
+
+	acc->sum64 = _mm_add_epi64(acc->sum64, _mm_unpacklo_epi32(acc->sum32, sign));
+	acc->sum64 = _mm_add_epi64(acc->sum64, _mm_unpackhi_epi32(acc->sum32, sign));
+	acc->sum32 = _mm_setzero_si128();
+}
+
+__attribute__((target("sse2")))
+static void sse2_init(SSE2_ACC_st *acc)
+{
+	acc->min = _mm_set1_epi16(INT16_MAX);
+	acc->max = _mm_set1_epi16(INT16_MIN);
+	acc->sum32 = acc->sum64 = acc->squares64 = _mm_setzero_si128();
+}
+
+__attribute__((target("sse2")))
+static void sse2_reduce(SSE2_ACC_st *acc, STATS_st *stats)
+{
+	int16_t min[8], max[8];
+	int64_t sum[2];
+	uint64_t squares[2];
+	int i;
+
+	sse2_flush(acc);
+	_mm_storeu_si128((__m128i *) min, acc->min);
+	_mm_storeu_si128((__m128i *) max, acc->max);
+	_mm_storeu_si128((__m128i *) sum, acc->sum64);
+	_mm_storeu_si128((__m128i *) squares, acc->squares64);
+	for (i = 0; i < 8; i++) {
+		stats->min = min[i] < stats->min ? min[i] : stats->min;
+		stats->max = max[i] > stats->max ? max[i] : stats->max;
+	}
+	stats->sum += sum[0] + sum[1];
+	stats->squares += squares[0] + squares[1];
+}
+
+__attribute__((target("sse2")))
+static void stats_s8_sse2(const unsigned char *src, size_t count, STATS_st *stats)
+{
+	SSE2_ACC_st acc;
+	size_t i = 0, end;
+
+	sse2_init(&acc);
+	while (i + 16 <= count) {
+		end = i + 16 * (MEASURE_BLOCK / 2);
+		for (; i + 16 <= count && i < end; i += 16) {
+			__m128i b = _mm_loadu_si128((const __m128i *)(src + i));
+			sse2_add(&acc, _mm_srai_epi16(_mm_unpacklo_epi8(b, b), 8));
+			sse2_add(&acc, _mm_srai_epi16(_mm_unpackhi_epi8(b, b), 8));
+		}
+		sse2_flush(&acc);
+	}
+	sse2_reduce(&acc, stats);
+	stats_s8_scalar(src + i, count - i, stats);
+}
+
+__attribute__((target("sse2")))
+static void stats_s16_sse2(const unsigned char *src, size_t count, STATS_st *stats)
+{
+	SSE2_ACC_st acc;
+	size_t i = 0, end;
+
+	sse2_init(&acc);
+	while (i + 8 <= count) {
+		end = i + 8 * MEASURE_BLOCK;
+		for (; i + 8 <= count && i < end; i += 8)
+			sse2_add(&acc, _mm_loadu_si128((const __m128i *)(src + 2 * i)));
+		sse2_flush(&acc);
+	}
+	sse2_reduce(&acc, stats);
+	stats_s16_scalar(src + 2 * i, count - i, stats);
+}
+
+// AVX2: the same on 16 samples at a time
+
+typedef struct {
+	__m256i min, max, sum32, sum64, squares64;
+} AVX2_ACC_st;
+
+__attribute__((target("avx2")))
+static inline void avx2_add(AVX2_ACC_st *acc, __m256i w)
+{
+	__m256i zero = _mm256_setzero_si256();
+	__m256i squares = _mm256_madd_epi16(w, w);
+
+	acc->min = _mm256_min_epi16(acc->min, w);
+	acc->max = _mm256_max_epi16(acc->max, w);
+	acc->sum32 = _mm256_add_epi32(acc->sum32, _mm256_madd_epi16(w, _mm256_set1_epi16(1)));
+	acc->squares64 = _mm256_add_epi64(acc->squares64, _mm256_unpacklo_epi32(squares, zero));
+	acc->squares64 = _mm256_add_epi64(acc->squares64, _mm256_unpackhi_epi32(squares, zero));
+}
+
+__attribute__((target("avx2")))
+static inline void avx2_flush(AVX2_ACC_st *acc)
+{
+	__m256i sign = _mm256_cmpgt_epi32(_mm256_setzero_si256(), acc->sum32);
+
+	acc->sum64 = _mm256_add_epi64(acc->sum64, _mm256_unpacklo_epi32(acc->sum32, sign));
+	acc->sum64 = _mm256_add_epi64(acc->sum64, _mm256_unpackhi_epi32(acc->sum32, sign));
+	acc->sum32 = _mm256_setzero_si256();
+}
+
+__attribute__((target("avx2")))
+static void avx2_init(AVX2_ACC_st *acc)
+{
+	acc->min = _mm256_set1_epi16(INT16_MAX);
+	acc->max = _mm256_set1_epi16(INT16_MIN);
+	acc->sum32 = acc->sum64 = acc->squares64 = _mm256_setzero_si256();
+}
+
+__attribute__((target("avx2")))
+static void avx2_reduce(AVX2_ACC_st *acc, STATS_st *stats)
+{
+	int16_t min[16], max[16];
+	int64_t sum[4];
+	uint64_t squares[4];
+	int i;
+
+	avx2_flush(acc);
+	_mm256_storeu_si256((__m256i *) min, acc->min);
+	_mm256_storeu_si256((__m256i *) max, acc->max);
+	_mm256_storeu_si256((__m256i *) sum, acc->sum64);
+	_mm256_storeu_si256((__m256i *) squares, acc->squares64);
+	for (i = 0; i < 16; i++) {
+		stats->min = min[i] < stats->min ? min[i] : stats->min;
+		stats->max = max[i] > stats->max ? max[i] : stats->max;
+	}
+	for (i = 0; i < 4; i++) {
+		stats->sum += sum[i];
+		stats->squares += squares[i];
+	}
+}
+
+__attribute__((target("avx2")))
+static void stats_s8_avx2(const unsigned char *src, size_t count, STATS_st *stats)
+{
+	AVX2_ACC_st acc;
+	size_t i = 0, end;
+
+	avx2_init(&acc);
+	while (i + 32 <= count) {
+		end = i + 32 * (MEASURE_BLOCK / 2);
+		for (; i + 32 <= count && i < end; i += 32) {
+			__m256i b = _mm256_loadu_si256((const __m256i *)(src + i));
+			avx2_add(&acc, _mm256_cvtepi8_epi16(_mm256_castsi256_si128(b)));
+			avx2_add(&acc, _mm256_cvtepi8_epi16(_mm256_extracti128_si256(b, 1)));
+		}
+		avx2_flush(&acc);
+	}
+	avx2_reduce(&acc, stats);
+	stats_s8_scalar(src + i, count - i, stats);
+}
+
+__attribute__((target("avx2")))
+static void stats_s16_avx2(const unsigned char *src, size_t count, STATS_st *stats)
+{
+	AVX2_ACC_st acc;
+	size_t i = 0, end;
+
+	avx2_init(&acc);
+	while (i + 16 <= count) {
+		end = i + 16 * MEASURE_BLOCK;
+		for (; i + 16 <= count && i < end; i += 16)
+			avx2_add(&acc, _mm256_loadu_si256((const __m256i *)(src + 2 * i)));
+		avx2_flush(&acc);
+	}
+	avx2_reduce(&acc, stats);
+	stats_s16_scalar(src + 2 * i, count - i, stats);
+}
+
+#endif
+
+// Runtime selection
+
+struct measure_kernels {
+	void (*s8)(const unsigned char *, size_t, STATS_st *);
+	void (*s16)(const unsigned char *, size_t, STATS_st *);
+};
+
+// Indexed by owon_cpu_level
+static const struct measure_kernels implementations[] = {
+	{ stats_s8_scalar, stats_s16_scalar },
+#ifdef MEASURE_X86
+	{ stats_s8_sse2, stats_s16_sse2 },
+	{ stats_s8_avx2, stats_s16_avx2 },
+#endif
+};
+
+static const struct measure_kernels *kernels = &implementations[OWON_CPU_SCALAR];
+static pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+
+static void select_kernels(void)
+{
+	kernels = &implementations[owon_cpu_level()];
+}
+
+const char *owon_measure_implementation(void)
+{
+	pthread_once(&kernels_once, select_kernels);
+	return owon_cpu_level_name(kernels - implementations);
+}
+
+// Second pass
+// The signal is low under the 10% level and high over the 90% one. A rising
+// edge goes from low to high, it starts at the last upward crossing of the
+// 10% level and ends at the crossing of the 90% one, the other way around
+// for a falling edge. Positions are in samples, interpolated.
+
+typedef struct {
+	double low, mid, high;
+	int state;                    // -1 low, 1 high, 0 not known yet
+	double start, middle;         // crossings of the edge in progress
+	double first_rise, last_rise; // 50% crossings of the rising edges
+	double last_fall;
+	double high_time, periods;    // over the whole periods
+	double rise_sum, fall_sum;
+	unsigned int rises, falls;
+} EDGES_st;
+
+static inline double crossing(size_t i, int32_t previous, int32_t value, double level)
+{
+	return (i - 1) + (level - previous) / (double)(value - previous);
+}
+
+static void edges_step(EDGES_st *edges, size_t i, int32_t previous, int32_t value)
+{
+	if (edges->state < 0) {
+		if (previous < edges->low && value >= edges->low)
+			edges->start = crossing(i, previous, value, edges->low);
+		if (previous < edges->mid && value >= edges->mid)
+			edges->middle = crossing(i, previous, value, edges->mid);
+		if (value <= edges->high)
+			return;
+		edges->rise_sum += crossing(i, previous, value, edges->high) - edges->start;
+		if (edges->rises == 0) {
+			edges->first_rise = edges->middle;
+		} else {
+			// A whole period, high from last_rise to last_fall
+			if (edges->last_fall > edges->last_rise)
+				edges->high_time += edges->last_fall - edges->last_rise;
+			edges->periods += edges->middle - edges->last_rise;
+		}
+		edges->last_rise = edges->middle;
+		edges->rises++;
+		edges->state = 1;
+	} else if (edges->state > 0) {
+		if (previous > edges->high && value <= edges->high)
+			edges->start = crossing(i, previous, value, edges->high);
+		if (previous > edges->mid && value <= edges->mid)
+			edges->middle = crossing(i, previous, value, edges->mid);
+		if (value >= edges->low)
+			return;
+		edges->fall_sum += crossing(i, previous, value, edges->low) - edges->start;
+		edges->last_fall = edges->middle;
+		edges->falls++;
+		edges->state = -1;
+	} else if (value < edges->low) {
+		edges->state = -1;
+	} else if (value > edges->high) {
+		edges->state = 1;
+	}
+}
+
+static void measure_edges(const CHANNEL_st *channel, const STATS_st *stats, EDGES_st *edges)
+{
+	size_t samples = channel->samples_file, i;
+	double vpp = stats->max - stats->min;
+	int32_t previous, value;
+
+	memset(edges, 0, sizeof(EDGES_st));
+	edges->low = stats->min + 0.1 * vpp;
+	edges->mid = stats->min + 0.5 * vpp;
+	edges->high = stats->min + 0.9 * vpp;
+	if (samples == 0)
+		return;
+
+	if (channel->datatype == 2) {
+		previous = load_s16(channel->samples);
+		edges_step(edges, 0, previous, previous);
+		for (i = 1; i < samples; i++, previous = value) {
+			value = load_s16(channel->samples + 2 * i);
+			edges_step(edges, i, previous, value);
+		}
+	} else {
+		previous = (int8_t) channel->samples[0];
+		edges_step(edges, 0, previous, previous);
+		for (i = 1; i < samples; i++, previous = value) {
+			value = (int8_t) channel->samples[i];
+			edges_step(edges, i, previous, value);
+		}
+	}
+}
+
+int owon_measure_channel(const CHANNEL_st *channel, OWON_MEASURE_st *measure)
+{
+	double scale = owon_channel_volts_per_count(channel);
+	double sample_time = owon_channel_time(channel, 1) - owon_channel_time(channel, 0);
+	double mean, square;
+	STATS_st stats = { INT32_MAX, INT32_MIN, 0, 0 };
+	EDGES_st edges;
+	size_t samples = channel->samples_file;
+
+	memset(measure, 0, sizeof(OWON_MEASURE_st));
+	if (samples == 0)
+		return OWON_SUCCESS;
+	if (channel->samples == NULL)
+		return OWON_ERROR;
+
+	pthread_once(&kernels_once, select_kernels);
+	if (channel->datatype == 2)
+		kernels->s16(channel->samples, samples, &stats);
+	else
+		kernels->s8(channel->samples, samples, &stats);
+
+	mean = (double) stats.sum / samples;
+	square = (double) stats.squares / samples;
+	measure->samples = samples;
+	measure->min = stats.min * scale;
+	measure->max = stats.max * scale;
+	measure->vpp = (stats.max - stats.min) * scale;
+	measure->mean = mean * scale;
+	measure->rms = sqrt(square) * scale;
+	measure->ac_rms = square > mean * mean ? sqrt(square - mean * mean) * scale : 0;
+
+	// Nothing to follow on a flat signal, or without a time base
+	if (stats.max == stats.min || !isfinite(sample_time) || sample_time <= 0)
+		return OWON_SUCCESS;
+
+	measure_edges(channel, &stats, &edges);
+	measure->rising_edges = edges.rises;
+	measure->falling_edges = edges.falls;
+	if (edges.rises > 0)
+		measure->rise_time = edges.rise_sum / edges.rises * sample_time;
+	if (edges.falls > 0)
+		measure->fall_time = edges.fall_sum / edges.falls * sample_time;
+	if (edges.rises > 1 && edges.periods > 0) {
+		measure->period = (edges.last_rise - edges.first_rise) / (edges.rises - 1) * sample_time;
+		measure->frequency = 1.0 / measure->period;
+		measure->duty_cycle = edges.high_time / edges.periods;
+	}
+	return OWON_SUCCESS;
+}
+
+// Across channels
+
+struct measure_job {
+	const HEADER_st *header;
+	OWON_MEASURE_st *measures;
+	size_t next;
+	int ret;
+};
+
+static void *measure_thread(void *arg)
+{
+	struct measure_job *job = arg;
+	size_t channel;
+	int ret;
+
+	while ((channel = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->header->channels_count) {
+		ret = owon_measure_channel(job->header->channels[channel], &job->measures[channel]);
+		if (ret < 0)
+			__atomic_store_n(&job->ret, ret, __ATOMIC_RELAXED);
+	}
+	return NULL;
+}
+
+int owon_measure_header(const HEADER_st *header, OWON_MEASURE_st *measures, int threads)
+{
+	struct measure_job job = { header, measures, 0, OWON_SUCCESS };
+	pthread_t workers[MEASURE_MAX_THREADS];
+	int started = 0, i;
+
+	if (threads > (int) header->channels_count)
+		threads = header->channels_count;
+	if (threads > MEASURE_MAX_THREADS)
+		threads = MEASURE_MAX_THREADS;
+
+	// The calling thread works too
+	for (i = 1; i < threads; i++)
+		if (pthread_create(&workers[started], NULL, measure_thread, &job) == 0)
+			started++;
+	measure_thread(&job);
+	for (i = 0; i < started; i++)
+		pthread_join(workers[i], NULL);
+	return job.ret;
+}
+
+int owon_measure_format(char *destination, size_t len, const char *file,
+			const CHANNEL_st *channel, const OWON_MEASURE_st *measure)
+{
+	return snprintf(destination, len, "%s,%s,%zu,%g,%g,%g,%g,%g,%g,%g,%g,%g,%g,%g,%u,%u\n",
+			file, channel->name, measure->samples, measure->min, measure->max,
+			measure->vpp, measure->mean, measure->rms, measure->ac_rms,
+			measure->frequency, measure->period, measure->duty_cycle,
+			measure->rise_time, measure->fall_time,
+			measure->rising_edges, measure->falling_edges);
+}
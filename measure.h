@@ -0,0 +1,65 @@
+/*
+ * measure - measurements computed from the channel samples
+ * Copyright (c) 2014 Jonathan Bisson <bjonnh-owon@bjonnh.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef _MEASURE_H_
+#define _MEASURE_H_
+
+#include <stddef.h>
+#include "parse.h"
+
+// A first pass reduces the samples, at their native width, to min, max,
+// sum and sum of squares with SSE2 or AVX2 when the CPU has them. A second
+// pass follows the edges between the 10% and 90% levels of the min to max
+// range, with the crossings interpolated between samples; the frequency
+// and the duty cycle come from the 50% crossings of these edges.
+// Volts are in volts, times in seconds. What can't be measured (a flat
+// signal, less than two rising edges...) is 0.
+
+typedef struct {
+	size_t samples;
+	double min;
+	double max;
+	double vpp;
+	double mean;
+	double rms;              // including the mean
+	double ac_rms;           // around the mean
+	double frequency;
+	double period;
+	double duty_cycle;       // 0 to 1, over the whole periods
+	double rise_time;        // 10% to 90%, average of the edges
+	double fall_time;
+	unsigned int rising_edges;
+	unsigned int falling_edges;
+} OWON_MEASURE_st;
+
+int owon_measure_channel(const CHANNEL_st *channel, OWON_MEASURE_st *measure);
+// measures holds header->channels_count results, the channels are spread
+// over threads workers
+int owon_measure_header(const HEADER_st *header, OWON_MEASURE_st *measures, int threads);
+
+// A CSV line per channel, with the capture it comes from first
+#define OWON_MEASURE_CSV_HEADER "file,channel,samples,min,max,vpp,mean,rms,ac_rms," \
+	"frequency,period,duty_cycle,rise_time,fall_time,rising_edges,falling_edges\n"
+// Same return as snprintf
+int owon_measure_format(char *destination, size_t len, const char *file,
+			const CHANNEL_st *channel, const OWON_MEASURE_st *measure);
+
+// Name of the selected first pass ("scalar", "sse2" or "avx2")
+const char *owon_measure_implementation(void);
+
+#endif
@@ -0,0 +1,468 @@
+/*
+ * owon-batch - convert many binary captures in parallel
+ * Copyright (c) 2014 Jonathan Bisson <bjonnh-owon@bjonnh.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "parse.h"
+#include "columnar.h"
+#include "archive.h"
+#include "measure.h"
+#include "owon.h"
+
+struct batch_params {
+	int columnar;
+	int archive;
+	int measure;
+	int precision;
+	int threads;
+	const char *outdir;
+};
+
+struct batch_list {
+	char **paths;
+	size_t count;
+	size_t size;
+};
+
+struct batch {
+	struct batch_params *params;
+	struct batch_list *list;
+	char *skipped;                // per input, its output belongs to another one
+	size_t next;
+	pthread_mutex_t lock;
+	// Totals, updated under lock
+	size_t converted;
+	size_t failed;
+	unsigned long long bytes;
+};
+
+// One per thread, reused from file to file
+struct batch_worker {
+	pthread_t thread;
+	struct batch *batch;
+	OUTBUF_st out;
+	OWON_ARENA_st arena;
+	char output[4096];
+};
+
+void usage(char **argv)
+{
+	printf("usage: %s [-o (csv|col|owz|meas)] [-p precision] [-j threads] [-d outdir] [-l list] (file|directory)...\n", argv[0]);
+	printf("  -o format     csv (default), columnar binary, owz compressed archive, or meas\n");
+	printf("                for the measurements of every channel as CSV on stdout\n");
+	printf("  -p precision  digits after the decimal point in csv (default %d)\n", OWON_CSV_PRECISION);
+	printf("  -j threads    number of workers (default: one per CPU)\n");
+	printf("  -d outdir     where to write the outputs (default: next to each input)\n");
+	printf("  -l list       read input paths from list, one per line (- for stdin)\n");
+	printf("Directories are searched for *.bin files.\n");
+	exit(EXIT_FAILURE);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1.0e9;
+}
+
+static int list_add(struct batch_list *list, const char *path)
+{
+	char **paths;
+
+	if (list->count == list->size) {
+		list->size = list->size ? 2 * list->size : 64;
+		paths = realloc(list->paths, list->size * sizeof(char *));
+		if (paths == NULL)
+			return OWON_ERROR_MEMORY;
+		list->paths = paths;
+	}
+	list->paths[list->count] = strdup(path);
+	if (list->paths[list->count] == NULL)
+		return OWON_ERROR_MEMORY;
+	list->count++;
+	return OWON_SUCCESS;
+}
+
+static int has_bin_extension(const char *name)
+{
+	size_t len = strlen(name);
+	return len > 4 && strcasecmp(name + len - 4, ".bin") == 0;
+}
+
+static int list_add_path(struct batch_list *list, const char *path)
+{
+	struct stat stbuf;
+	struct dirent *entry;
+	char file[4096];
+	DIR *dir;
+	int ret = OWON_SUCCESS;
+
+	if (stat(path, &stbuf) == -1 || !S_ISDIR(stbuf.st_mode))
+		return list_add(list, path);
+
+	dir = opendir(path);
+	if (dir == NULL) {
+		fprintf(stderr, "Unable to open directory %s\n", path);
+		return OWON_ERROR_READ;
+	}
+	while (ret == OWON_SUCCESS && (entry = readdir(dir)) != NULL) {
+		if (!has_bin_extension(entry->d_name))
+			continue;
+		snprintf(file, sizeof(file), "%s/%s", path, entry->d_name);
+		ret = list_add(list, file);
+	}
+	closedir(dir);
+	return ret;
+}
+
+static int list_add_file(struct batch_list *list, const char *listfile)
+{
+	char line[4096];
+	size_t len;
+	FILE *fp;
+	int ret = OWON_SUCCESS;
+
+	fp = strcmp(listfile, "-") == 0 ? stdin : fopen(listfile, "r");
+	if (fp == NULL) {
+		fprintf(stderr, "Unable to open %s\n", listfile);
+		return OWON_ERROR_READ;
+	}
+	while (ret == OWON_SUCCESS && fgets(line, sizeof(line), fp) != NULL) {
+		len = strlen(line);
+		while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+			line[--len] = 0;
+		if (len > 0)
+			ret = list_add_path(list, line);
+	}
+	if (fp != stdin)
+		fclose(fp);
+	return ret;
+}
+
+// capture.bin -> outdir/capture.csv
+static void output_path(char *destination, size_t len, const char *input, const struct batch_params *params)
+{
+	const char *extension = params->columnar ? ".col" : params->archive ? ".owz" : ".csv";
+	const char *base = strrchr(input, '/');
+	const char *dot;
+	size_t stem;
+
+	if (params->outdir != NULL) {
+		base = base != NULL ? base + 1 : input;
+		dot = strrchr(base, '.');
+		stem = dot != NULL ? (size_t)(dot - base) : strlen(base);
+		snprintf(destination, len, "%s/%.*s%s", params->outdir, (int)stem, base, extension);
+	} else {
+		dot = strrchr(input, '.');
+		if (dot != NULL && base != NULL && dot < base)
+			dot = NULL;
+		stem = dot != NULL ? (size_t)(dot - input) : strlen(input);
+		snprintf(destination, len, "%.*s%s", (int)stem, input, extension);
+	}
+}
+
+struct batch_output {
+	char *path;
+	size_t input;
+};
+
+static int compare_outputs(const void *a, const void *b)
+{
+	const struct batch_output *x = a, *y = b;
+	int ret = strcmp(x->path, y->path);
+
+	if (ret != 0)
+		return ret;
+	return x->input < y->input ? -1 : x->input > y->input;
+}
+
+// Inputs sharing an output (a/cap.bin and b/cap.bin with -d) would
+// overwrite each other: only the first one in the list is converted
+static int find_collisions(struct batch *batch)
+{
+	struct batch_list *list = batch->list;
+	struct batch_output *outputs;
+	char path[4096];
+	size_t i, first;
+	int ret = OWON_SUCCESS;
+
+	batch->skipped = calloc(list->count, 1);
+	outputs = calloc(list->count, sizeof(struct batch_output));
+	if (batch->skipped == NULL || outputs == NULL) {
+		free(outputs);
+		return OWON_ERROR_MEMORY;
+	}
+	for (i = 0; i < list->count && ret == OWON_SUCCESS; i++) {
+		output_path(path, sizeof(path), list->paths[i], batch->params);
+		outputs[i].path = strdup(path);
+		outputs[i].input = i;
+		if (outputs[i].path == NULL)
+			ret = OWON_ERROR_MEMORY;
+	}
+	if (ret == OWON_SUCCESS) {
+		qsort(outputs, list->count, sizeof(struct batch_output), compare_outputs);
+		for (i = 1, first = 0; i < list->count; i++) {
+			if (strcmp(outputs[i].path, outputs[first].path) != 0) {
+				first = i;
+				continue;
+			}
+			batch->skipped[outputs[i].input] = 1;
+			fprintf(stderr, "%s: skipped, %s is already the output of %s\n",
+				list->paths[outputs[i].input], outputs[i].path,
+				list->paths[outputs[first].input]);
+		}
+	}
+	for (i = 0; i < list->count; i++)
+		free(outputs[i].path);
+	free(outputs);
+	return ret;
+}
+
+// A line per channel, written in one go so the files don't interleave
+static int measure(struct batch_worker *worker, const char *input, HEADER_st *header)
+{
+	OWON_MEASURE_st measure;
+	char line[1024];
+	size_t i;
+	int len, ret;
+
+	// Without a file the buffer only grows, nothing is written before the lock
+	worker->out.file = NULL;
+	worker->out.error = 0;
+	worker->out.len = 0;
+	for (i = 0; i < header->channels_count; i++) {
+		ret = owon_measure_channel(header->channels[i], &measure);
+		if (ret < 0)
+			return ret;
+		len = owon_measure_format(line, sizeof(line), input, header->channels[i], &measure);
+		if (len < 0 || (size_t) len >= sizeof(line))
+			return OWON_ERROR;
+		owon_outbuf_string(&worker->out, line);
+	}
+	pthread_mutex_lock(&worker->batch->lock);
+	worker->out.file = stdout;
+	ret = owon_outbuf_flush(&worker->out);
+	pthread_mutex_unlock(&worker->batch->lock);
+	return ret;
+}
+
+static int convert(struct batch_worker *worker, const char *input, size_t *bytes)
+{
+	struct batch_params *params = worker->batch->params;
+	HEADER_st header;
+	FILE *fp;
+	int ret;
+
+	ret = owon_parse_file_arena(input, &header, &worker->arena);
+	if (ret < 0) {
+		fprintf(stderr, "%s: can't parse (%d)\n", input, ret);
+		return ret;
+	}
+	*bytes = header.map_len;
+
+	if (params->measure) {
+		ret = measure(worker, input, &header);
+		if (ret != 0)
+			fprintf(stderr, "%s: can't measure (%d)\n", input, ret);
+		owon_free_header(&header);
+		return ret;
+	}
+
+	output_path(worker->output, sizeof(worker->output), input, params);
+	fp = fopen(worker->output, "wb");
+	if (fp == NULL) {
+		fprintf(stderr, "%s: unable to open %s\n", input, worker->output);
+		owon_free_header(&header);
+		return OWON_ERROR;
+	}
+
+	if (params->columnar) {
+		ret = owon_output_columnar(&header, fp);
+	} else if (params->archive) {
+		// The files already keep every worker busy
+		ret = owon_output_archive(&header, header.map, header.map_len, fp, 1);
+	} else {
+		worker->out.file = fp;
+		worker->out.error = 0;
+		worker->out.len = 0;
+		ret = owon_output_csv_outbuf(&header, &worker->out, params->precision);
+		if (ret == 0)
+			ret = owon_outbuf_flush(&worker->out);
+	}
+	if (fclose(fp) != 0 && ret == 0)
+		ret = OWON_ERROR;
+	if (ret != 0)
+		fprintf(stderr, "%s: can't write %s (%d)\n", input, worker->output, ret);
+
+	owon_free_header(&header);
+	return ret;
+}
+
+static void *batch_thread(void *arg)
+{
+	struct batch_worker *worker = arg;
+	struct batch *batch = worker->batch;
+	size_t index, bytes;
+	int ret;
+
+	for (;;) {
+		pthread_mutex_lock(&batch->lock);
+		index = batch->next++;
+		pthread_mutex_unlock(&batch->lock);
+		if (index >= batch->list->count)
+			break;
+
+		bytes = 0;
+		if (batch->skipped != NULL && batch->skipped[index])
+			ret = OWON_ERROR;
+		else
+			ret = convert(worker, batch->list->paths[index], &bytes);
+
+		pthread_mutex_lock(&batch->lock);
+		if (ret == 0) {
+			batch->converted++;
+			batch->bytes += bytes;
+		} else {
+			batch->failed++;
+		}
+		pthread_mutex_unlock(&batch->lock);
+	}
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	struct batch_params params;
+	struct batch_list list;
+	struct batch batch;
+	struct batch_worker *workers;
+	double start, elapsed;
+	int c, i, started = 0;
+
+	params.columnar = 0;
+	params.archive = 0;
+	params.measure = 0;
+	params.precision = OWON_CSV_PRECISION;
+	params.threads = sysconf(_SC_NPROCESSORS_ONLN);
+	params.outdir = NULL;
+	memset(&list, 0, sizeof(list));
+
+	while ((c = getopt(argc, argv, "o:p:j:d:l:h")) != -1) {
+		switch (c) {
+		case 'o':
+			if (strcasecmp(optarg, "col") == 0)
+				params.columnar = 1;
+			else if (strcasecmp(optarg, "owz") == 0)
+				params.archive = 1;
+			else if (strcasecmp(optarg, "meas") == 0)
+				params.measure = 1;
+			else if (strcasecmp(optarg, "csv") != 0)
+				usage(argv);
+			break;
+		case 'p':
+			if (sscanf(optarg, "%d", &params.precision) != 1 || params.precision < 0)
+				usage(argv);
+			break;
+		case 'j':
+			if (sscanf(optarg, "%d", &params.threads) != 1 || params.threads < 1)
+				usage(argv);
+			break;
+		case 'd':
+			params.outdir = optarg;
+			break;
+		case 'l':
+			if (list_add_file(&list, optarg) != OWON_SUCCESS)
+				return EXIT_FAILURE;
+			break;
+		default:
+			usage(argv);
+		}
+	}
+	for (i = optind; i < argc; i++)
+		if (list_add_path(&list, argv[i]) != OWON_SUCCESS)
+			return EXIT_FAILURE;
+	if (list.count == 0)
+		usage(argv);
+	if (params.threads < 1)
+		params.threads = 1;
+	if ((size_t) params.threads > list.count)
+		params.threads = list.count;
+
+	memset(&batch, 0, sizeof(batch));
+	batch.params = &params;
+	batch.list = &list;
+	pthread_mutex_init(&batch.lock, NULL);
+
+	workers = calloc(params.threads, sizeof(struct batch_worker));
+	if (workers == NULL) {
+		fprintf(stderr, "Can't allocate the workers\n");
+		return EXIT_FAILURE;
+	}
+
+	if (params.measure) {
+		fputs(OWON_MEASURE_CSV_HEADER, stdout);
+	} else if (find_collisions(&batch) != OWON_SUCCESS) {
+		fprintf(stderr, "Can't allocate the outputs\n");
+		return EXIT_FAILURE;
+	}
+
+	start = now();
+	for (i = 0; i < params.threads; i++) {
+		workers[i].batch = &batch;
+		owon_arena_init(&workers[i].arena);
+		if (owon_outbuf_init(&workers[i].out, NULL, OWON_OUTBUF_SIZE) != 0)
+			continue;
+		if (pthread_create(&workers[i].thread, NULL, batch_thread, &workers[i]) == 0)
+			started++;
+		else
+			owon_outbuf_free(&workers[i].out);
+	}
+	if (started == 0) {
+		fprintf(stderr, "Can't start any worker\n");
+		return EXIT_FAILURE;
+	}
+	for (i = 0; i < params.threads; i++) {
+		if (workers[i].out.buf == NULL)
+			continue;
+		pthread_join(workers[i].thread, NULL);
+		owon_outbuf_free(&workers[i].out);
+		owon_arena_free(&workers[i].arena);
+	}
+	elapsed = now() - start;
+
+	fprintf(stderr, "%zu converted, %zu failed, %.2f MB in %.3f s with %d workers: %.1f files/s, %.1f MB/s\n",
+		batch.converted, batch.failed, batch.bytes / 1.0e6, elapsed, started,
+		elapsed > 0 ? batch.converted / elapsed : 0,
+		elapsed > 0 ? batch.bytes / elapsed / 1.0e6 : 0);
+
+	for (i = 0; (size_t) i < list.count; i++)
+		free(list.paths[i]);
+	free(list.paths);
+	free(batch.skipped);
+	free(workers);
+	pthread_mutex_destroy(&batch.lock);
+
+	return batch.failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,320 @@
+/*
+ * owon-bench - parser throughput benchmark
+ * Copyright (c) 2014 Jonathan Bisson <bjonnh-owon@bjonnh.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "parse.h"
+#include "decode.h"
+#include "pyramid.h"
+#include "measure.h"
+#include "spectrum.h"
+#include "trigger.h"
+#include "archive.h"
+
+// Display buckets of the overview queries
+#define OWON_BENCH_BUCKETS 1920
+
+// Synthetic capture laid out like a STARTBIN answer
+
+static unsigned char *put_u32(unsigned char *p, uint32_t value)
+{
+	p[0] = value;
+	p[1] = value >> 8;
+	p[2] = value >> 16;
+	p[3] = value >> 24;
+	return p + 4;
+}
+
+static unsigned char *build_capture(uint32_t samples, int channels, int datatype, size_t *len)
+{
+	size_t width = datatype == 2 ? 2 : 1;
+	size_t body = 6 + 4 + 29 + 1 + 1 + 4 + 1 + 8 + channels * (59 + samples * width);
+	unsigned char *buffer, *p;
+	uint32_t i;
+	int c;
+
+	buffer = calloc(12 + body, 1);
+	if (buffer == NULL)
+		return NULL;
+	p = put_u32(buffer, body);
+	p = put_u32(p, 0);
+	p = put_u32(p, 1);
+	memcpy(p, "SPBV01", 6);
+	p = put_u32(p + 6, 1);
+	memcpy(p, "BENCH", 5);
+	p += 29 + 1 + 1;
+	p = put_u32(p, 0);
+	p += 1 + 8;
+
+	for (c = 0; c < channels; c++) {
+		p[0] = 'C';
+		p[1] = 'H';
+		p[2] = '1' + c;
+		p += 3;
+		p = put_u32(p, 0);
+		p = put_u32(p, datatype);
+		p = put_u32(p, 0);
+		p = put_u32(p, samples);
+		p = put_u32(p, samples);
+		p = put_u32(p, 0);
+		p = put_u32(p, 17);
+		p = put_u32(p, 0);
+		p = put_u32(p, 5);
+		p = put_u32(p, 1);
+		p += 16;
+		for (i = 0; i < samples; i++) {
+			int16_t value = (i * 7 + c * 13) % 200 - 100;
+			*p++ = value;
+			if (width == 2)
+				*p++ = value >> 8;
+		}
+	}
+
+	*len = p - buffer;
+	return buffer;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1.0e9;
+}
+
+void usage(char **argv)
+{
+	printf("usage: %s [-n samples] [-c channels] [-t datatype] [-i iterations]\n", argv[0]);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+	uint32_t samples = 10000000;
+	int channels = 2, datatype = 1, iterations = 20, i, c;
+	unsigned char *buffer, *restored;
+	float *volts;
+	size_t len, ch;
+	HEADER_st header;
+	OWON_ARENA_st arena;
+	OWON_PYRAMID_st pyramid;
+	OWON_PYRAMID_BUCKET_st buckets[OWON_BENCH_BUCKETS];
+	OWON_MEASURE_st measures[4];
+	OWON_SPECTRUM_st spectra[4];
+	OWON_TRIGGER_st trigger;
+	OWON_TRIGGER_EVENT_st event;
+	ARCHIVE_st archive;
+	char *packed = NULL;
+	size_t packed_len = 0;
+	FILE *fp;
+	int threads = sysconf(_SC_NPROCESSORS_ONLN), checked;
+	size_t first, count;
+	double start, parse_time = 0, decode_time = 0, build_time = 0, query_time = 0;
+	double measure_time = 0, spectrum_time = 0, trigger_time = 0;
+	double encode_time = 0, extract_time = 0, read_time = 0, probe_time = 0, map_time = 0;
+	char path[] = "/tmp/owon-bench-XXXXXX";
+	int fd;
+
+	while ((c = getopt(argc, argv, "n:c:t:i:")) != -1) {
+		switch (c) {
+		case 'n':
+			samples = strtoul(optarg, NULL, 10);
+			break;
+		case 'c':
+			channels = atoi(optarg);
+			break;
+		case 't':
+			datatype = atoi(optarg);
+			break;
+		case 'i':
+			iterations = atoi(optarg);
+			break;
+		default:
+			usage(argv);
+		}
+	}
+	if (channels < 1 || channels > 4 || iterations < 1)
+		usage(argv);
+
+	// A benchmark of kernels that give wrong samples is worth nothing
+	checked = owon_decode_check();
+	if (checked < 0)
+		return EXIT_FAILURE;
+
+	memset(spectra, 0, sizeof(spectra));
+	owon_arena_init(&arena);
+	owon_trigger_parse("edge,level=1e6", &trigger);
+	buffer = build_capture(samples, channels, datatype, &len);
+	volts = malloc(samples * sizeof(float));
+	restored = buffer != NULL ? malloc(len) : NULL;
+	if (buffer == NULL || volts == NULL || restored == NULL) {
+		fprintf(stderr, "Can't allocate the capture\n");
+		return EXIT_FAILURE;
+	}
+
+	for (i = 0; i < iterations; i++) {
+		start = now();
+		if (owon_parse_arena((const char *) buffer, len, &header, &arena) < 0 ||
+		    header.channels_count != (size_t) channels) {
+			fprintf(stderr, "Parse error\n");
+			return EXIT_FAILURE;
+		}
+		parse_time += now() - start;
+
+		start = now();
+		for (ch = 0; ch < header.channels_count; ch++)
+			owon_channel_volts(header.channels[ch], 0, header.channels[ch]->samples_file, volts);
+		decode_time += now() - start;
+
+		start = now();
+		owon_pyramid_init(&pyramid, header.channels[0], OWON_PYRAMID_MEAN);
+		if (owon_pyramid_build(&pyramid) < 0) {
+			fprintf(stderr, "Can't build the pyramid\n");
+			return EXIT_FAILURE;
+		}
+		build_time += now() - start;
+
+		start = now();
+		owon_measure_header(&header, measures, 1);
+		measure_time += now() - start;
+
+		// A level no sample reaches, every sample goes through the scan
+		start = now();
+		if (owon_trigger_search_header(&trigger, &header, &event, 1) < 0) {
+			fprintf(stderr, "Can't search the trigger\n");
+			return EXIT_FAILURE;
+		}
+		trigger_time += now() - start;
+
+		// The tables are built by the first iteration, as by the first capture
+		start = now();
+		if (owon_spectrum_add_header(spectra, 4, &header, OWON_WINDOW_HANN, 0) < 0) {
+			fprintf(stderr, "Can't compute the spectrum\n");
+			return EXIT_FAILURE;
+		}
+		if (i > 0)
+			spectrum_time += now() - start;
+
+		// From the whole capture down to a zoom where buckets are samples
+		start = now();
+		for (count = samples; count >= OWON_BENCH_BUCKETS; count /= 2) {
+			first = (samples - count) / 3;
+			owon_pyramid_query(&pyramid, first, count, OWON_BENCH_BUCKETS, buckets);
+		}
+		query_time += now() - start;
+		owon_pyramid_free(&pyramid);
+
+		start = now();
+		fp = open_memstream(&packed, &packed_len);
+		if (fp == NULL || owon_output_archive(&header, buffer, len, fp, threads) != 0 ||
+		    fclose(fp) != 0) {
+			fprintf(stderr, "Can't write the archive\n");
+			return EXIT_FAILURE;
+		}
+		encode_time += now() - start;
+
+		start = now();
+		if (owon_archive_from_buffer(packed, packed_len, &archive) != 0 ||
+		    owon_archive_extract(&archive, restored, threads) != 0 ||
+		    memcmp(restored, buffer, len) != 0) {
+			fprintf(stderr, "The archive doesn't restore the capture\n");
+			return EXIT_FAILURE;
+		}
+		extract_time += now() - start;
+
+		// A screen of samples in the middle of the last channel
+		start = now();
+		first = samples / 2 > OWON_BENCH_BUCKETS ? samples / 2 - OWON_BENCH_BUCKETS : 0;
+		count = samples - first < OWON_BENCH_BUCKETS ? samples - first : OWON_BENCH_BUCKETS;
+		if (owon_archive_read(&archive, header.channels_count - 1, first, count, restored, 1) != 0) {
+			fprintf(stderr, "Can't read the archive\n");
+			return EXIT_FAILURE;
+		}
+		read_time += now() - start;
+		owon_archive_close(&archive);
+		free(packed);
+
+		owon_free_header(&header);
+	}
+
+	// The same capture in a file, by its headers only and mapped to be parsed
+	fd = mkstemp(path);
+	if (fd == -1 || write(fd, buffer, len) != (ssize_t) len) {
+		fprintf(stderr, "Can't write %s\n", path);
+		return EXIT_FAILURE;
+	}
+	close(fd);
+	for (i = 0; i < iterations; i++) {
+		start = now();
+		if (owon_probe_file_arena(path, &header, &arena) < 0 ||
+		    header.channels_count != (size_t) channels) {
+			fprintf(stderr, "Probe error\n");
+			return EXIT_FAILURE;
+		}
+		owon_free_header(&header);
+		probe_time += now() - start;
+
+		start = now();
+		if (owon_parse_file_arena(path, &header, &arena) < 0) {
+			fprintf(stderr, "Parse error\n");
+			return EXIT_FAILURE;
+		}
+		owon_free_header(&header);
+		map_time += now() - start;
+	}
+	unlink(path);
+
+	printf("capture: %zu bytes, %d channels of %u samples (datatype %d)\n",
+	       len, channels, samples, datatype);
+	printf("parse:  %.3f ms/capture, %.1f MB/s\n",
+	       parse_time / iterations * 1.0e3, len * iterations / parse_time / 1.0e6);
+	printf("probe:  %.3f ms/capture from its file, %.3f ms mapped and parsed\n",
+	       probe_time / iterations * 1.0e3, map_time / iterations * 1.0e3);
+	printf("decode: %.3f ms/capture, %.1f MB/s (%s, %d implementations checked against scalar)\n",
+	       decode_time / iterations * 1.0e3, len * iterations / decode_time / 1.0e6,
+	       owon_decode_implementation(), checked);
+	printf("pyramid: %.3f ms to build a channel, %d buckets queries in %.3f ms from full view to samples\n",
+	       build_time / iterations * 1.0e3, OWON_BENCH_BUCKETS, query_time / iterations * 1.0e3);
+	printf("measure: %.3f ms/capture, %.1f MB/s (%s)\n",
+	       measure_time / iterations * 1.0e3, len * iterations / measure_time / 1.0e6,
+	       owon_measure_implementation());
+	printf("trigger: %.3f ms/capture, %.1f MB/s (%s)\n",
+	       trigger_time / iterations * 1.0e3, len * iterations / trigger_time / 1.0e6,
+	       owon_trigger_implementation());
+	if (iterations > 1)
+		printf("spectrum: %.3f ms/capture of %zu points per channel\n",
+		       spectrum_time / (iterations - 1) * 1.0e3, spectra[0].size);
+
+	printf("archive: %zu bytes (%.1f%%), %.1f MB/s coded, %.1f MB/s restored with %d threads,"
+	       " %d samples read in %.3f ms\n",
+	       packed_len, 100.0 * packed_len / len, len * iterations / encode_time / 1.0e6,
+	       len * iterations / extract_time / 1.0e6, threads, OWON_BENCH_BUCKETS,
+	       read_time / iterations * 1.0e3);
+
+	for (ch = 0; ch < 4; ch++)
+		owon_spectrum_free(&spectra[ch]);
+
+	owon_arena_free(&arena);
+	free(restored);
+	free(volts);
+	free(buffer);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,421 @@
+/*
+ * owon-daemon - keeps the oscilloscopes open and serves captures
+ * Copyright (c) 2014 Jonathan Bisson <bjonnh-owon@bjonnh.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "usb.h"
+#include "parse.h"
+#include "columnar.h"
+#include "daemon.h"
+#include "owon.h"
+
+// The user and its group, for a daemon shared through /run/owon
+#define OWON_DAEMON_MODE 0660
+
+// Devices seen on the bus since the start, by serial number
+#define OWON_DAEMON_MAX_DEVICES 32
+
+struct device_slot {
+	char serial[OWON_USB_SERIAL_LENGTH];
+	struct libusb_device_handle *dev_handle; // NULL until used, or after an error
+	pthread_mutex_t lock;                    // one capture at a time per device
+};
+
+static struct device_slot slots[OWON_DAEMON_MAX_DEVICES];
+static int slots_count = 0;
+static pthread_mutex_t slots_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Connections served at once, each by its own thread
+#define OWON_DAEMON_MAX_CLIENTS 64
+// Wait before accepting again when full or out of descriptors or memory, in ms
+#define OWON_DAEMON_ACCEPT_BACKOFF 100
+
+static int clients_count = 0;
+static pthread_mutex_t clients_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static void stop_handler(int sig)
+{
+	stop_requested = 1;
+}
+
+void usage(char **argv)
+{
+	printf("usage: %s [-S socket]\n", argv[0]);
+	printf("  -S socket  path of the Unix socket (default $XDG_RUNTIME_DIR/%s,\n"
+	       "             or %s/%s without it)\n",
+	       OWON_DAEMON_SOCKET_NAME, OWON_DAEMON_DIR, OWON_DAEMON_SOCKET_NAME);
+	exit(EXIT_FAILURE);
+}
+
+// The device slot a request is about, created the first time. Only devices
+// on the bus get one: a made up serial must not use up the table.
+static struct device_slot *find_slot(const OWON_DAEMON_REQUEST_st *request)
+{
+	OWON_USB_DEVICE_st *devices = NULL;
+	struct device_slot *slot = NULL;
+	char serial[OWON_USB_SERIAL_LENGTH];
+	int count, i;
+
+	// The device table is cached, this doesn't walk the bus
+	count = owon_usb_list_devices(&devices);
+	if (count < 0)
+		return NULL;
+	if (request->serial[0] != 0) {
+		memcpy(serial, request->serial, sizeof(serial));
+		serial[sizeof(serial) - 1] = 0;
+		for (i = 0; i < count; i++)
+			if (strcmp(devices[i].serial, serial) == 0)
+				break;
+	} else {
+		i = request->device;
+		if (i >= 0 && i < count)
+			strcpy(serial, devices[i].serial);
+	}
+	free(devices);
+	if (i < 0 || i >= count)
+		return NULL;
+
+	pthread_mutex_lock(&slots_lock);
+	for (i = 0; i < slots_count; i++)
+		if (strcmp(slots[i].serial, serial) == 0)
+			slot = &slots[i];
+	if (slot == NULL && slots_count < OWON_DAEMON_MAX_DEVICES) {
+		slot = &slots[slots_count++];
+		strcpy(slot->serial, serial);
+		slot->dev_handle = NULL;
+		pthread_mutex_init(&slot->lock, NULL);
+	}
+	pthread_mutex_unlock(&slots_lock);
+	return slot;
+}
+
+// Called with the slot locked
+static long capture(struct device_slot *slot, enum owon_start_command_type type, OWON_USB_BUFFER_st *buffer)
+{
+	long length;
+
+	if (slot->dev_handle == NULL) {
+		slot->dev_handle = owon_usb_easy_open_serial(slot->serial);
+		if (slot->dev_handle == NULL)
+			return OWON_ERROR_USB_NOT_FOUND;
+		fprintf(stderr, "Opened device %s\n", slot->serial);
+	}
+
+	length = owon_usb_read_into(slot->dev_handle, buffer, type);
+	if (length <= 0) {
+		// Reopened on the next request, in case the device went away
+		libusb_clear_halt(slot->dev_handle, OWON_USB_ENDPOINT_IN);
+		libusb_clear_halt(slot->dev_handle, OWON_USB_ENDPOINT_OUT);
+		owon_usb_close(slot->dev_handle);
+		slot->dev_handle = NULL;
+		return length < 0 ? length : OWON_ERROR_USB;
+	}
+	return length;
+}
+
+// Parses the capture into a sealed memfd in the columnar format
+static int columnar_memfd(const unsigned char *buffer, long length, uint64_t *size)
+{
+	HEADER_st header;
+	FILE *fp;
+	int memfd, ret;
+
+	ret = owon_parse((const char *)buffer, length, &header);
+	if (ret < 0)
+		return ret;
+
+	memfd = memfd_create("owon-capture", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (memfd < 0) {
+		owon_free_header(&header);
+		return OWON_ERROR_MEMORY;
+	}
+	fp = fdopen(dup(memfd), "wb");
+	if (fp == NULL) {
+		owon_free_header(&header);
+		close(memfd);
+		return OWON_ERROR_MEMORY;
+	}
+	ret = owon_output_columnar(&header, fp);
+	*size = ftell(fp);
+	if (fclose(fp) != 0 && ret == 0)
+		ret = OWON_ERROR_MEMORY;
+	owon_free_header(&header);
+	if (ret != 0) {
+		close(memfd);
+		return ret;
+	}
+
+	// The client maps what it gets, it can't change under it
+	if (fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) != 0) {
+		close(memfd);
+		return OWON_ERROR_MEMORY;
+	}
+	return memfd;
+}
+
+// usb is the buffer of the connection, reused from request to request
+static int serve(int fd, const OWON_DAEMON_REQUEST_st *request, OWON_USB_BUFFER_st *usb)
+{
+	OWON_DAEMON_RESPONSE_st response;
+	struct device_slot *slot;
+	const unsigned char *buffer = NULL;
+	long length = OWON_ERROR_USB_NOT_FOUND;
+	int memfd = -1, ret;
+
+	memset(&response, 0, sizeof(response));
+	response.magic = OWON_DAEMON_MAGIC;
+
+	if (request->command >= DUMP_COUNT ||
+	    (request->output != DUMP_OUTPUT_RAW && request->output != DUMP_OUTPUT_COLUMNAR)) {
+		response.status = OWON_ERROR_UNSUPPORTED;
+		return owon_daemon_send_response(fd, &response, -1);
+	}
+
+	slot = find_slot(request);
+	if (slot != NULL) {
+		pthread_mutex_lock(&slot->lock);
+		length = capture(slot, request->command, usb);
+		pthread_mutex_unlock(&slot->lock);
+	}
+	if (length > 0) {
+		buffer = owon_usb_buffer_data(usb);
+		if (buffer == NULL)
+			length = OWON_ERROR_MEMORY;
+	}
+
+	if (length <= 0) {
+		response.status = length < 0 ? length : OWON_ERROR_USB;
+		return owon_daemon_send_response(fd, &response, -1);
+	}
+
+	if (request->output == DUMP_OUTPUT_COLUMNAR) {
+		memfd = columnar_memfd(buffer, length, &response.length);
+		if (memfd < 0) {
+			response.status = memfd;
+			response.length = 0;
+			return owon_daemon_send_response(fd, &response, -1);
+		}
+		ret = owon_daemon_send_response(fd, &response, memfd);
+		close(memfd);
+		return ret;
+	}
+
+	response.length = length;
+	ret = owon_daemon_send_response(fd, &response, -1);
+	if (ret == 0)
+		ret = owon_daemon_write_all(fd, buffer, length);
+	return ret;
+}
+
+static void *client_thread(void *arg)
+{
+	int fd = (int)(intptr_t) arg;
+	OWON_DAEMON_REQUEST_st request;
+	OWON_USB_BUFFER_st usb;
+
+	owon_usb_buffer_init(&usb);
+	while (owon_daemon_read_all(fd, &request, sizeof(request)) == 0) {
+		if (request.magic != OWON_DAEMON_MAGIC) {
+			fprintf(stderr, "Bad request, closing the connection\n");
+			break;
+		}
+		if (serve(fd, &request, &usb) != 0)
+			break;
+	}
+	owon_usb_buffer_free(&usb);
+	close(fd);
+
+	pthread_mutex_lock(&clients_lock);
+	clients_count--;
+	pthread_mutex_unlock(&clients_lock);
+	return NULL;
+}
+
+// A socket left by a daemon that is gone is removed. Anything else at path
+// is left alone: a file, or the socket of a daemon still running.
+static int remove_stale(const char *path, const struct sockaddr_un *address)
+{
+	struct stat stbuf;
+	int fd, ret;
+
+	if (lstat(path, &stbuf) != 0)
+		return errno == ENOENT ? 0 : -1;
+	if (!S_ISSOCK(stbuf.st_mode)) {
+		fprintf(stderr, "%s exists and is not a socket\n", path);
+		return -1;
+	}
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+	ret = connect(fd, (const struct sockaddr *)address, sizeof(*address));
+	close(fd);
+	if (ret == 0) {
+		fprintf(stderr, "An owon-daemon already listens on %s\n", path);
+		return -1;
+	}
+	if (errno != ECONNREFUSED) {
+		fprintf(stderr, "Unable to check %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	return unlink(path);
+}
+
+// inode is that of the socket, to only remove our own when leaving
+static int listen_on(const char *path, ino_t *inode)
+{
+	struct sockaddr_un address;
+	struct stat stbuf;
+	mode_t mask;
+	int fd, ret;
+
+	if (path[0] == '\0' || strlen(path) >= sizeof(address.sun_path)) {
+		fprintf(stderr, "Invalid socket path: %s\n", path);
+		return -1;
+	}
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, path);
+
+	if (remove_stale(path, &address) != 0)
+		return -1;
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+	// Nobody else can connect between bind and chmod
+	mask = umask(0177);
+	ret = bind(fd, (struct sockaddr *)&address, sizeof(address));
+	umask(mask);
+	if (ret != 0 || chmod(path, OWON_DAEMON_MODE) != 0 || stat(path, &stbuf) != 0 ||
+	    listen(fd, 16) != 0) {
+		fprintf(stderr, "Unable to listen on %s: %s\n", path, strerror(errno));
+		if (ret == 0)
+			unlink(path);
+		close(fd);
+		return -1;
+	}
+	*inode = stbuf.st_ino;
+	return fd;
+}
+
+int main(int argc, char **argv)
+{
+	char default_path[4096];
+	const char *path = default_path;
+	struct sigaction action;
+	struct stat stbuf;
+	ino_t inode;
+	pthread_attr_t attr;
+	pthread_t thread;
+	int c, fd, client, clients, error, i;
+
+	if (owon_daemon_socket_path(default_path, sizeof(default_path)) != OWON_SUCCESS)
+		default_path[0] = '\0';
+	while ((c = getopt(argc, argv, "S:h")) != -1) {
+		switch (c) {
+		case 'S':
+			path = optarg;
+			break;
+		default:
+			usage(argv);
+		}
+	}
+
+	// No SA_RESTART: accept() returns when we are asked to stop
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = stop_handler;
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	owon_usb_init();
+	if (owon_usb_start_events() != 0)
+		return EXIT_FAILURE;
+
+	fd = listen_on(path, &inode);
+	if (fd < 0) {
+		owon_usb_exit();
+		return EXIT_FAILURE;
+	}
+	fprintf(stderr, "Listening on %s, %d devices\n", path, (int) owon_usb_get_device_count());
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	while (!stop_requested) {
+		// Full: new connections wait in the listen backlog
+		pthread_mutex_lock(&clients_lock);
+		clients = clients_count;
+		pthread_mutex_unlock(&clients_lock);
+		if (clients >= OWON_DAEMON_MAX_CLIENTS) {
+			poll(NULL, 0, OWON_DAEMON_ACCEPT_BACKOFF);
+			continue;
+		}
+
+		client = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+		if (client < 0) {
+			error = errno;
+			if (error == EINTR)
+				continue;
+			fprintf(stderr, "accept: %s\n", strerror(error));
+			// Retrying at once would only spin until a client leaves
+			if (error == EMFILE || error == ENFILE || error == ENOBUFS || error == ENOMEM)
+				poll(NULL, 0, OWON_DAEMON_ACCEPT_BACKOFF);
+			continue;
+		}
+		pthread_mutex_lock(&clients_lock);
+		clients_count++;
+		pthread_mutex_unlock(&clients_lock);
+		if (pthread_create(&thread, &attr, client_thread, (void *)(intptr_t) client) != 0) {
+			fprintf(stderr, "Can't start a client thread\n");
+			close(client);
+			pthread_mutex_lock(&clients_lock);
+			clients_count--;
+			pthread_mutex_unlock(&clients_lock);
+		}
+	}
+	pthread_attr_destroy(&attr);
+
+	close(fd);
+	if (stat(path, &stbuf) == 0 && stbuf.st_ino == inode)
+		unlink(path);
+
+	// Wait for the captures in progress before closing the devices
+	pthread_mutex_lock(&slots_lock);
+	for (i = 0; i < slots_count; i++) {
+		pthread_mutex_lock(&slots[i].lock);
+		if (slots[i].dev_handle != NULL)
+			owon_usb_close(slots[i].dev_handle);
+		slots[i].dev_handle = NULL;
+	}
+	owon_usb_exit();
+
+	return EXIT_SUCCESS;
+}
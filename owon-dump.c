@@ -26,49 +26,131 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
 #include <usb.h>
 #include "usb.h"
 #include "parse.h"
+#include "columnar.h"
+#include "archive.h"
+#include "queue.h"
+#include "daemon.h"
+#include "shm.h"
+#include "spectrum.h"
+#include "trigger.h"
+#include "owon.h"
+
+// Depth of the queues between the stages of the continuous mode
+#define OWON_DUMP_QUEUE_DEPTH 4
+// Consecutive failed captures before the continuous mode gives up
+#define OWON_DUMP_MAX_FAILURES 3
+// Captures of a pipeline: enough for full queues plus one in each stage
+#define OWON_DUMP_POOL_SIZE (2 * OWON_DUMP_QUEUE_DEPTH + 3)
+// Channels of a capture the spectrum output goes through
+#define OWON_DUMP_SPECTRA 4
 
 struct owon_dump_params {
-	uint8_t dnum;
+	int dnum;
+	char *serial;       // selects the device by serial instead of dnum
+	int all;            // acquire from every managed device at once
+	char *socket;       // capture through owon-daemon when set
+	char *publish;      // shared memory ring the captures are published to
+	unsigned int shm_slots;
+	unsigned long shm_slot_size;
 	enum owon_start_command_type mode;
 	enum owon_output_type output;
+	OWON_TRIGGER_st *trigger; // only the captures with an event are written
+	int window;         // of the spectrum output
+	unsigned int averages;
 	char *filename;
+	int continuous;
+	unsigned int count; // 0 means until interrupted
+	double rate;        // captures per second, 0 means as fast as possible
 };
 
 void usage(int argc, char **argv)
 {
-	printf("usage: %s [-m (bmp|bin|memdepth|debugtxt)] [-o (raw|csv)] [-f output_file]", argv[0]);
+	printf("usage: %s [-l] [-d device | -s serial | -a] [-m (bmp|bin|memdepth|debugtxt)]"
+	       " [-o (raw|csv|col|fft|owz)] [-f output_file] [-c count [-r rate]]\n", argv[0]);
+	printf("  -l        list the connected devices\n");
+	printf("  -d device index of the device to use, as listed by -l (default 0)\n");
+	printf("  -s serial serial number of the device to use\n");
+	printf("  -a        acquire from all the devices at once, each capture is written\n"
+	       "            to output_file-SERIAL-YYYYMMDDTHHMMSS.mmmZ.ext\n");
+	printf("  -c count  continuous mode, capture count times (0: until interrupted)\n"
+	       "            to output_file-NNNNNN.ext\n");
+	printf("  -r rate   target captures per second in continuous mode\n");
+	printf("  -w window window of the fft output: rect, hann (default), blackman or flattop\n");
+	printf("  -A count  the fft output of the continuous mode is averaged over about count\n"
+	       "            captures (default 0: every capture so far)\n");
+	printf("  -T trigger in continuous mode, only write the captures where the software\n"
+	       "            trigger finds an event (e.g. edge,level=1.5 or runt,low=0.5,high=2.5)\n");
+	printf("  -S socket capture through a running owon-daemon (- for $XDG_RUNTIME_DIR/%s,\n"
+	       "            or %s/%s without it)\n",
+	       OWON_DAEMON_SOCKET_NAME, OWON_DAEMON_DIR, OWON_DAEMON_SOCKET_NAME);
+	printf("  -P name   continuous mode publishing to the shared memory ring name (e.g. /owon),\n"
+	       "            files are only written with -f\n");
+	printf("  -R slots  captures held by the ring (default %d)\n", OWON_SHM_SLOTS);
+	printf("  -Z MB     largest capture a slot holds (default %d)\n", OWON_SHM_SLOT_SIZE >> 20);
 	exit(EXIT_FAILURE);
 }
 
-/*void list_devices()
+void list_devices()
 {
-	size_t count, i;
+	OWON_USB_DEVICE_st *devices = NULL;
+	int count, i;
 
 	owon_usb_init();
-	count = owon_usb_get_device_count();
+	count = owon_usb_list_devices(&devices);
+	if (count < 0) {
+		fprintf(stderr, "Can't list the devices: %d\n", count);
+		exit(EXIT_FAILURE);
+	}
 
-	printf("Owon-dump: %u devices\n", count);
+	printf("Owon-dump: %d devices\n", count);
+	for (i = 0; i < count; i++)
+		printf("%d: bus %03u address %03u serial %s\n", devices[i].index,
+		       devices[i].bus, devices[i].address, devices[i].serial);
 
+	free(devices);
+	owon_usb_exit();
 	exit(EXIT_SUCCESS);
-	}*/
+}
 
 int parse_cli(int argc, char **argv, struct owon_dump_params *params)
 {
 	char c;
 
 	params->dnum = 0;
+	params->serial = NULL;
+	params->all = 0;
+	params->socket = NULL;
+	params->publish = NULL;
+	params->shm_slots = OWON_SHM_SLOTS;
+	params->shm_slot_size = OWON_SHM_SLOT_SIZE;
 	params->mode = DUMP_BIN;
 	params->output = DUMP_OUTPUT_RAW;
+	params->trigger = NULL;
+	params->window = OWON_WINDOW_HANN;
+	params->averages = 0;
 	params->filename = NULL;
+	params->continuous = 0;
+	params->count = 0;
+	params->rate = 0;
 
-	while ((c = getopt (argc, argv, "m:o:f:")) != -1) {
+	while ((c = getopt (argc, argv, "d:s:alm:o:f:c:r:w:A:T:S:P:R:Z:")) != -1) {
 		switch (c) {
-/*			case 'd':
-				sscanf(optarg, "%d", &params->dnum);
-				break;*/
+			case 'd':
+				if (sscanf(optarg, "%d", &params->dnum) != 1 || params->dnum < 0)
+					return 1;
+				break;
+			case 's':
+				params->serial = strdup(optarg);
+				break;
+			case 'a':
+				params->all = 1;
+				break;
 			case 'm':
 				if (strcasecmp(optarg, "bmp") == 0)
 					params->mode = DUMP_BMP;
@@ -86,21 +168,95 @@ int parse_cli(int argc, char **argv, struct owon_dump_params *params)
 					params->output = DUMP_OUTPUT_RAW;
 				else if (strcasecmp(optarg, "csv") == 0)
 					params->output = DUMP_OUTPUT_CSV;
+				else if (strcasecmp(optarg, "col") == 0)
+					params->output = DUMP_OUTPUT_COLUMNAR;
+				else if (strcasecmp(optarg, "fft") == 0)
+					params->output = DUMP_OUTPUT_SPECTRUM;
+				else if (strcasecmp(optarg, "owz") == 0)
+					params->output = DUMP_OUTPUT_ARCHIVE;
 				else
 					return 1;
 				break;
 			case 'f':
 				params->filename = strdup(optarg);
 				break;
-/*			case 'l':
+			case 'c':
+				params->continuous = 1;
+				if (sscanf(optarg, "%u", &params->count) != 1)
+					return 1;
+				break;
+			case 'r':
+				if (sscanf(optarg, "%lf", &params->rate) != 1 || params->rate < 0)
+					return 1;
+				break;
+			case 'w':
+				params->window = owon_spectrum_window(optarg);
+				if (params->window < 0)
+					return 1;
+				break;
+			case 'A':
+				if (sscanf(optarg, "%u", &params->averages) != 1)
+					return 1;
+				break;
+			case 'T':
+				params->trigger = malloc(sizeof(OWON_TRIGGER_st));
+				if (NULL == params->trigger || owon_trigger_parse(optarg, params->trigger) != 0) {
+					fprintf(stderr, "Invalid trigger %s\n", optarg);
+					return 1;
+				}
+				break;
+			case 'l':
 				list_devices();
-				break;*/
+				break;
+			case 'S':
+				if (strcmp(optarg, "-") == 0) {
+					char path[4096];
+					if (owon_daemon_socket_path(path, sizeof(path)) != 0)
+						return 1;
+					params->socket = strdup(path);
+				} else {
+					params->socket = strdup(optarg);
+				}
+				break;
+			case 'P':
+				params->publish = strdup(optarg);
+				params->continuous = 1;
+				break;
+			case 'R':
+				if (sscanf(optarg, "%u", &params->shm_slots) != 1 || params->shm_slots < 2)
+					return 1;
+				break;
+			case 'Z':
+				if (sscanf(optarg, "%lu", &params->shm_slot_size) != 1 || params->shm_slot_size == 0)
+					return 1;
+				params->shm_slot_size <<= 20;
+				break;
 			default:
 				usage(argc, argv);
 				break;
 		}
 	}
-	
+
+	if (NULL != params->socket && (params->continuous || params->all)) {
+		fprintf(stderr, "-S captures once from one device\n");
+		return 1;
+	}
+
+	if (NULL != params->trigger && !params->continuous && !params->all) {
+		fprintf(stderr, "-T filters the captures of the continuous and all devices modes\n");
+		return 1;
+	}
+
+	if (NULL != params->publish && params->all) {
+		fprintf(stderr, "A shared memory ring has a single publisher, -P doesn't go with -a\n");
+		return 1;
+	}
+
+	if ((params->continuous || params->all) && NULL == params->filename && NULL == params->publish) {
+		fprintf(stderr, "Continuous and all devices modes need an output file (-f)\n");
+		return 1;
+	}
+
 	return 0;
 }
 
@@ -118,7 +274,585 @@ int output_csv(FILE *fp, const char *buffer, long length)
 	if (ret < 0)
 		return ret;
 
-	owon_output_csv(&header, fp);
+	ret = owon_output_csv(&header, fp);
+	owon_free_header(&header);
+	return ret;
+}
+
+// Transforms the channels of a parsed capture into spectra, which keep
+// their tables and their average from one call to the next
+int output_spectrum(FILE *fp, const HEADER_st *header, OWON_SPECTRUM_st *spectra,
+		    const struct owon_dump_params *params)
+{
+	int count = owon_spectrum_add_header(spectra, OWON_DUMP_SPECTRA, header,
+					     params->window, params->averages);
+	if (count <= 0) {
+		fprintf(stderr, "Can't compute the spectrum of the capture: %d\n", count);
+		return count < 0 ? count : OWON_ERROR;
+	}
+	return owon_output_spectrum(header, spectra, count, fp);
+}
+
+// Continuous mode
+// The handle stays open and captures go through three stages connected by
+// bounded queues: the USB fetch, the parsing and the writing. Parsing and disk
+// I/O of a capture thus overlap the download of the next one.
+// With -a every device runs its own pipeline, all of them sharing the libusb
+// event thread, so a sweep lasts as long as the slowest device.
+
+struct capture {
+	unsigned int index;
+	struct timespec taken;
+	OWON_USB_BUFFER_st usb;      // kept from one capture to the next
+	const unsigned char *buffer; // the capture in one piece
+	long length;
+	int parsed;
+	HEADER_st header;
+	OWON_STREAM_st stream;       // parses the capture as it downloads
+	OWON_ARENA_st arena;         // the channels of header, reused like usb
+	int triggered;               // the software trigger found an event
+};
+
+struct stage_stats {
+	const char *name;
+	unsigned long items;
+	unsigned long failures;
+	unsigned long long bytes;
+	double busy;
+};
+
+struct pipeline {
+	struct owon_dump_params *params;
+	struct libusb_device_handle *dev_handle;
+	char serial[OWON_USB_SERIAL_LENGTH]; // only set when writing per device
+	OWON_SHM_st *shm;                    // set when publishing
+	QUEUE_st free_queue;
+	QUEUE_st parse_queue;
+	QUEUE_st write_queue;
+	struct capture *pool;
+	OWON_SPECTRUM_st spectra[OWON_DUMP_SPECTRA]; // averaged by the write stage
+	struct stage_stats fetch, parse, write;
+	unsigned long triggered;     // captures with an event, with -T
+};
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static void stop_handler(int sig)
+{
+	stop_requested = 1;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1.0e9;
+}
+
+// output.bin -> output-000042.bin
+static void capture_filename(char *destination, size_t len, const char *filename, unsigned int index)
+{
+	const char *dot = strrchr(filename, '.');
+	const char *slash = strrchr(filename, '/');
+
+	if (NULL == dot || (NULL != slash && dot < slash))
+		snprintf(destination, len, "%s-%06u", filename, index);
+	else
+		snprintf(destination, len, "%.*s-%06u%s", (int)(dot - filename), filename, index, dot);
+}
+
+// output.bin -> output-SERIAL-20141005T213012.345Z.bin
+static void device_filename(char *destination, size_t len, const char *filename,
+			    const char *serial, const struct timespec *taken)
+{
+	const char *dot = strrchr(filename, '.');
+	const char *slash = strrchr(filename, '/');
+	char stamp[32];
+	struct tm tm;
+
+	gmtime_r(&taken->tv_sec, &tm);
+	strftime(stamp, sizeof(stamp), "%Y%m%dT%H%M%S", &tm);
+
+	if (NULL == dot || (NULL != slash && dot < slash))
+		snprintf(destination, len, "%s-%s-%s.%03ldZ", filename, serial, stamp,
+			 taken->tv_nsec / 1000000);
+	else
+		snprintf(destination, len, "%.*s-%s-%s.%03ldZ%s", (int)(dot - filename), filename,
+			 serial, stamp, taken->tv_nsec / 1000000, dot);
+}
+
+// Back to the pool, the queue holds the whole pool so this never waits
+static void release_capture(struct pipeline *pipeline, struct capture *capture)
+{
+	if (capture->parsed)
+		owon_free_header(&capture->header);
+	capture->parsed = 0;
+	capture->triggered = 0;
+	capture->buffer = NULL;
+	owon_queue_push(&pipeline->free_queue, capture);
+}
+
+static void *fetch_thread(void *arg)
+{
+	struct pipeline *pipeline = arg;
+	struct owon_dump_params *params = pipeline->params;
+	struct capture *capture;
+	unsigned int index;
+	int failures = 0;
+	double start, next = now();
+
+	for (index = 0; !stop_requested && (params->count == 0 || index < params->count); index++) {
+		if (params->rate > 0) {
+			double wait = next - now();
+			if (wait > 0) {
+				struct timespec ts = { (time_t)wait, (long)((wait - (time_t)wait) * 1.0e9) };
+				nanosleep(&ts, NULL);
+			}
+			next += 1.0 / params->rate;
+		}
+
+		// Waits for the later stages when the whole pool is in use
+		capture = owon_queue_pop(&pipeline->free_queue);
+		if (NULL == capture)
+			break;
+		capture->index = index;
+		clock_gettime(CLOCK_REALTIME, &capture->taken);
+
+		// Only the parsed outputs and the trigger need the stream
+		capture->usb.stream = NULL;
+		if (params->output != DUMP_OUTPUT_RAW || NULL != pipeline->shm || NULL != params->trigger) {
+			owon_stream_init(&capture->stream, &capture->header, NULL, 1);
+			owon_stream_set_arena(&capture->stream, &capture->arena);
+			capture->usb.stream = &capture->stream;
+		}
+
+		start = now();
+		capture->length = owon_usb_read_into(pipeline->dev_handle, &capture->usb, params->mode);
+		if (capture->length > 0) {
+			capture->buffer = owon_usb_buffer_data(&capture->usb);
+			if (NULL == capture->buffer)
+				capture->length = OWON_ERROR_MEMORY;
+		}
+		pipeline->fetch.busy += now() - start;
+
+		if (0 >= capture->length && NULL != capture->usb.stream)
+			owon_stream_abort(&capture->stream);
+		if (0 >= capture->length) {
+			fprintf(stderr, "Error reading capture %u from device %s: %li\n", index,
+				pipeline->serial, capture->length);
+			libusb_clear_halt(pipeline->dev_handle, OWON_USB_ENDPOINT_IN);
+			libusb_clear_halt(pipeline->dev_handle, OWON_USB_ENDPOINT_OUT);
+			release_capture(pipeline, capture);
+			pipeline->fetch.failures++;
+			if (++failures >= OWON_DUMP_MAX_FAILURES)
+				break;
+			continue;
+		}
+		failures = 0;
+		pipeline->fetch.items++;
+		pipeline->fetch.bytes += capture->length;
+
+		if (owon_queue_push(&pipeline->parse_queue, capture) != 0) {
+			release_capture(pipeline, capture);
+			break;
+		}
+	}
+
+	owon_queue_close(&pipeline->parse_queue);
+	return NULL;
+}
+
+// The first event is enough to keep the capture
+static int trigger_capture(struct pipeline *pipeline, struct capture *capture)
+{
+	OWON_TRIGGER_EVENT_st event;
+	long found;
+
+	if (!capture->parsed)
+		return 0;
+	found = owon_trigger_search_header(pipeline->params->trigger, &capture->header, &event, 1);
+	if (found < 0)
+		fprintf(stderr, "Can't search capture %u: %ld\n", capture->index, found);
+	if (found <= 0)
+		return 0;
+	fprintf(stderr, "%s%sCapture %u: %s event on %s at %.9g s\n", pipeline->serial,
+		*pipeline->serial ? " " : "", capture->index, owon_trigger_slope_name(event.slope),
+		capture->header.channels[event.channel]->name, event.time);
+	pipeline->triggered++;
+	return 1;
+}
+
+static void *parse_thread(void *arg)
+{
+	struct pipeline *pipeline = arg;
+	struct capture *capture;
+	double start;
+
+	while ((capture = owon_queue_pop(&pipeline->parse_queue)) != NULL) {
+		start = now();
+		// The stream has gone through everything but the end of the capture
+		if (NULL != capture->usb.stream) {
+			if (owon_stream_finish(&capture->stream) < 0) {
+				fprintf(stderr, "Can't parse capture %u\n", capture->index);
+				pipeline->parse.failures++;
+				release_capture(pipeline, capture);
+				continue;
+			}
+			// The samples of a multipart capture are in its segments
+			if (capture->usb.count > 1)
+				owon_rebase_header(&capture->header, capture->buffer);
+			capture->parsed = 1;
+		}
+		// Searched here so the write stage only gets the files to write
+		if (NULL != pipeline->params->trigger)
+			capture->triggered = trigger_capture(pipeline, capture);
+		pipeline->parse.busy += now() - start;
+		pipeline->parse.items++;
+		pipeline->parse.bytes += capture->length;
+
+		if (owon_queue_push(&pipeline->write_queue, capture) != 0)
+			release_capture(pipeline, capture);
+	}
+
+	owon_queue_close(&pipeline->write_queue);
+	return NULL;
+}
+
+static void *write_thread(void *arg)
+{
+	struct pipeline *pipeline = arg;
+	struct capture *capture;
+	char filename[4096];
+	FILE *fp;
+	double start;
+
+	while ((capture = owon_queue_pop(&pipeline->write_queue)) != NULL) {
+		start = now();
+		if (NULL != pipeline->shm &&
+		    owon_shm_publish(pipeline->shm, capture->buffer, capture->length,
+				     capture->parsed ? &capture->header : NULL) != 0)
+			pipeline->write.failures++;
+		if (NULL == pipeline->params->filename ||
+		    (NULL != pipeline->params->trigger && !capture->triggered)) {
+			pipeline->write.busy += now() - start;
+			pipeline->write.items++;
+			pipeline->write.bytes += capture->length;
+			release_capture(pipeline, capture);
+			continue;
+		}
+
+		if (pipeline->params->all)
+			device_filename(filename, sizeof(filename), pipeline->params->filename,
+					pipeline->serial, &capture->taken);
+		else
+			capture_filename(filename, sizeof(filename), pipeline->params->filename, capture->index);
+		fp = fopen(filename, "wb");
+		if (NULL == fp) {
+			fprintf(stderr, "Unable to open %s\n", filename);
+			pipeline->write.failures++;
+			release_capture(pipeline, capture);
+			continue;
+		}
+
+		switch (pipeline->params->output) {
+		case DUMP_OUTPUT_RAW:
+			output_raw(fp, (const char *)capture->buffer, capture->length);
+			break;
+		case DUMP_OUTPUT_CSV:
+			owon_output_csv(&capture->header, fp);
+			break;
+		case DUMP_OUTPUT_COLUMNAR:
+			owon_output_columnar(&capture->header, fp);
+			break;
+		case DUMP_OUTPUT_SPECTRUM:
+			if (output_spectrum(fp, &capture->header, pipeline->spectra, pipeline->params) != 0)
+				pipeline->write.failures++;
+			break;
+		case DUMP_OUTPUT_ARCHIVE:
+			if (owon_output_archive(&capture->header, capture->buffer, capture->length, fp,
+						sysconf(_SC_NPROCESSORS_ONLN)) != 0)
+				pipeline->write.failures++;
+			break;
+		default:
+			break;
+		}
+		pipeline->write.bytes += ftell(fp);
+		fclose(fp);
+
+		pipeline->write.busy += now() - start;
+		pipeline->write.items++;
+		release_capture(pipeline, capture);
+	}
+
+	return NULL;
+}
+
+static void print_stage_stats(const char *device, const struct stage_stats *stats, double elapsed)
+{
+	fprintf(stderr, "%s%s%-6s %lu captures (%lu failed), %.2f MB, busy %.3f s, %.2f captures/s, %.2f MB/s\n",
+		device, *device ? " " : "",
+		stats->name, stats->items, stats->failures, stats->bytes / 1.0e6, stats->busy,
+		elapsed > 0 ? stats->items / elapsed : 0,
+		stats->busy > 0 ? stats->bytes / stats->busy / 1.0e6 : 0);
+}
+
+static void catch_stop_signals(void)
+{
+	struct sigaction action;
+
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = stop_handler;
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+}
+
+static int pipeline_init(struct pipeline *pipeline, struct owon_dump_params *params,
+			 struct libusb_device_handle *dev_handle)
+{
+	int i;
+
+	memset(pipeline, 0, sizeof(struct pipeline));
+	pipeline->params = params;
+	pipeline->dev_handle = dev_handle;
+	pipeline->fetch.name = "fetch";
+	pipeline->parse.name = "parse";
+	pipeline->write.name = "write";
+
+	pipeline->pool = calloc(OWON_DUMP_POOL_SIZE, sizeof(struct capture));
+	if (NULL == pipeline->pool ||
+	    owon_queue_init(&pipeline->free_queue, OWON_DUMP_POOL_SIZE) != 0 ||
+	    owon_queue_init(&pipeline->parse_queue, OWON_DUMP_QUEUE_DEPTH) != 0 ||
+	    owon_queue_init(&pipeline->write_queue, OWON_DUMP_QUEUE_DEPTH) != 0) {
+		fprintf(stderr, "Can't allocate the capture queues\n");
+		return -1;
+	}
+	// The capture buffers grow during the first captures and are then reused
+	for (i = 0; i < OWON_DUMP_POOL_SIZE; i++) {
+		owon_usb_buffer_init(&pipeline->pool[i].usb);
+		owon_arena_init(&pipeline->pool[i].arena);
+		owon_queue_push(&pipeline->free_queue, &pipeline->pool[i]);
+	}
+	return 0;
+}
+
+static void pipeline_start(struct pipeline *pipeline, pthread_t threads[3])
+{
+	pthread_create(&threads[0], NULL, fetch_thread, pipeline);
+	pthread_create(&threads[1], NULL, parse_thread, pipeline);
+	pthread_create(&threads[2], NULL, write_thread, pipeline);
+}
+
+static void pipeline_join(struct pipeline *pipeline, pthread_t threads[3])
+{
+	int i;
+
+	pthread_join(threads[0], NULL);
+	pthread_join(threads[1], NULL);
+	pthread_join(threads[2], NULL);
+
+	owon_queue_destroy(&pipeline->parse_queue);
+	owon_queue_destroy(&pipeline->write_queue);
+	owon_queue_destroy(&pipeline->free_queue);
+	for (i = 0; i < OWON_DUMP_POOL_SIZE; i++) {
+		owon_usb_buffer_free(&pipeline->pool[i].usb);
+		owon_arena_free(&pipeline->pool[i].arena);
+	}
+	free(pipeline->pool);
+	for (i = 0; i < OWON_DUMP_SPECTRA; i++)
+		owon_spectrum_free(&pipeline->spectra[i]);
+}
+
+static void pipeline_stats(struct pipeline *pipeline, double elapsed)
+{
+	print_stage_stats(pipeline->serial, &pipeline->fetch, elapsed);
+	print_stage_stats(pipeline->serial, &pipeline->parse, elapsed);
+	print_stage_stats(pipeline->serial, &pipeline->write, elapsed);
+	if (NULL != pipeline->params->trigger)
+		fprintf(stderr, "%s%strigger %lu of %lu captures with an event\n", pipeline->serial,
+			*pipeline->serial ? " " : "", pipeline->triggered, pipeline->parse.items);
+}
+
+int run_continuous(struct owon_dump_params *params, struct libusb_device_handle *dev_handle)
+{
+	struct pipeline pipeline;
+	pthread_t threads[3];
+	OWON_SHM_st shm;
+	double start, elapsed;
+
+	if (pipeline_init(&pipeline, params, dev_handle) != 0)
+		return -1;
+	if (NULL != params->publish) {
+		if (owon_shm_create(params->publish, params->shm_slots, params->shm_slot_size, &shm) != 0) {
+			fprintf(stderr, "Can't create the shared memory ring %s\n", params->publish);
+			return -1;
+		}
+		pipeline.shm = &shm;
+		fprintf(stderr, "Publishing to %s, %u slots of %lu MB\n", params->publish,
+			params->shm_slots, params->shm_slot_size >> 20);
+	}
+	catch_stop_signals();
+
+	start = now();
+	pipeline_start(&pipeline, threads);
+	pipeline_join(&pipeline, threads);
+	elapsed = now() - start;
+
+	fprintf(stderr, "Continuous mode: %.3f s\n", elapsed);
+	pipeline_stats(&pipeline, elapsed);
+	if (NULL != pipeline.shm)
+		owon_shm_close(pipeline.shm);
+
+	return pipeline.fetch.items > 0 ? 0 : -1;
+}
+
+// Opens every managed device and runs one pipeline per device. Without -c
+// each device is captured once.
+int run_all_devices(struct owon_dump_params *params)
+{
+	OWON_USB_DEVICE_st *devices = NULL;
+	struct pipeline *pipelines;
+	pthread_t (*threads)[3];
+	double start, elapsed;
+	int count, opened = 0, succeeded = 0, i;
+
+	owon_usb_init();
+	count = owon_usb_list_devices(&devices);
+	if (count <= 0) {
+		fprintf(stderr, "No device found\n");
+		return -1;
+	}
+	if (!params->continuous)
+		params->count = 1;
+
+	pipelines = calloc(count, sizeof(struct pipeline));
+	threads = calloc(count, sizeof(*threads));
+	if (NULL == pipelines || NULL == threads) {
+		fprintf(stderr, "Can't allocate the device pipelines\n");
+		free(pipelines);
+		free(threads);
+		free(devices);
+		return -1;
+	}
+
+	for (i = 0; i < count; i++) {
+		struct libusb_device_handle *dev_handle = owon_usb_easy_open(devices[i].index);
+		int j;
+		if (NULL == dev_handle)
+			continue;
+		if (pipeline_init(&pipelines[opened], params, dev_handle) != 0) {
+			owon_usb_close(dev_handle);
+			continue;
+		}
+		// Devices sharing a serial number still get their own files
+		for (j = 0; j < i && strcmp(devices[j].serial, devices[i].serial) != 0; j++)
+			;
+		if (j < i)
+			snprintf(pipelines[opened].serial, OWON_USB_SERIAL_LENGTH, "%.40s-%d",
+				 devices[i].serial, devices[i].index);
+		else
+			strcpy(pipelines[opened].serial, devices[i].serial);
+		opened++;
+	}
+	free(devices);
+	fprintf(stderr, "Acquiring from %d of %d devices\n", opened, count);
+
+	if (opened > 0 && owon_usb_start_events() == 0) {
+		catch_stop_signals();
+		start = now();
+		for (i = 0; i < opened; i++)
+			pipeline_start(&pipelines[i], threads[i]);
+		for (i = 0; i < opened; i++)
+			pipeline_join(&pipelines[i], threads[i]);
+		elapsed = now() - start;
+		owon_usb_stop_events();
+
+		fprintf(stderr, "All devices: %.3f s\n", elapsed);
+		for (i = 0; i < opened; i++) {
+			pipeline_stats(&pipelines[i], elapsed);
+			if (pipelines[i].fetch.items > 0)
+				succeeded++;
+		}
+	}
+
+	for (i = 0; i < opened; i++)
+		owon_usb_close(pipelines[i].dev_handle);
+	free(pipelines);
+	free(threads);
+
+	return succeeded == count ? 0 : -1;
+}
+
+static int output_daemon_spectrum(FILE *fp, const unsigned char *buffer, long length,
+				  const struct owon_dump_params *params)
+{
+	OWON_SPECTRUM_st spectra[OWON_DUMP_SPECTRA];
+	HEADER_st header;
+	int ret, i;
+
+	ret = owon_parse((const char *)buffer, length, &header);
+	if (ret < 0)
+		return ret;
+	memset(spectra, 0, sizeof(spectra));
+	ret = output_spectrum(fp, &header, spectra, params);
+	for (i = 0; i < OWON_DUMP_SPECTRA; i++)
+		owon_spectrum_free(&spectra[i]);
+	owon_free_header(&header);
+	return ret;
+}
+
+static int output_daemon_archive(FILE *fp, const unsigned char *buffer, long length)
+{
+	HEADER_st header;
+	int ret;
+
+	ret = owon_parse((const char *)buffer, length, &header);
+	if (ret < 0)
+		return ret;
+	ret = owon_output_archive(&header, buffer, length, fp, sysconf(_SC_NPROCESSORS_ONLN));
+	owon_free_header(&header);
+	return ret;
+}
+
+// The daemon already holds the device open, a capture only costs the
+// transfer. Columnar output is built by the daemon and comes back mapped.
+int run_daemon_client(struct owon_dump_params *params, FILE *fp)
+{
+	unsigned char *buffer = NULL;
+	COLUMNAR_st col;
+	long length;
+	int fd, ret;
+
+	fd = owon_daemon_connect(params->socket);
+	if (fd < 0) {
+		fprintf(stderr, "Unable to connect to owon-daemon on %s\n", params->socket);
+		return -1;
+	}
+
+	if (params->output == DUMP_OUTPUT_COLUMNAR) {
+		ret = owon_daemon_capture_columnar(fd, params->dnum, params->serial, params->mode, &col);
+		if (ret == 0) {
+			if (fwrite(col.data, 1, col.len, fp) != col.len)
+				ret = -1;
+			owon_columnar_close(&col);
+		}
+	} else {
+		length = owon_daemon_capture(fd, params->dnum, params->serial, params->mode, &buffer);
+		ret = length > 0 ? 0 : (int) length;
+		if (ret == 0 && params->output == DUMP_OUTPUT_CSV)
+			ret = output_csv(fp, (const char *)buffer, length);
+		else if (ret == 0 && params->output == DUMP_OUTPUT_SPECTRUM)
+			ret = output_daemon_spectrum(fp, buffer, length, params);
+		else if (ret == 0 && params->output == DUMP_OUTPUT_ARCHIVE)
+			ret = output_daemon_archive(fp, buffer, length);
+		else if (ret == 0)
+			output_raw(fp, (const char *)buffer, length);
+		free(buffer);
+	}
+	close(fd);
+
+	if (ret != 0)
+		fprintf(stderr, "Error capturing through owon-daemon: %d\n", ret);
+	return ret;
 }
 
 int main (int argc, char **argv)
@@ -129,25 +863,82 @@ int main (int argc, char **argv)
 		usage(argc, argv);
 
 	
-	unsigned char *buffer;
+	OWON_USB_BUFFER_st usb;
+	OWON_STREAM_st stream;
+	HEADER_st header;
+	OWON_SPECTRUM_st spectra[OWON_DUMP_SPECTRA];
+	int i;
+	const unsigned char *buffer = NULL;
 	long length = -1;
+
+	if (NULL != params.socket) {
+		FILE *fp = stdout;
+		int ret;
+		if (NULL != params.filename && NULL == (fp = fopen(params.filename, "wb"))) {
+			fprintf(stderr, "Unable to open %s\n", params.filename);
+			exit(EXIT_FAILURE);
+		}
+		ret = run_daemon_client(&params, fp);
+		if (NULL != params.filename)
+			fclose(fp);
+		return ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
+	if (params.all) {
+		int ret = run_all_devices(&params);
+		owon_usb_exit();
+		return ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
 	
-	struct libusb_device_handle *dev_handle = owon_usb_easy_open(params.dnum);
+	struct libusb_device_handle *dev_handle;
+	if (NULL != params.serial)
+		dev_handle = owon_usb_easy_open_serial(params.serial);
+	else
+		dev_handle = owon_usb_easy_open(params.dnum);
 	if (!dev_handle) {
 		fprintf(stderr,"USB: Impossible to connect to device.\n");
 		return 2;
 	}
 
-	length = owon_usb_read(dev_handle, &buffer, params.mode);
-	owon_usb_close(dev_handle);
+	if (params.continuous) {
+		int ret = run_continuous(&params, dev_handle);
+		owon_usb_close(dev_handle);
+		owon_usb_exit();
+		return ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
+	// The parsed outputs are parsed as the capture downloads, they can be
+	// written as soon as the last transfer is in
+	owon_usb_buffer_init(&usb);
+	if (params.output != DUMP_OUTPUT_RAW) {
+		owon_stream_init(&stream, &header, NULL, 1);
+		usb.stream = &stream;
+	}
+	length = owon_usb_read_into(dev_handle, &usb, params.mode);
+	if (length > 0 && NULL == (buffer = owon_usb_buffer_data(&usb)))
+		length = OWON_ERROR_MEMORY;
 
 	if (0 >= length) {
 		libusb_clear_halt(dev_handle,OWON_USB_ENDPOINT_IN);
 		libusb_clear_halt(dev_handle,OWON_USB_ENDPOINT_OUT);
 		libusb_reset_device(dev_handle);
+		owon_usb_close(dev_handle);
+		if (NULL != usb.stream)
+			owon_stream_abort(&stream);
+		owon_usb_buffer_free(&usb);
+		owon_usb_exit();
 		fprintf(stderr, "Error reading from device: %li\n", length);
 		exit(EXIT_FAILURE);
 	}
+	owon_usb_close(dev_handle);
+	if (NULL != usb.stream && owon_stream_finish(&stream) < 0) {
+		owon_usb_buffer_free(&usb);
+		owon_usb_exit();
+		fprintf(stderr, "Can't parse the capture\n");
+		exit(EXIT_FAILURE);
+	}
+	if (NULL != usb.stream && usb.count > 1)
+		owon_rebase_header(&header, buffer);
 	fprintf(stderr,"Writing file of length %d\n",length);
 	// Get file pointer to file or stdout.
 	FILE *fp;
@@ -163,14 +954,30 @@ int main (int argc, char **argv)
 
 	switch (params.output) {
 	case DUMP_OUTPUT_RAW:
-		output_raw(fp, buffer, length);
+		output_raw(fp, (const char *)buffer, length);
 		break;
 	case DUMP_OUTPUT_CSV:
-		output_csv(fp, buffer, length);
+		owon_output_csv(&header, fp);
+		break;
+	case DUMP_OUTPUT_COLUMNAR:
+		owon_output_columnar(&header, fp);
+		break;
+	case DUMP_OUTPUT_SPECTRUM:
+		memset(spectra, 0, sizeof(spectra));
+		output_spectrum(fp, &header, spectra, &params);
+		for (i = 0; i < OWON_DUMP_SPECTRA; i++)
+			owon_spectrum_free(&spectra[i]);
+		break;
+	case DUMP_OUTPUT_ARCHIVE:
+		if (owon_output_archive(&header, buffer, length, fp, sysconf(_SC_NPROCESSORS_ONLN)) != 0)
+			fprintf(stderr, "Can't write the archive\n");
 		break;
 	}
 	
-	free(buffer);
+	if (NULL != usb.stream)
+		owon_free_header(&header);
+	owon_usb_buffer_free(&usb);
+	owon_usb_exit();
 
 	// Only close fp if it's an actually file (don't close stdout).
 	if (NULL != params.filename) {
@@ -0,0 +1,234 @@
+/*
+ * owon-fuzz - fuzzing harness for the capture parser
+ * Copyright (c) 2014 Jonathan Bisson <bjonnh-owon@bjonnh.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>
+ */
+
+// Built with libFuzzer by default (cmake -DOWON_FUZZ=ON with clang).
+// With OWON_FUZZ_MAIN defined it gets a main reading the files given on the
+// command line, or stdin, which is what AFL expects.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "parse.h"
+#include "archive.h"
+#include "owon.h"
+
+// The incremental parser has to agree with owon_parse whatever the chunks,
+// their sizes are taken from the data. Its channels come from an arena kept
+// from input to input, as in a long running process.
+static void check_stream(const uint8_t *data, size_t size, const HEADER_st *header, int ret)
+{
+	static OWON_ARENA_st arena;
+	OWON_STREAM_st stream;
+	HEADER_st streamed;
+	size_t i, position = 0, chunk;
+	int streamed_ret = 0;
+
+	owon_stream_init(&stream, &streamed, NULL, 0);
+	owon_stream_set_arena(&stream, &arena);
+	while (position < size && streamed_ret == 0) {
+		chunk = 1 + data[position] % 61;
+		if (chunk > size - position)
+			chunk = size - position;
+		streamed_ret = owon_stream_feed(&stream, data + position, chunk);
+		position += chunk;
+	}
+	if (streamed_ret == 0)
+		streamed_ret = owon_stream_finish(&stream);
+
+	if ((ret < 0) != (streamed_ret < 0))
+		abort();
+	if (ret < 0)
+		return;
+	if (streamed.channels_count != header->channels_count)
+		abort();
+	for (i = 0; i < header->channels_count; i++)
+		if (streamed.channels[i]->samples_offset != header->channels[i]->samples_offset ||
+		    streamed.channels[i]->samples_file != header->channels[i]->samples_file)
+			abort();
+	owon_free_header(&streamed);
+}
+
+// The probe reads the same input from a file, by windows, and has to find
+// the same channels
+static void check_probe(const uint8_t *data, size_t size, const HEADER_st *header, int ret)
+{
+	static char path[32];
+	static int fd = -1;
+	HEADER_st probed;
+	size_t i;
+	int probed_ret;
+
+	if (fd == -1) {
+		fd = memfd_create("owon-fuzz", 0);
+		if (fd == -1)
+			abort();
+		snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+	}
+	if (ftruncate(fd, 0) == -1 || pwrite(fd, data, size, 0) != (ssize_t) size)
+		abort();
+
+	// An empty file can't be read, nor parsed
+	probed_ret = owon_probe_file(path, &probed);
+	if ((ret < 0) != (probed_ret < 0))
+		abort();
+	if (ret < 0)
+		return;
+	if (probed.channels_count != header->channels_count ||
+	    strcmp(probed.serial, header->serial) != 0)
+		abort();
+	for (i = 0; i < header->channels_count; i++)
+		if (probed.channels[i]->samples_offset != header->channels[i]->samples_offset ||
+		    probed.channels[i]->samples_file != header->channels[i]->samples_file ||
+		    probed.channels[i]->samples != NULL)
+			abort();
+	owon_free_header(&probed);
+}
+
+// Largest capture an archive restores in the harness
+#define OWON_FUZZ_CAPTURE (64 << 20)
+
+// Archives are opened from untrusted files as well: whatever the reader
+// accepts has to extract and read without leaving its buffers
+static void check_archive(const uint8_t *data, size_t size)
+{
+	const ARCHIVE_CHANNEL_st *channel;
+	ARCHIVE_st archive;
+	unsigned char *capture;
+	size_t i, count;
+
+	if (owon_archive_from_buffer(data, size, &archive) != OWON_SUCCESS)
+		return;
+	if (archive.header->capture_length <= OWON_FUZZ_CAPTURE) {
+		capture = malloc(archive.header->capture_length + 1);
+		if (capture == NULL)
+			abort();
+		owon_archive_extract(&archive, capture, 1);
+		for (i = 0; i < archive.header->channels_count; i++) {
+			channel = owon_archive_channel(&archive, i);
+			count = channel->samples < 256 ? channel->samples : 256;
+			owon_archive_read(&archive, i, channel->samples - count, count, capture, 1);
+		}
+		free(capture);
+	}
+	owon_archive_close(&archive);
+}
+
+// A capture that parses has to come back byte for byte from its archive
+static void check_archive_capture(const uint8_t *data, size_t size, const HEADER_st *header)
+{
+	ARCHIVE_st archive;
+	unsigned char *restored;
+	char *packed = NULL;
+	size_t packed_len = 0;
+	FILE *fp;
+
+	fp = open_memstream(&packed, &packed_len);
+	if (fp == NULL || owon_output_archive(header, data, size, fp, 1) != OWON_SUCCESS ||
+	    fclose(fp) != 0)
+		abort();
+	restored = malloc(size);
+	if (restored == NULL ||
+	    owon_archive_from_buffer(packed, packed_len, &archive) != OWON_SUCCESS ||
+	    owon_archive_extract(&archive, restored, 1) != OWON_SUCCESS ||
+	    memcmp(restored, data, size) != 0)
+		abort();
+	owon_archive_close(&archive);
+	free(restored);
+	free(packed);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	HEADER_st header;
+	float volts[256];
+	size_t i, sample, count;
+	int ret;
+
+	ret = owon_parse((const char *) data, size, &header);
+	check_stream(data, size, &header, ret);
+	check_probe(data, size, &header, ret);
+	check_archive(data, size);
+	if (ret < 0)
+		return 0;
+	check_archive_capture(data, size, &header);
+
+	// Touch every sample the parser claims to have
+	for (i = 0; i < header.channels_count; i++) {
+		CHANNEL_st *channel = header.channels[i];
+		for (sample = 0; sample < channel->samples_file; sample += count) {
+			count = channel->samples_file - sample;
+			if (count > sizeof(volts) / sizeof(*volts))
+				count = sizeof(volts) / sizeof(*volts);
+			owon_channel_volts(channel, sample, count, volts);
+		}
+	}
+
+	owon_free_header(&header);
+	return 0;
+}
+
+#ifdef OWON_FUZZ_MAIN
+static void run_file(FILE *fp)
+{
+	unsigned char *buffer = NULL;
+	size_t len = 0, size = 0, n;
+
+	do {
+		if (len == size) {
+			size = size ? 2 * size : 65536;
+			buffer = realloc(buffer, size);
+			if (buffer == NULL)
+				exit(EXIT_FAILURE);
+		}
+		n = fread(buffer + len, 1, size - len, fp);
+		len += n;
+	} while (n > 0);
+
+	// Exactly the input, reads past it are caught
+	buffer = realloc(buffer, len ? len : 1);
+	if (buffer == NULL)
+		exit(EXIT_FAILURE);
+	LLVMFuzzerTestOneInput(buffer, len);
+	free(buffer);
+}
+
+int main(int argc, char **argv)
+{
+	int i;
+	FILE *fp;
+
+	if (argc < 2) {
+		run_file(stdin);
+		return 0;
+	}
+	for (i = 1; i < argc; i++) {
+		fp = fopen(argv[i], "rb");
+		if (fp == NULL) {
+			fprintf(stderr, "Unable to open %s\n", argv[i]);
+			continue;
+		}
+		run_file(fp);
+		fclose(fp);
+	}
+	return 0;
+}
+#endif
@@ -0,0 +1,409 @@
+/*
+ * owon-index - index captures to query them without parsing them again
+ * Copyright (c) 2014 Jonathan Bisson <bjonnh-owon@bjonnh.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <math.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "parse.h"
+#include "archive.h"
+#include "measure.h"
+#include "index.h"
+#include "owon.h"
+
+struct index_params {
+	const char *output;
+	int measure;
+	int threads;
+};
+
+struct index_list {
+	char **paths;
+	size_t count;
+	size_t size;
+};
+
+struct index_job {
+	struct index_params *params;
+	struct index_list *list;
+	INDEX_st *previous;         // the index being updated, or NULL
+	const uint64_t *paths;      // its path column
+	uint32_t *sorted;           // its rows by path
+	OWON_INDEX_ROW_st *rows;    // one per path
+	int *status;                // of each row: <0 failed, 0 parsed, 1 reused
+	size_t next;
+	pthread_mutex_t lock;
+};
+
+void usage(char **argv)
+{
+	printf("usage: %s -f index [-m] [-j threads] [-l list] (file|directory)...\n", argv[0]);
+	printf("  -f index    index to write, the captures it already holds with the same size\n");
+	printf("              and modification time are taken from it instead of parsed again\n");
+	printf("  -m          also store the min, max and RMS of the channels (reads every sample)\n");
+	printf("  -j threads  number of workers (default: one per CPU)\n");
+	printf("  -l list     read input paths from list, one per line (- for stdin)\n");
+	printf("Directories are searched for *.bin and *.owz files.\n");
+	exit(EXIT_FAILURE);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1.0e9;
+}
+
+static int list_add(struct index_list *list, const char *path)
+{
+	char **paths;
+
+	if (list->count == list->size) {
+		list->size = list->size ? 2 * list->size : 64;
+		paths = realloc(list->paths, list->size * sizeof(char *));
+		if (paths == NULL)
+			return OWON_ERROR_MEMORY;
+		list->paths = paths;
+	}
+	list->paths[list->count] = strdup(path);
+	if (list->paths[list->count] == NULL)
+		return OWON_ERROR_MEMORY;
+	list->count++;
+	return OWON_SUCCESS;
+}
+
+static int has_capture_extension(const char *name)
+{
+	size_t len = strlen(name);
+	return len > 4 && (strcasecmp(name + len - 4, ".bin") == 0 || strcasecmp(name + len - 4, ".owz") == 0);
+}
+
+static int list_add_path(struct index_list *list, const char *path)
+{
+	struct stat stbuf;
+	struct dirent *entry;
+	char file[4096];
+	DIR *dir;
+	int ret = OWON_SUCCESS;
+
+	if (stat(path, &stbuf) == -1 || !S_ISDIR(stbuf.st_mode))
+		return list_add(list, path);
+
+	dir = opendir(path);
+	if (dir == NULL) {
+		fprintf(stderr, "Unable to open directory %s\n", path);
+		return OWON_ERROR_READ;
+	}
+	while (ret == OWON_SUCCESS && (entry = readdir(dir)) != NULL) {
+		if (!has_capture_extension(entry->d_name))
+			continue;
+		snprintf(file, sizeof(file), "%s/%s", path, entry->d_name);
+		ret = list_add(list, file);
+	}
+	closedir(dir);
+	return ret;
+}
+
+static int list_add_file(struct index_list *list, const char *listfile)
+{
+	char line[4096];
+	size_t len;
+	FILE *fp;
+	int ret = OWON_SUCCESS;
+
+	fp = strcmp(listfile, "-") == 0 ? stdin : fopen(listfile, "r");
+	if (fp == NULL) {
+		fprintf(stderr, "Unable to open %s\n", listfile);
+		return OWON_ERROR_READ;
+	}
+	while (ret == OWON_SUCCESS && fgets(line, sizeof(line), fp) != NULL) {
+		len = strlen(line);
+		while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+			line[--len] = 0;
+		if (len > 0)
+			ret = list_add_path(list, line);
+	}
+	if (fp != stdin)
+		fclose(fp);
+	return ret;
+}
+
+// Rows of the previous index sorted by path, to find the unchanged captures
+static const INDEX_st *sorting;
+static const uint64_t *sorting_paths;
+
+static int compare_rows(const void *a, const void *b)
+{
+	return strcmp(owon_index_string(sorting, sorting_paths[*(const uint32_t *) a]),
+		      owon_index_string(sorting, sorting_paths[*(const uint32_t *) b]));
+}
+
+static uint32_t *sort_previous(const INDEX_st *previous, const uint64_t *paths)
+{
+	size_t rows = previous->header->rows, i;
+	uint32_t *sorted;
+
+	sorted = malloc((rows ? rows : 1) * sizeof(uint32_t));
+	if (sorted == NULL)
+		return NULL;
+	for (i = 0; i < rows; i++)
+		sorted[i] = i;
+	sorting = previous;
+	sorting_paths = paths;
+	qsort(sorted, rows, sizeof(uint32_t), compare_rows);
+	return sorted;
+}
+
+// Indexed without -m, its channels have no min
+static int has_measures(const OWON_INDEX_ROW_st *row)
+{
+	const double *values;
+	int slot;
+
+	for (slot = 0; slot < OWON_INDEX_CHANNELS_MAX; slot++) {
+		values = row->values + OWON_INDEX_CHANNEL + slot * OWON_INDEX_FIELDS;
+		if (!isnan(values[OWON_INDEX_SAMPLES]) && isnan(values[OWON_INDEX_MIN]))
+			return 0;
+	}
+	return 1;
+}
+
+// Row of path in the previous index if the file didn't change since
+static int find_previous(struct index_job *job, const char *path, const struct stat *stbuf,
+			 OWON_INDEX_ROW_st *row)
+{
+	size_t low = 0, high, middle;
+	int cmp;
+
+	if (job->sorted == NULL)
+		return 0;
+	high = job->previous->header->rows;
+	while (low < high) {
+		middle = (low + high) / 2;
+		cmp = strcmp(path, owon_index_string(job->previous, job->paths[job->sorted[middle]]));
+		if (cmp == 0) {
+			owon_index_row(job->previous, job->sorted[middle], row);
+			return row->values[OWON_INDEX_SIZE] == (double) stbuf->st_size &&
+				row->values[OWON_INDEX_TIME] ==
+				stbuf->st_mtim.tv_sec + stbuf->st_mtim.tv_nsec / 1.0e9 &&
+				(!job->params->measure || has_measures(row));
+		}
+		if (cmp < 0)
+			high = middle;
+		else
+			low = middle + 1;
+	}
+	return 0;
+}
+
+static int index_capture(struct index_job *job, const char *path, OWON_ARENA_st *arena,
+			 OWON_INDEX_ROW_st *row)
+{
+	OWON_MEASURE_st *measures = NULL;
+	ARCHIVE_st archive;
+	HEADER_st header;
+	struct stat stbuf;
+	size_t i;
+	int ret;
+
+	if (stat(path, &stbuf) == -1) {
+		fprintf(stderr, "%s: can't read\n", path);
+		return OWON_ERROR_READ;
+	}
+	if (find_previous(job, path, &stbuf, row))
+		return 1;
+
+	// Without measures only the headers are read, not the samples
+	if (owon_archive_open(path, &archive) == OWON_SUCCESS) {
+		if (job->params->measure)
+			ret = owon_archive_parse(&archive, &header, 1);
+		else
+			ret = owon_archive_probe(&archive, &header);
+		owon_archive_close(&archive);
+	} else if (job->params->measure) {
+		ret = owon_parse_file_arena(path, &header, arena);
+	} else {
+		ret = owon_probe_file_arena(path, &header, arena);
+	}
+	if (ret < 0) {
+		fprintf(stderr, "%s: can't parse (%d)\n", path, ret);
+		return ret;
+	}
+
+	if (job->params->measure) {
+		measures = calloc(header.channels_count ? header.channels_count : 1, sizeof(OWON_MEASURE_st));
+		for (i = 0; measures != NULL && i < header.channels_count; i++)
+			if (owon_measure_channel(header.channels[i], &measures[i]) < 0)
+				break;
+		if (measures == NULL || i < header.channels_count) {
+			fprintf(stderr, "%s: can't measure\n", path);
+			free(measures);
+			owon_free_header(&header);
+			return OWON_ERROR;
+		}
+	}
+
+	owon_index_describe(&header, measures, path,
+			    stbuf.st_mtim.tv_sec + stbuf.st_mtim.tv_nsec / 1.0e9, stbuf.st_size, row);
+	free(measures);
+	owon_free_header(&header);
+	return 0;
+}
+
+static void *index_thread(void *arg)
+{
+	struct index_job *job = arg;
+	OWON_ARENA_st arena;
+	size_t index;
+
+	owon_arena_init(&arena);
+	for (;;) {
+		pthread_mutex_lock(&job->lock);
+		index = job->next++;
+		pthread_mutex_unlock(&job->lock);
+		if (index >= job->list->count)
+			break;
+		job->status[index] = index_capture(job, job->list->paths[index], &arena,
+						   &job->rows[index]);
+	}
+	owon_arena_free(&arena);
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	struct index_params params;
+	struct index_list list;
+	struct index_job job;
+	OWON_INDEX_BUILDER_st builder;
+	INDEX_st previous;
+	pthread_t *threads;
+	size_t i, parsed = 0, reused = 0, failed = 0;
+	char temporary[4096];
+	double start, elapsed;
+	FILE *fp;
+	int c, started = 0, ret = OWON_SUCCESS;
+
+	params.output = NULL;
+	params.measure = 0;
+	params.threads = sysconf(_SC_NPROCESSORS_ONLN);
+	memset(&list, 0, sizeof(list));
+
+	while ((c = getopt(argc, argv, "f:mj:l:h")) != -1) {
+		switch (c) {
+		case 'f':
+			params.output = optarg;
+			break;
+		case 'm':
+			params.measure = 1;
+			break;
+		case 'j':
+			if (sscanf(optarg, "%d", &params.threads) != 1 || params.threads < 1)
+				usage(argv);
+			break;
+		case 'l':
+			if (list_add_file(&list, optarg) != OWON_SUCCESS)
+				return EXIT_FAILURE;
+			break;
+		default:
+			usage(argv);
+		}
+	}
+	for (i = optind; i < (size_t) argc; i++)
+		if (list_add_path(&list, argv[i]) != OWON_SUCCESS)
+			return EXIT_FAILURE;
+	if (params.output == NULL)
+		usage(argv);
+	if (params.threads < 1)
+		params.threads = 1;
+	if ((size_t) params.threads > list.count)
+		params.threads = list.count ? list.count : 1;
+
+	memset(&job, 0, sizeof(job));
+	job.params = &params;
+	job.list = &list;
+	pthread_mutex_init(&job.lock, NULL);
+	if (owon_index_open(params.output, &previous) == OWON_SUCCESS) {
+		job.previous = &previous;
+		c = owon_index_find(&previous, "path");
+		job.paths = c < 0 ? NULL : owon_index_offsets(&previous, c);
+		if (job.paths != NULL)
+			job.sorted = sort_previous(&previous, job.paths);
+	}
+	job.rows = malloc((list.count ? list.count : 1) * sizeof(OWON_INDEX_ROW_st));
+	job.status = malloc((list.count ? list.count : 1) * sizeof(int));
+	threads = malloc(params.threads * sizeof(pthread_t));
+	if (job.rows == NULL || job.status == NULL || threads == NULL) {
+		fprintf(stderr, "Can't allocate the rows\n");
+		return EXIT_FAILURE;
+	}
+
+	start = now();
+	for (c = 1; c < params.threads; c++)
+		if (pthread_create(&threads[started], NULL, index_thread, &job) == 0)
+			started++;
+	index_thread(&job);
+	for (c = 0; c < started; c++)
+		pthread_join(threads[c], NULL);
+
+	// Rows in the order of the inputs, written next to the index and renamed
+	// over it: the previous one is still mapped and readers may have it open
+	owon_index_builder_init(&builder);
+	for (i = 0; i < list.count && ret == OWON_SUCCESS; i++) {
+		if (job.status[i] < 0) {
+			failed++;
+			continue;
+		}
+		if (job.status[i] > 0)
+			reused++;
+		else
+			parsed++;
+		ret = owon_index_add(&builder, &job.rows[i]);
+	}
+	snprintf(temporary, sizeof(temporary), "%s.tmp", params.output);
+	fp = ret == OWON_SUCCESS ? fopen(temporary, "wb") : NULL;
+	if (fp == NULL || owon_output_index(&builder, fp) != OWON_SUCCESS || fclose(fp) != 0 ||
+	    rename(temporary, params.output) != 0) {
+		fprintf(stderr, "Can't write %s\n", params.output);
+		ret = OWON_ERROR;
+	}
+	elapsed = now() - start;
+
+	fprintf(stderr, "%zu captures indexed (%zu parsed, %zu unchanged), %zu failed, in %.3f s\n",
+		builder.rows, parsed, reused, failed, elapsed);
+
+	owon_index_builder_free(&builder);
+	if (job.previous != NULL)
+		owon_index_close(&previous);
+	free(job.sorted);
+	free(job.rows);
+	free(job.status);
+	free(threads);
+	for (i = 0; i < list.count; i++)
+		free(list.paths[i]);
+	free(list.paths);
+	pthread_mutex_destroy(&job.lock);
+
+	return ret == OWON_SUCCESS && failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -19,64 +19,268 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
 #include <sys/stat.h>
 #include "parse.h"
+#include "columnar.h"
+#include "archive.h"
+#include "measure.h"
+#include "spectrum.h"
+#include "trigger.h"
+#include "owon.h"
 
-int main(int argc, char **argv) {
-  FILE *fp,*fp2;
-  int fd,fd2;
+// Most events -t prints
+#define OWON_PARSE_MAX_EVENTS (1 << 20)
+
+void usage(char **argv) {
+  printf("usage: %s [-o (csv|col|fft|owz|bin)] [-p precision] [-j threads] [-m] [-w window] [-t trigger] <binfile|owzfile>\n", argv[0]);
+  printf("       %s -i|--info <binfile|owzfile>...\n", argv[0]);
+  printf("  -i, --info    print the model, serial and channel settings of the\n");
+  printf("                captures as CSV, read from their headers only\n");
+  printf("  -o format     output.csv (default), columnar binary output.col, the\n");
+  printf("                spectrum of the channels in dBV to spectrum.csv, compressed\n");
+  printf("                archive output.owz or the original capture output.bin\n");
+  printf("  -p precision  digits after the decimal point (default %d)\n", OWON_CSV_PRECISION);
+  printf("  -j threads    format the CSV with threads workers (0: one per CPU)\n");
+  printf("  -m            print the measurements of the channels as CSV instead\n");
+  printf("  -w window     window of the spectrum: rect, hann (default), blackman or flattop\n");
+  printf("  -t trigger    print the events of the trigger as CSV instead, e.g.\n");
+  printf("                edge,level=1.5,slope=falling  pulse,level=0.8,width=<1e-6,ch=2\n");
+  printf("                runt,low=0.5,high=2.5,hyst=0.05  window,low=-1,high=1\n");
+}
+
+// The samples are neither read nor parsed, a capture costs a few small reads
+static int print_info(const char *path) {
+  ARCHIVE_st archive;
+  HEADER_st header;
+  CHANNEL_st *channel;
+  size_t i;
+  int ret;
+
+  if (owon_archive_open(path, &archive) == OWON_SUCCESS) {
+    ret = owon_archive_probe(&archive, &header);
+    owon_archive_close(&archive);
+  } else {
+    ret = owon_probe_file(path, &header);
+  }
+  if (ret < 0) {
+    fprintf(stderr, "Error: %s is not a valid capture (%d)\n", path, ret);
+    return ret;
+  }
+  for (i = 0; i < header.channels_count; i++) {
+    channel = header.channels[i];
+    printf("%s,%s,%s,%s,%u,%.9g,%.9g,%u,%.9g,%.9g\n", path, header.model, header.serial,
+           channel->name, channel->samples_file, channel->timediv, channel->voltsdiv,
+           channel->attenuation, channel->frequency, channel->period);
+  }
+  owon_free_header(&header);
+  return OWON_SUCCESS;
+}
 
-  int i;
+int main(int argc, char **argv) {
+  static const struct option options[] = {
+    { "info", no_argument, NULL, 'i' },
+    { NULL, 0, NULL, 0 }
+  };
+  FILE *fp2;
+  int ret, c;
+  int precision = OWON_CSV_PRECISION;
+  int threads = 1;
+  int columnar = 0;
+  int measure = 0;
+  int spectrum = 0;
+  int archived = 0;
+  int restored = 0;
+  int window = OWON_WINDOW_HANN;
+  int triggered = 0;
+  int info = 0;
+  OWON_TRIGGER_st trigger;
+  OWON_MEASURE_st *measures;
+  ARCHIVE_st archive;
 
   HEADER_st file_header;
 
-  struct stat stbuf;
+  while ((c = getopt_long(argc, argv, "o:p:j:mw:t:ih", options, NULL)) != -1) {
+    switch (c) {
+    case 'i':
+      info = 1;
+      break;
+    case 'o':
+      if (strcasecmp(optarg, "col") == 0) {
+        columnar = 1;
+      } else if (strcasecmp(optarg, "fft") == 0) {
+        spectrum = 1;
+      } else if (strcasecmp(optarg, "owz") == 0) {
+        archived = 1;
+      } else if (strcasecmp(optarg, "bin") == 0) {
+        restored = 1;
+      } else if (strcasecmp(optarg, "csv") != 0) {
+        usage(argv);
+        return 1;
+      }
+      break;
+    case 'p':
+      if (sscanf(optarg, "%d", &precision) != 1 || precision < 0) {
+        usage(argv);
+        return 1;
+      }
+      break;
+    case 'j':
+      if (sscanf(optarg, "%d", &threads) != 1 || threads < 0) {
+        usage(argv);
+        return 1;
+      }
+      if (threads == 0)
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+      break;
+    case 'm':
+      measure = 1;
+      break;
+    case 't':
+      if (owon_trigger_parse(optarg, &trigger) != OWON_SUCCESS) {
+        printf("Error: invalid trigger %s\n", optarg);
+        usage(argv);
+        return 1;
+      }
+      triggered = 1;
+      break;
+    case 'w':
+      window = owon_spectrum_window(optarg);
+      if (window < 0) {
+        usage(argv);
+        return 1;
+      }
+      break;
+    default:
+      usage(argv);
+      return 1;
+    }
+  }
 
-  char *buffer;
-  
-  if (argc<2) {
+  if (optind >= argc) {
     printf("Give me the food !\n");
     return 1;
   }
 
-  fd=open(argv[1],O_RDONLY);
-  if (fd==-1) {
-    printf("Error: can't open file %s\n",argv[1]);
-    return(128);
-  }
-  fp=fdopen(fd,"rb");
-  if (fp==NULL) {
-    printf("Error: can't open file %s\n",argv[1]);
-    return(128);
+  if (info) {
+    printf("file,model,serial,channel,samples,timediv,voltsdiv,attenuation,frequency,period\n");
+    for (ret = 0; optind < argc; optind++)
+      if (print_info(argv[optind]) < 0)
+        ret = 124;
+    return ret;
   }
 
-  if (fstat(fd, &stbuf) == -1) {
-    printf("Error: %s may not be a regular file\n",argv[1]);
-    return(127);
+  // The file is mapped, channels are parsed straight from the page cache.
+  // An archive is restored in memory first.
+  if (owon_archive_open(argv[optind], &archive) == OWON_SUCCESS) {
+    ret = owon_archive_parse(&archive, &file_header, sysconf(_SC_NPROCESSORS_ONLN));
+    owon_archive_close(&archive);
+  } else {
+    ret = owon_parse_file(argv[optind],&file_header);
+  }
+  if (ret == OWON_ERROR_READ) {
+    printf("Error: can't read file %s\n",argv[optind]);
+    return(125);
+  }
+  if (ret == OWON_ERROR_MEMORY) {
+    printf("Error: can't map file %s\n",argv[optind]);
+    return(126);
+  }
+  if (ret < 0) {
+    printf("Error: %s is not a valid capture\n",argv[optind]);
+    return(124);
   }
 
-  buffer = calloc(stbuf.st_size,sizeof(char));
-  if (buffer==NULL) {
+  if (measure) {
+    char line[1024];
+    size_t i;
 
-    printf("Can't allocate %d bytes of memory.\n",stbuf.st_size);
-    return(126);
+    measures = calloc(file_header.channels_count ? file_header.channels_count : 1, sizeof(OWON_MEASURE_st));
+    if (measures == NULL || owon_measure_header(&file_header, measures, threads) < 0) {
+      printf("Error: can't measure %s\n",argv[optind]);
+      free(measures);
+      owon_free_header(&file_header);
+      return(126);
+    }
+    fputs(OWON_MEASURE_CSV_HEADER, stdout);
+    for (i = 0; i < file_header.channels_count; i++) {
+      owon_measure_format(line, sizeof(line), argv[optind], file_header.channels[i], &measures[i]);
+      fputs(line, stdout);
+    }
+    free(measures);
+    owon_free_header(&file_header);
+    return(0);
   }
-  
 
-  if (fread((void *)buffer,sizeof(char),stbuf.st_size,fp) != stbuf.st_size) {
-    printf("Error: can't read file %s\n",argv[1]);
-    return(125);
+  if (triggered) {
+    OWON_TRIGGER_EVENT_st *events;
+    long count, i;
+
+    events = malloc(OWON_PARSE_MAX_EVENTS * sizeof(OWON_TRIGGER_EVENT_st));
+    count = events == NULL ? OWON_ERROR_MEMORY :
+      owon_trigger_search_header(&trigger, &file_header, events, OWON_PARSE_MAX_EVENTS);
+    if (count < 0) {
+      printf("Error: can't search %s\n",argv[optind]);
+    } else {
+      printf("channel,slope,sample,time,length\n");
+      for (i = 0; i < count; i++)
+        printf("%s,%s,%zu,%.9g,%zu\n", file_header.channels[events[i].channel]->name,
+               owon_trigger_slope_name(events[i].slope), events[i].sample,
+               events[i].time, events[i].length);
+      if (count == OWON_PARSE_MAX_EVENTS)
+        fprintf(stderr, "Only the first %d events are printed\n", OWON_PARSE_MAX_EVENTS);
+    }
+    free(events);
+    owon_free_header(&file_header);
+    return count < 0 ? 126 : 0;
   }
 
+  if (spectrum) {
+    OWON_SPECTRUM_st *spectra;
+    size_t i;
+
+    spectra = calloc(file_header.channels_count ? file_header.channels_count : 1, sizeof(OWON_SPECTRUM_st));
+    ret = spectra == NULL ? OWON_ERROR_MEMORY :
+      owon_spectrum_add_header(spectra, file_header.channels_count, &file_header, window, 0);
+    if (ret > 0) {
+      fp2=fopen("spectrum.csv","w+");
+      owon_output_spectrum(&file_header, spectra, ret, fp2);
+      fclose(fp2);
+    } else {
+      printf("Error: can't compute the spectrum of %s\n",argv[optind]);
+    }
+    for (i = 0; spectra != NULL && i < file_header.channels_count; i++)
+      owon_spectrum_free(&spectra[i]);
+    free(spectra);
+    owon_free_header(&file_header);
+    return ret > 0 ? 0 : 126;
+  }
 
-  owon_parse(buffer,stbuf.st_size,&file_header);
+  if (archived || restored) {
+    fp2=fopen(archived ? "output.owz" : "output.bin","wb");
+    if (archived)
+      ret = owon_output_archive(&file_header, file_header.map, file_header.map_len, fp2,
+                                sysconf(_SC_NPROCESSORS_ONLN));
+    else
+      ret = fwrite(file_header.map, 1, file_header.map_len, fp2) == file_header.map_len ? 0 : OWON_ERROR;
+    if (ret != 0)
+      printf("Error: can't write the %s\n", archived ? "archive" : "capture");
+    fclose(fp2);
+    owon_free_header(&file_header);
+    return ret != 0 ? 126 : 0;
+  }
 
-  fp2=fopen("output.csv","w+");
-  
-  owon_output_csv(&file_header,fp2);
+  if (columnar) {
+    fp2=fopen("output.col","wb");
+    owon_output_columnar(&file_header,fp2);
+  } else {
+    fp2=fopen("output.csv","w+");
+    owon_output_csv_parallel(&file_header,fp2,precision,threads);
+  }
   fclose(fp2);
-  free((char *)buffer);
   owon_free_header(&file_header);
   return(0);
 }
@@ -0,0 +1,192 @@
+/*
+ * owon-query - select captures from an index built by owon-index
+ * Copyright (c) 2014 Jonathan Bisson <bjonnh-owon@bjonnh.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+#include "index.h"
+#include "format.h"
+#include "owon.h"
+
+void usage(char **argv)
+{
+	printf("usage: %s [-c columns] [-n] [-L] index [condition]...\n", argv[0]);
+	printf("  -c columns  comma separated columns to print as CSV (default: path)\n");
+	printf("  -n          only print how many captures match\n");
+	printf("  -L          list the columns of the index\n");
+	printf("Conditions are column, operator (= != < <= > >= or ~ for wildcards) and value,\n");
+	printf("every one must match: 'ch1.frequency>1000' serial=SDS7102V00001 'time>=2014-05-01'\n");
+	exit(EXIT_FAILURE);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1.0e9;
+}
+
+// Quoted the way CSV readers expect when it holds a separator, a quote or
+// a line break, as a path may
+static void print_string(OUTBUF_st *out, const char *string)
+{
+	if (string[strcspn(string, ",\"\r\n")] == '\0') {
+		owon_outbuf_string(out, string);
+		return;
+	}
+	owon_outbuf_char(out, '"');
+	for (; *string != '\0'; string++) {
+		if (*string == '"')
+			owon_outbuf_char(out, '"');
+		owon_outbuf_char(out, *string);
+	}
+	owon_outbuf_char(out, '"');
+}
+
+static void print_value(OUTBUF_st *out, const INDEX_st *index, int column, size_t row)
+{
+	const INDEX_COLUMN_st *record = owon_index_column(index, column);
+	char text[64];
+	struct tm tm;
+	time_t seconds;
+	double value;
+
+	if (record->type == OWON_INDEX_STRING) {
+		print_string(out, owon_index_string(index, owon_index_offsets(index, column)[row]));
+		return;
+	}
+	value = owon_index_numbers(index, column)[row];
+	if (isnan(value))
+		return;
+	if (strcmp(record->name, "time") == 0) {
+		seconds = value;
+		gmtime_r(&seconds, &tm);
+		strftime(text, sizeof(text), "%Y-%m-%dT%H:%M:%SZ", &tm);
+	} else {
+		snprintf(text, sizeof(text), "%.15g", value);
+	}
+	owon_outbuf_string(out, text);
+}
+
+int main(int argc, char **argv)
+{
+	OWON_INDEX_CONDITION_st *conditions;
+	INDEX_st index;
+	OUTBUF_st out;
+	const char *names = "path";
+	char *list, *name;
+	int columns[OWON_INDEX_COLUMNS * 2];
+	int count_only = 0, list_columns = 0, columns_count = 0, c, ret;
+	size_t conditions_count, selected, i, j;
+	uint32_t *rows;
+	double start;
+
+	while ((c = getopt(argc, argv, "c:nLh")) != -1) {
+		switch (c) {
+		case 'c':
+			names = optarg;
+			break;
+		case 'n':
+			count_only = 1;
+			break;
+		case 'L':
+			list_columns = 1;
+			break;
+		default:
+			usage(argv);
+		}
+	}
+	if (optind >= argc)
+		usage(argv);
+
+	ret = owon_index_open(argv[optind], &index);
+	if (ret < 0) {
+		fprintf(stderr, "Error: %s is not a valid index (%d)\n", argv[optind], ret);
+		return EXIT_FAILURE;
+	}
+	if (list_columns) {
+		for (i = 0; i < index.header->columns_count; i++)
+			printf("%s\n", owon_index_column(&index, i)->name);
+		owon_index_close(&index);
+		return EXIT_SUCCESS;
+	}
+
+	list = strdup(names);
+	if (list == NULL) {
+		fprintf(stderr, "Error: can't allocate the query\n");
+		return EXIT_FAILURE;
+	}
+	for (name = strtok(list, ","); name != NULL; name = strtok(NULL, ",")) {
+		c = owon_index_find(&index, name);
+		if (c < 0 || columns_count == OWON_INDEX_COLUMNS * 2) {
+			fprintf(stderr, "Error: no column %s in the index\n", name);
+			return EXIT_FAILURE;
+		}
+		columns[columns_count++] = c;
+	}
+	free(list);
+
+	conditions_count = argc - optind - 1;
+	conditions = calloc(conditions_count ? conditions_count : 1, sizeof(OWON_INDEX_CONDITION_st));
+	rows = malloc((index.header->rows ? index.header->rows : 1) * sizeof(uint32_t));
+	if (conditions == NULL || rows == NULL) {
+		fprintf(stderr, "Error: can't allocate the query\n");
+		return EXIT_FAILURE;
+	}
+	for (i = 0; i < conditions_count; i++) {
+		if (owon_index_condition(&index, argv[optind + 1 + i], &conditions[i]) != OWON_SUCCESS) {
+			fprintf(stderr, "Error: invalid condition %s\n", argv[optind + 1 + i]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	start = now();
+	selected = owon_index_select(&index, conditions, conditions_count, rows);
+	fprintf(stderr, "%zu of %llu captures in %.3f ms\n", selected,
+		(unsigned long long) index.header->rows, (now() - start) * 1.0e3);
+
+	if (count_only) {
+		printf("%zu\n", selected);
+	} else if (owon_outbuf_init(&out, stdout, OWON_OUTBUF_SIZE) == 0) {
+		for (j = 0; j < (size_t) columns_count; j++) {
+			if (j > 0)
+				owon_outbuf_char(&out, ',');
+			owon_outbuf_string(&out, owon_index_column(&index, columns[j])->name);
+		}
+		owon_outbuf_char(&out, '\n');
+		for (i = 0; i < selected; i++) {
+			for (j = 0; j < (size_t) columns_count; j++) {
+				if (j > 0)
+					owon_outbuf_char(&out, ',');
+				print_value(&out, &index, columns[j], rows[i]);
+			}
+			owon_outbuf_char(&out, '\n');
+		}
+		owon_outbuf_flush(&out);
+		owon_outbuf_free(&out);
+	}
+
+	free(rows);
+	free(conditions);
+	owon_index_close(&index);
+	return EXIT_SUCCESS;
+}
@@ -27,5 +27,16 @@
 #define OWON_ERROR_HEADER           (-5)
 #define OWON_ERROR_USB              (-6)
 #define OWON_ERROR_USB_NOT_FOUND    (-7)
+#define OWON_ERROR_OVERRUN          (-8)
+
+// Files written by the library (columnar.h, archive.h, index.h) hold their
+// structs and numbers as laid out in memory, and the readers map them back
+// without copying. Their headers, records and index columns are therefore
+// in the byte order of the host that wrote them; samples stay little-endian
+// as in the capture. A file from a host of the other byte order has its
+// version swapped and is refused with OWON_ERROR_UNSUPPORTED.
+// OWON_ON_DISK makes sure the compiler keeps the size of such a struct.
+#define OWON_ON_DISK(type, size) \
+	_Static_assert(sizeof(type) == (size), #type " must be " #size " bytes")
 
 #endif
@@ -19,12 +19,31 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
 #include "parse.h"
+#include "decode.h"
+#include "format.h"
+#include "owon.h"
 
 #define ARRAY_LENGTH(x) (sizeof(x)/sizeof(*(x)))
 
+// Rows converted at once by the CSV output
+#define OWON_CSV_BLOCK 4096
+// Rows formatted by each task of the parallel CSV output
+#define OWON_CSV_CHUNK 65536
+// Bytes of a channel header, before its samples
+#define OWON_CHANNEL_HEADER (3 + 14 * 4)
+// Arena blocks are aligned for any type, the first bytes link them
+#define OWON_ARENA_ALIGN 16
+#define OWON_ARENA_MIN 4096
+// Channels an arena is first sized for: a part has up to four
+#define OWON_ARENA_CHANNELS 8
+
 // _attenuation_table is from the Levi Larsen app
 static float _attenuation_table[] = { 1.0e0, 1.0e1, 1.0e2, 1.0e3 }; // We are only sure for these
 static float _volt_table[] = {
@@ -164,10 +183,27 @@ static void debug_file(HEADER_st *file_header) {
 #endif
 }
 
+// Every read checks that the data is there. When it is not, nothing is read,
+// data_p stays where it is and the error is kept in the cursor: the caller
+// only has to check data->error once after a series of reads.
+
+static int data_need(DATA_st *data, size_t len) {
+	if (data->error)
+		return 0;
+	if (data->data_p > data->data + data->len ||
+	    len > (size_t)(data->data + data->len - data->data_p)) {
+		data->error = OWON_ERROR_HEADER;
+		return 0;
+	}
+	return 1;
+}
+
 // Reading an unsigned 32 and increment the data_p position accordingly
 
 static uint32_t read_u32(DATA_st *data) {
 	uint32_t temp;
+	if (!data_need(data, sizeof(uint32_t)))
+		return 0;
 	temp = (uint32_t)(data->data_p[3]) << 24 |
 		(uint32_t)(data->data_p[2]) << 16 |
 		(uint32_t)(data->data_p[1]) << 8  |
@@ -179,23 +215,7 @@ static uint32_t read_u32(DATA_st *data) {
 // Reading a signed 32 and increment the data_p position accordingly
 
 static int32_t read_32(DATA_st *data) {
-	int32_t temp;
-	temp = (int32_t)(data->data_p[3]) << 24 |
-		(int32_t)(data->data_p[2]) << 16 |
-		(int32_t)(data->data_p[1]) << 8  |
-		(int32_t)(data->data_p[0]);
-	data->data_p += sizeof(int32_t);
-	return temp;
-}
-
-// Reading a signed 16 and increment the data_p position accordingly
-
-static int16_t read_16(DATA_st *data) {
-	int16_t temp;
-	temp = (int16_t)(data->data_p[1]) << 8  |
-		(int16_t)(data->data_p[0]);
-	data->data_p += sizeof(uint16_t);
-	return temp;
+	return (int32_t) read_u32(data);
 }
 
 // Reading a float and increment the data_p position accordingly
@@ -203,6 +223,8 @@ static int16_t read_16(DATA_st *data) {
 static float read_f(DATA_st *data) {
 	float temp;
 
+	if (!data_need(data, sizeof(float)))
+		return 0;
 	memcpy(&temp,&(*data->data_p),4);
 
 	data->data_p += sizeof(float);
@@ -213,16 +235,21 @@ static float read_f(DATA_st *data) {
 
 static unsigned char read_char(DATA_st *data) {
 	unsigned char temp;
+	if (!data_need(data, sizeof(unsigned char)))
+		return 0;
 	temp = (unsigned char)(*data->data_p);
 	data->data_p += sizeof(unsigned char);
 	return temp;
 }
 
 // Reading a string from *data_p of length len-1, and copying in the memory area at destination.
-// add a \0 at the end of destination and increment data_p position
-void read_string_nullify(DATA_st *data, char *destination, size_t len) {
+// add a \0 at the end of destination (len bytes long) and increment data_p position
+static void read_string_nullify(DATA_st *data, char *destination, size_t len) {
+	destination[0]=0;
+	if (!data_need(data, len-1))
+		return;
 	memcpy(destination,data->data_p,len-1);
-	destination[len]=0;
+	destination[len-1]=0;
 	data->data_p += len-1;
 }
 
@@ -230,20 +257,20 @@ void read_string_nullify(DATA_st *data, char *destination, size_t len) {
 // then increment data_p position
 
 static void read_string(DATA_st *data, char *destination, size_t len) {
+	if (!data_need(data, len))
+		return;
 	memcpy(destination,data->data_p,len);
 	data->data_p += len;
 }
 
-// Parse a channel from data, len will be used to check if there is enough data
+// Parse the header of a channel, the samples follow it
 
-static int parse_channel(DATA_st *data_s, CHANNEL_st *channel)
+static int parse_channel_header(DATA_st *data_s, CHANNEL_st *channel)
 {
-	size_t i;
-
-	read_string_nullify(data_s,channel->name,4);
+	read_string_nullify(data_s,(char *)channel->name,sizeof(channel->name));
 	channel->unknownint = read_32(data_s);
 	channel->datatype = read_32(data_s);
-	read_string(data_s,channel->unknown4,4);
+	read_string(data_s,(char *)channel->unknown4,4);
 	channel->samples_count = read_u32(data_s);
 	channel->samples_file = read_u32(data_s);
 	channel->samples3 = read_u32(data_s);
@@ -255,37 +282,61 @@ static int parse_channel(DATA_st *data_s, CHANNEL_st *channel)
 	channel->frequency = read_f(data_s);
 	channel->period = read_f(data_s);
 	channel->volts_mul = read_f(data_s);
-	channel->data = (double *) calloc(channel->samples_file,sizeof(double));
-	if (channel->data == NULL) {
-		printf("Error: Can't allocate %d bytes of memory.\n",channel->samples_file*sizeof(int16_t));
-		return 2;
-	}
-	for (i=0;i<channel->samples_file-1;i++) {
+	return data_s->error;
+}
 
-		if (channel->datatype == 2) {
-			channel->data[i] = read_16(data_s);
-		} else {
-			channel->data[i] = read_char(data_s);
-		}
+// Parse a channel from data, the header and the samples have to fit in the data
+
+static int parse_channel(DATA_st *data_s, CHANNEL_st *channel)
+{
+	size_t payload;
+
+	if (parse_channel_header(data_s, channel) < 0)
+		return data_s->error;
+
+	// Don't trust samples_file, the payload has to be in the data
+	payload = (size_t) channel->samples_file * owon_channel_sample_size(channel);
+	if (!data_need(data_s, payload)) {
+		fprintf(stderr,"Error: channel %s declares %u samples past the end of data.\n",
+			channel->name,channel->samples_file);
+		return data_s->error;
 	}
+	channel->samples = data_s->data_p;
+	channel->samples_offset = data_s->data_p - data_s->data;
+	data_s->data_p += payload;
 
 	debug_channel(channel);
+	return 0;
 }
 
-int owon_parse(const char * const buf, size_t len, HEADER_st *header)
+// Captures coming over usb start with a 12 bytes prefix before the model
+#define OWON_PART_PREFIX 12
+
+static int is_part_start(const unsigned char *p, const unsigned char *end)
 {
-	unsigned int i;
-	DATA_st data;
-	DATA_st *data_s = &data;
-	CHANNEL_st **channel_p;
+	return end - p >= OWON_PART_PREFIX + 3 && strncmp((const char *)p + OWON_PART_PREFIX,"SPB",3) == 0;
+}
 
-	data_s->data = buf;
-	data_s->data_p = buf;
-	data_s->len = len;
+// End of a part starting at part as declared by its prefix, or end
+
+static uint64_t part_end_at(const HEADER_st *header, uint64_t part, uint64_t end)
+{
+	if (header->length > 0 && end - part >= OWON_PART_PREFIX &&
+	    header->length <= end - part - OWON_PART_PREFIX)
+		return part + OWON_PART_PREFIX + header->length;
+	return end;
+}
+
+// Parse the header of a part, with its 12 bytes USB prefix when present.
+// Returns the end of the part as declared by the prefix, or the end of data.
+
+static const unsigned char *parse_part_header(DATA_st *data_s, HEADER_st *header)
+{
+	const unsigned char *part = data_s->data_p;
+	const unsigned char *end = data_s->data + data_s->len;
 
-	memset(header,0,sizeof(HEADER_st)); // Putting NULL in the structure for fields not present
   // This is used only with data coming over usb, we jump the first 12 bytes.
-	if (strncmp((data_s->data_p)+12,"SPB",3) == 0) {
+	if (is_part_start(data_s->data_p, end)) {
 		header->length = read_32(data_s); // This is the length without the LAN header
 		header->unknown1 = read_32(data_s);
 		header->type = read_32(data_s); // This seems to be related to the number of parts in the file
@@ -317,54 +368,843 @@ int owon_parse(const char * const buf, size_t len, HEADER_st *header)
 		header->unknownstatus = read_char(data_s);
 		header->unknownvalue1 = read_u32(data_s);
 		header->unknownvalue2 = read_char(data_s);
-		read_string(data_s,header->unknown3,sizeof(header->unknown3));
+		read_string(data_s,(char *)header->unknown3,sizeof(header->unknown3));
 
 		//    debug_file(header);
 
 	}
 
+	return part + part_end_at(header, 0, end - part);
+}
+
+// Chunks start with "CH" and the channel number.
+// Anything else (INFO block, padding) is skipped up to the next chunk.
+
+static int is_channel_start(const unsigned char *p, const unsigned char *end)
+{
+	return end - p >= 3 && p[0] == 'C' && p[1] == 'H' && p[2] >= '0' && p[2] <= '9';
+}
+
+static const unsigned char *find_chunk(const unsigned char *p, const unsigned char *end)
+{
+	while (p < end) {
+		p = memchr(p, 'C', end - p);
+		if (p == NULL)
+			return end;
+		if (is_channel_start(p, end))
+			return p;
+		p++;
+	}
+	return end;
+}
+
+// Arena
+
+void owon_arena_init(OWON_ARENA_st *arena)
+{
+	memset(arena, 0, sizeof(OWON_ARENA_st));
+}
+
+// The current block, if any, goes to the full ones
+static int arena_block(OWON_ARENA_st *arena, size_t size)
+{
+	unsigned char *block = malloc(size);
+
+	if (block == NULL)
+		return OWON_ERROR_MEMORY;
+	if (arena->block != NULL) {
+		memcpy(arena->block, &arena->full, sizeof(arena->full));
+		arena->full = arena->block;
+	}
+	arena->block = block;
+	arena->size = size;
+	arena->used = OWON_ARENA_ALIGN;
+	arena->total += size;
+	return OWON_SUCCESS;
+}
+
+void *owon_arena_alloc(OWON_ARENA_st *arena, size_t size)
+{
+	size_t next;
+	void *p;
+
+	size = (size + OWON_ARENA_ALIGN - 1) & ~(size_t)(OWON_ARENA_ALIGN - 1);
+	if (arena->block == NULL || arena->size - arena->used < size) {
+		// Doubles what the arena holds
+		next = arena->total > OWON_ARENA_MIN ? arena->total : OWON_ARENA_MIN;
+		if (next < size + OWON_ARENA_ALIGN)
+			next = size + OWON_ARENA_ALIGN;
+		if (arena_block(arena, next) != OWON_SUCCESS)
+			return NULL;
+	}
+	p = arena->block + arena->used;
+	arena->used += size;
+	memset(p, 0, size);
+	return p;
+}
+
+int owon_arena_reserve(OWON_ARENA_st *arena, size_t size)
+{
+	if (arena->block != NULL && arena->size - arena->used >= size)
+		return OWON_SUCCESS;
+	// An empty block is replaced rather than kept aside
+	if (arena->block != NULL && arena->used == OWON_ARENA_ALIGN) {
+		free(arena->block);
+		arena->total -= arena->size;
+		arena->block = NULL;
+	}
+	size += OWON_ARENA_ALIGN;
+	return arena_block(arena, size > OWON_ARENA_MIN ? size : OWON_ARENA_MIN);
+}
+
+static void arena_free_full(OWON_ARENA_st *arena)
+{
+	unsigned char *block, *next;
+
+	for (block = arena->full; block != NULL; block = next) {
+		memcpy(&next, block, sizeof(next));
+		free(block);
+	}
+	arena->full = NULL;
+}
+
+void owon_arena_reset(OWON_ARENA_st *arena)
+{
+	size_t total = arena->total;
+
+	// Outgrown by this capture: a single block of their size from now on
+	if (arena->full != NULL) {
+		arena_free_full(arena);
+		free(arena->block);
+		arena->block = NULL;
+		arena->total = 0;
+		arena_block(arena, total); // Or the next allocation makes one
+	}
+	arena->used = OWON_ARENA_ALIGN;
+}
+
+void owon_arena_free(OWON_ARENA_st *arena)
+{
+	arena_free_full(arena);
+	free(arena->block);
+	memset(arena, 0, sizeof(OWON_ARENA_st));
+}
+
+// What a capture of len bytes should need, it has at least a channel
+// header per channel
+static size_t arena_estimate(size_t len)
+{
+	size_t channels = len / OWON_CHANNEL_HEADER + 1;
+
+	if (channels > OWON_ARENA_CHANNELS)
+		channels = OWON_ARENA_CHANNELS;
+	return channels * (sizeof(CHANNEL_st) + OWON_ARENA_ALIGN) +
+		2 * channels * sizeof(CHANNEL_st *) + OWON_ARENA_ALIGN;
+}
+
+// With an arena the pointer array doubles from 4, the old one is left
+// in the arena
+static CHANNEL_st **grow_channels(HEADER_st *header)
+{
+	size_t count = header->channels_count;
+	CHANNEL_st **channels;
+
+	if (header->arena == NULL)
+		return realloc(header->channels, (count + 1) * sizeof(CHANNEL_st *));
+	if (count != 0 && (count < 4 || (count & (count - 1)) != 0))
+		return header->channels;
+	channels = owon_arena_alloc(header->arena, (count ? 2 * count : 4) * sizeof(CHANNEL_st *));
+	if (channels != NULL && count > 0)
+		memcpy(channels, header->channels, count * sizeof(CHANNEL_st *));
+	return channels;
+}
+
+static CHANNEL_st *new_channel(HEADER_st *header)
+{
+	CHANNEL_st **channel_p;
+	CHANNEL_st *channel;
+
+	channel_p = grow_channels(header);
+	if (channel_p==NULL) {
+		printf("Can't allocate %zu bytes of memory for channel data.\n",sizeof(CHANNEL_st*) * (header->channels_count+1));
+		return NULL;
+	}
+	header->channels = channel_p;
+
+	// Putting NULL in the structure for fields not present
+	if (header->arena != NULL)
+		channel = owon_arena_alloc(header->arena, sizeof(CHANNEL_st));
+	else
+		channel = calloc(1, sizeof(CHANNEL_st));
+	if (channel == NULL)
+		return NULL;
+	header->channels[header->channels_count++] = channel;
+	return channel;
+}
+
+static int add_channel(DATA_st *data_s, HEADER_st *header)
+{
+	CHANNEL_st *channel = new_channel(header);
+
+	if (channel == NULL)
+		return OWON_ERROR_MEMORY;
+	return parse_channel(data_s, channel);
+}
+
+// The parser walks the chunks: after a channel header it jumps over the
+// declared payload, so sample bytes are never looked at. Scanning only
+// happens over data it does not know. Captures in several parts are followed
+// through the length of each part prefix.
+
+int owon_parse(const char * const buf, size_t len, HEADER_st *header)
+{
+	return owon_parse_arena(buf, len, header, NULL);
+}
+
+int owon_parse_arena(const char * const buf, size_t len, HEADER_st *header, OWON_ARENA_st *arena)
+{
+	DATA_st data;
+	DATA_st *data_s = &data;
+	const unsigned char *end, *part_end;
+	int ret;
+
+	data_s->data = (const unsigned char *) buf;
+	data_s->data_p = (const unsigned char *) buf;
+	data_s->len = len;
+	data_s->error = 0;
+	end = data_s->data + len;
+
+	memset(header,0,sizeof(HEADER_st)); // Putting NULL in the structure for fields not present
+	if (arena != NULL && owon_arena_reserve(arena, arena_estimate(len)) != OWON_SUCCESS)
+		return OWON_ERROR_MEMORY;
+	header->arena = arena;
+	part_end = parse_part_header(data_s, header);
+	if (data_s->error)
+		return data_s->error;
+
 	header->channels_count = 0;
 
-	while ((void *)data_s->data_p < (void *) data_s->data + data_s->len) {
-		if (strncmp(data_s->data_p,"CH",2) == 0) {
+	while (data_s->data_p < end) {
+		if (data_s->data_p >= part_end && is_part_start(data_s->data_p, end)) {
+			HEADER_st part;
+			memset(&part, 0, sizeof(part));
+			part_end = parse_part_header(data_s, &part);
+			if (data_s->error) {
+				owon_free_header(header);
+				return data_s->error;
+			}
+#ifdef DEBUG_KNOWN
+			printf("Debug Known: part of length %d\n", part.length);
+#endif
+			continue;
+		}
 
-			header->channels_count++;
+		if (is_channel_start(data_s->data_p, end)) {
+			ret = add_channel(data_s, header);
+			if (ret < 0) {
+				owon_free_header(header);
+				return ret;
+			}
+			continue; // data_p is now right after the samples
+		}
 
-			channel_p = realloc(header->channels,header->channels_count*sizeof(CHANNEL_st*));
-			if (channel_p==NULL) {
-				printf("Can't allocate %d bytes of memory for channel data.\n",sizeof(CHANNEL_st*) * header->channels_count);
-				return(126);
+		data_s->data_p = find_chunk(data_s->data_p + 1, data_s->data_p < part_end ? part_end : end);
+	}
+	return(0);
+}
+
+// Incremental parser
+// The walk of owon_parse runs as a state machine. Each step looks at the
+// bytes not consumed yet: in place in the chunk when it has what the step
+// needs, else gathered in hold. Samples are never gathered, they are passed
+// on as they come.
+
+// Prefix, model, intsize, serial, status bytes and values, unknown3
+#define OWON_PART_HEADER_MAX (OWON_PART_PREFIX + 6 + 4 + 29 + 7 + 8)
+
+enum stream_state {
+	STREAM_HEADER,  // First part header
+	STREAM_SCAN,    // Looking at what starts at offset
+	STREAM_SKIP,    // Unknown data, up to the next chunk or skip_end
+	STREAM_PART,    // Header of another part
+	STREAM_CHANNEL, // Header of a channel
+	STREAM_SAMPLES,
+};
+
+void owon_stream_init(OWON_STREAM_st *stream, HEADER_st *header,
+		      const OWON_STREAM_EVENTS_st *events, int persistent)
+{
+	memset(stream, 0, sizeof(OWON_STREAM_st));
+	memset(header, 0, sizeof(HEADER_st));
+	stream->header = header;
+	if (events != NULL)
+		stream->events = *events;
+	stream->persistent = persistent;
+	stream->state = STREAM_HEADER;
+	stream->part_end = UINT64_MAX;
+}
+
+static void stream_fail(OWON_STREAM_st *stream, int error)
+{
+	stream->error = error;
+	owon_free_header(stream->header);
+}
+
+// Bytes a step needs to decide the same way owon_parse does on the whole data
+static size_t stream_want(const OWON_STREAM_st *stream)
+{
+	switch (stream->state) {
+	case STREAM_HEADER:
+	case STREAM_PART:
+		return OWON_PART_HEADER_MAX;
+	case STREAM_CHANNEL:
+		return OWON_CHANNEL_HEADER;
+	case STREAM_SCAN:
+		return stream->offset >= stream->part_end ? OWON_PART_PREFIX + 3 : 3;
+	case STREAM_SKIP:
+		return 3;
+	default:
+		return 1;
+	}
+}
+
+static uint64_t stream_part_end(const OWON_STREAM_st *stream, const HEADER_st *part)
+{
+	return part->length > 0 ? stream->offset + OWON_PART_PREFIX + part->length : UINT64_MAX;
+}
+
+static void stream_emit(OWON_STREAM_st *stream, const unsigned char *data, size_t count)
+{
+	if (stream->events.samples != NULL)
+		stream->events.samples(stream->events.user, stream->channel, stream->samples_done,
+				       data, count);
+	stream->samples_done += count;
+}
+
+// A sample cut between two chunks waits in carry
+static void stream_samples(OWON_STREAM_st *stream, const unsigned char *data, size_t len, int in_place)
+{
+	CHANNEL_st *channel = stream->channel;
+	size_t size = owon_channel_sample_size(channel);
+	size_t take, whole;
+
+	if (!in_place || data != stream->next_sample)
+		channel->samples = NULL;
+	stream->next_sample = data + len;
+
+	if (stream->carry_len > 0) {
+		take = size - stream->carry_len;
+		if (take > len)
+			take = len;
+		memcpy(stream->carry + stream->carry_len, data, take);
+		stream->carry_len += take;
+		data += take;
+		len -= take;
+		if (stream->carry_len < size)
+			return;
+		stream_emit(stream, stream->carry, 1);
+		stream->carry_len = 0;
+	}
+	whole = len / size;
+	if (whole > 0)
+		stream_emit(stream, data, whole);
+	stream->carry_len = len - whole * size;
+	memcpy(stream->carry, data + whole * size, stream->carry_len);
+}
+
+// One step over the len bytes at view, returns the bytes consumed or an error.
+// final tells there is nothing after view.
+
+static long stream_step(OWON_STREAM_st *stream, const unsigned char *view, size_t len,
+			int final, int in_place)
+{
+	DATA_st data = { view, view, len, 0 };
+	const unsigned char *end = view + len;
+	const unsigned char *p;
+	CHANNEL_st *channel;
+	HEADER_st part;
+	size_t limit, consumed;
+
+	switch (stream->state) {
+	case STREAM_HEADER:
+		parse_part_header(&data, stream->header);
+		if (data.error)
+			return data.error;
+		stream->part_end = stream_part_end(stream, stream->header);
+		stream->state = STREAM_SCAN;
+		if (stream->events.header != NULL)
+			stream->events.header(stream->events.user, stream->header);
+		return data.data_p - view;
+
+	case STREAM_PART:
+		memset(&part, 0, sizeof(part));
+		parse_part_header(&data, &part);
+		if (data.error)
+			return data.error;
+		stream->part_end = stream_part_end(stream, &part);
+		stream->state = STREAM_SCAN;
+		return data.data_p - view;
+
+	case STREAM_SCAN:
+		if (stream->offset >= stream->part_end && is_part_start(view, end)) {
+			stream->state = STREAM_PART;
+			return 0;
+		}
+		if (is_channel_start(view, end)) {
+			stream->state = STREAM_CHANNEL;
+			return 0;
+		}
+		stream->state = STREAM_SKIP;
+		stream->skip_end = stream->offset < stream->part_end ? stream->part_end : UINT64_MAX;
+		return 1;
+
+	case STREAM_SKIP:
+		limit = len;
+		if (stream->skip_end - stream->offset < limit)
+			limit = stream->skip_end - stream->offset;
+		p = memchr(view, 'C', limit);
+		while (p != NULL) {
+			if (is_channel_start(p, view + limit)) {
+				stream->state = STREAM_SCAN;
+				return p - view;
 			}
+			// Too close to the end of the chunk to know yet
+			if (view + limit - p < 3 && !final && stream->offset + limit < stream->skip_end)
+				return p - view;
+			p = memchr(p + 1, 'C', view + limit - (p + 1));
+		}
+		if (stream->offset + limit == stream->skip_end)
+			stream->state = STREAM_SCAN;
+		return limit;
+
+	case STREAM_CHANNEL:
+		channel = new_channel(stream->header);
+		if (channel == NULL)
+			return OWON_ERROR_MEMORY;
+		if (parse_channel_header(&data, channel) < 0)
+			return data.error;
+		consumed = data.data_p - view;
+		stream->channel = channel;
+		stream->payload_left = (uint64_t) channel->samples_file * owon_channel_sample_size(channel);
+		stream->samples_done = 0;
+		stream->carry_len = 0;
+		channel->samples = in_place ? view + consumed : NULL;
+		channel->samples_offset = stream->offset + consumed;
+		stream->next_sample = channel->samples;
+		if (stream->events.channel != NULL)
+			stream->events.channel(stream->events.user, stream->header, channel);
+		stream->state = STREAM_SAMPLES;
+		if (stream->payload_left == 0) {
+			debug_channel(channel);
+			stream->state = STREAM_SCAN;
+		}
+		return consumed;
+
+	case STREAM_SAMPLES:
+		consumed = len < stream->payload_left ? len : stream->payload_left;
+		stream_samples(stream, view, consumed, in_place);
+		stream->payload_left -= consumed;
+		if (stream->payload_left == 0) {
+			debug_channel(stream->channel);
+			stream->state = STREAM_SCAN;
+		}
+		return consumed;
+	}
+	return OWON_ERROR;
+}
 
-			header->channels = channel_p;
-			header->channels[header->channels_count-1] = malloc(sizeof(CHANNEL_st));
-			memset(header->channels[header->channels_count-1],0,sizeof(CHANNEL_st)); // Putting NULL in the structure for fields not present
-			parse_channel(data_s,header->channels[header->channels_count-1]);
-		}  else if (strncmp(data_s->data_p,"INFO",4) == 0) {
+static int stream_run(OWON_STREAM_st *stream, const unsigned char *data, size_t len, int final)
+{
+	const unsigned char *view;
+	size_t want, take, view_len;
+	long consumed;
+	int state, in_place;
+
+	// Bytes left in place by the previous chunk, this one may follow them
+	if (stream->pending_len > 0) {
+		if (len == 0 || stream->pending + stream->pending_len == data) {
+			data = stream->pending;
+			len += stream->pending_len;
+		} else {
+			memcpy(stream->hold, stream->pending, stream->pending_len);
+			stream->hold_len = stream->pending_len;
+		}
+		stream->pending_len = 0;
+	}
 
+	while (stream->error == 0) {
+		want = stream_want(stream);
+		if (stream->hold_len > 0) {
+			take = stream->hold_len < want ? want - stream->hold_len : 0;
+			if (take > len)
+				take = len;
+			if (take > 0)
+				memcpy(stream->hold + stream->hold_len, data, take);
+			stream->hold_len += take;
+			data += take;
+			len -= take;
+			if (stream->hold_len < want && !final)
+				return 0;
+			view = stream->hold;
+			view_len = stream->hold_len;
+			in_place = 0;
+		} else {
+			if (len < want && !final) {
+				if (len > 0 && stream->persistent) {
+					stream->pending = data;
+					stream->pending_len = len;
+				} else if (len > 0) {
+					memcpy(stream->hold, data, len);
+					stream->hold_len = len;
+				}
+				return 0;
+			}
+			view = data;
+			view_len = len;
+			in_place = stream->persistent;
+		}
+		// Only headers are parsed from nothing, and fail
+		if (view_len == 0 && stream->state != STREAM_HEADER &&
+		    stream->state != STREAM_PART && stream->state != STREAM_CHANNEL)
+			return 0;
+
+		state = stream->state;
+		consumed = stream_step(stream, view, view_len, final, in_place);
+		if (consumed < 0) {
+			stream_fail(stream, consumed);
+			break;
+		}
+		if (consumed == 0 && stream->state == state) {
+			stream_fail(stream, OWON_ERROR);
+			break;
+		}
+		stream->offset += consumed;
+		if (view == stream->hold) {
+			stream->hold_len -= consumed;
+			memmove(stream->hold, stream->hold + consumed, stream->hold_len);
+		} else {
+			data += consumed;
+			len -= consumed;
 		}
-		data_s->data_p++;
 	}
-	return(0);
+	return stream->error;
 }
 
-static float sample_id_to_time(const HEADER_st *header, uint32_t sample)
+int owon_stream_feed(OWON_STREAM_st *stream, const unsigned char *data, size_t len)
 {
-	if (!header->channels_count)
-		return -1.0;
+	if (stream->error)
+		return stream->error;
+	return stream_run(stream, data, len, 0);
+}
+
+int owon_stream_finish(OWON_STREAM_st *stream)
+{
+	if (stream->error)
+		return stream->error;
+	if (stream_run(stream, NULL, 0, 1) < 0)
+		return stream->error;
+	if (stream->state == STREAM_SAMPLES) {
+		fprintf(stderr,"Error: channel %s declares %u samples past the end of data.\n",
+			stream->channel->name,stream->channel->samples_file);
+		stream_fail(stream, OWON_ERROR_HEADER);
+	}
+	return stream->error;
+}
+
+void owon_stream_abort(OWON_STREAM_st *stream)
+{
+	if (stream->error == 0)
+		stream_fail(stream, OWON_ERROR_READ);
+}
+
+void owon_stream_set_arena(OWON_STREAM_st *stream, OWON_ARENA_st *arena)
+{
+	stream->header->arena = arena;
+}
 
-	return header->channels[0]->timediv * 10.0 * sample / header->channels[0]->samples_count;
+void owon_rebase_header(HEADER_st *header, const unsigned char *data)
+{
+	size_t i;
+
+	for (i = 0; i < header->channels_count; i++)
+		header->channels[i]->samples = data + header->channels[i]->samples_offset;
 }
 
-static float sample_to_volt(HEADER_st *header, uint8_t channel, uint32_t sample)
+int owon_map_file(const char *path, MAP_st *map)
 {
-	int8_t val;
+	struct stat stbuf;
+	void *data;
+	int fd;
+
+	map->data = NULL;
+	map->len = 0;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return OWON_ERROR_READ;
+	if (fstat(fd, &stbuf) == -1 || !S_ISREG(stbuf.st_mode) || stbuf.st_size == 0) {
+		close(fd);
+		return OWON_ERROR_READ;
+	}
+
+	data = mmap(NULL, stbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd); // The mapping keeps its own reference
+	if (data == MAP_FAILED)
+		return OWON_ERROR_MEMORY;
+
+	// The parser walks the file once from start to end
+	madvise(data, stbuf.st_size, MADV_SEQUENTIAL);
+	madvise(data, stbuf.st_size, MADV_WILLNEED);
+
+	map->data = data;
+	map->len = stbuf.st_size;
+	return OWON_SUCCESS;
+}
+
+void owon_unmap_file(MAP_st *map)
+{
+	if (map->data != NULL)
+		munmap((void *)map->data, map->len);
+	map->data = NULL;
+	map->len = 0;
+}
+
+int owon_parse_file(const char *path, HEADER_st *header)
+{
+	return owon_parse_file_arena(path, header, NULL);
+}
 
-	if (channel > header->channels_count - 1)
+int owon_parse_file_arena(const char *path, HEADER_st *header, OWON_ARENA_st *arena)
+{
+	MAP_st map;
+	int ret;
+
+	ret = owon_map_file(path, &map);
+	if (ret < 0)
+		return ret;
+
+	ret = owon_parse_arena((const char *)map.data, map.len, header, arena);
+	// Sample views point into the mapping, keep it for the header lifetime
+	header->map = map.data;
+	header->map_len = map.len;
+	if (ret < 0) {
+		owon_free_header(header);
+		return ret;
+	}
+	return ret;
+}
+
+// Probe
+// The walk of owon_parse over windows read from the file. Headers of parts
+// and channels always fit in a window, payloads are jumped over by their
+// declared length without being read: a capture costs one small read per
+// channel whatever its size. Only unknown data is read through.
+
+#define OWON_PROBE_WINDOW 4096
+
+typedef struct {
+	int fd;
+	uint64_t size;
+	uint64_t offset;          // of the window in the file
+	size_t len;
+	unsigned char window[OWON_PROBE_WINDOW];
+} PROBE_st;
+
+// Points data at offset in the window, read again when it doesn't hold
+// a whole header there and the file goes further
+static int probe_at(PROBE_st *probe, uint64_t offset, DATA_st *data)
+{
+	uint64_t end = probe->offset + probe->len;
+	size_t want;
+	ssize_t got;
+
+	if (offset < probe->offset || offset > end ||
+	    (end - offset < OWON_STREAM_HOLD && end < probe->size)) {
+		want = probe->size - offset < OWON_PROBE_WINDOW ? probe->size - offset : OWON_PROBE_WINDOW;
+		probe->offset = offset;
+		probe->len = 0;
+		while (probe->len < want) {
+			got = pread(probe->fd, probe->window + probe->len, want - probe->len,
+				    offset + probe->len);
+			if (got < 0 && errno == EINTR)
+				continue;
+			if (got <= 0)
+				return OWON_ERROR_READ;
+			probe->len += got;
+		}
+	}
+	data->data = probe->window + (offset - probe->offset);
+	data->data_p = data->data;
+	data->len = probe->offset + probe->len - offset;
+	data->error = 0;
+	return OWON_SUCCESS;
+}
+
+// Unknown data from offset, returns where the next chunk starts or limit
+static int probe_scan(PROBE_st *probe, uint64_t *offset, uint64_t limit)
+{
+	const unsigned char *found;
+	DATA_st data;
+	size_t len;
+
+	while (*offset < limit) {
+		if (probe_at(probe, *offset, &data) < 0)
+			return OWON_ERROR_READ;
+		len = data.len < limit - *offset ? data.len : limit - *offset;
+		found = find_chunk(data.data, data.data + len);
+		if (found < data.data + len || len == limit - *offset) {
+			*offset += found - data.data;
+			return OWON_SUCCESS;
+		}
+		*offset += len - 2; // A chunk may start in the last two bytes
+	}
+	return OWON_SUCCESS;
+}
+
+static int probe_walk(PROBE_st *probe, HEADER_st *header)
+{
+	DATA_st data;
+	HEADER_st part;
+	CHANNEL_st *channel;
+	uint64_t offset, part_end, payload;
+
+	if (probe_at(probe, 0, &data) < 0)
+		return OWON_ERROR_READ;
+	parse_part_header(&data, header);
+	if (data.error)
+		return data.error;
+	part_end = part_end_at(header, 0, probe->size);
+	offset = data.data_p - data.data;
+
+	while (offset < probe->size) {
+		if (probe_at(probe, offset, &data) < 0)
+			return OWON_ERROR_READ;
+
+		if (offset >= part_end && is_part_start(data.data, data.data + data.len)) {
+			memset(&part, 0, sizeof(part));
+			parse_part_header(&data, &part);
+			if (data.error)
+				return data.error;
+			part_end = part_end_at(&part, offset, probe->size);
+			offset += data.data_p - data.data;
+			continue;
+		}
+
+		if (is_channel_start(data.data, data.data + data.len)) {
+			channel = new_channel(header);
+			if (channel == NULL)
+				return OWON_ERROR_MEMORY;
+			if (parse_channel_header(&data, channel) < 0)
+				return data.error;
+			offset += data.data_p - data.data;
+			payload = (uint64_t) channel->samples_file * owon_channel_sample_size(channel);
+			if (payload > probe->size - offset) {
+				fprintf(stderr,"Error: channel %s declares %u samples past the end of data.\n",
+					channel->name,channel->samples_file);
+				return OWON_ERROR_HEADER;
+			}
+			channel->samples_offset = offset;
+			offset += payload;
+			continue;
+		}
+
+		offset++;
+		if (probe_scan(probe, &offset, offset <= part_end ? part_end : probe->size) < 0)
+			return OWON_ERROR_READ;
+	}
+	return OWON_SUCCESS;
+}
+
+int owon_probe_file(const char *path, HEADER_st *header)
+{
+	return owon_probe_file_arena(path, header, NULL);
+}
+
+int owon_probe_file_arena(const char *path, HEADER_st *header, OWON_ARENA_st *arena)
+{
+	struct stat stbuf;
+	PROBE_st *probe;
+	int ret;
+
+	memset(header, 0, sizeof(HEADER_st));
+	probe = malloc(sizeof(PROBE_st));
+	if (probe == NULL)
+		return OWON_ERROR_MEMORY;
+	probe->fd = open(path, O_RDONLY);
+	if (probe->fd == -1) {
+		free(probe);
+		return OWON_ERROR_READ;
+	}
+	if (fstat(probe->fd, &stbuf) == -1 || !S_ISREG(stbuf.st_mode) || stbuf.st_size == 0) {
+		close(probe->fd);
+		free(probe);
+		return OWON_ERROR_READ;
+	}
+	// The reads jump from header to header, readahead would fetch samples
+	posix_fadvise(probe->fd, 0, 0, POSIX_FADV_RANDOM);
+	probe->size = stbuf.st_size;
+	probe->offset = 0;
+	probe->len = 0;
+
+	if (arena != NULL && owon_arena_reserve(arena, arena_estimate(probe->size)) != OWON_SUCCESS) {
+		ret = OWON_ERROR_MEMORY;
+	} else {
+		header->arena = arena;
+		ret = probe_walk(probe, header);
+	}
+	close(probe->fd);
+	free(probe);
+	if (ret < 0)
+		owon_free_header(header);
+	return ret;
+}
+
+size_t owon_channel_sample_size(const CHANNEL_st *channel)
+{
+	return channel->datatype == 2 ? sizeof(int16_t) : sizeof(int8_t);
+}
+
+int16_t owon_channel_sample(const CHANNEL_st *channel, size_t sample)
+{
+	const unsigned char *p;
+
+	if (channel->datatype != 2)
+		return (int8_t) channel->samples[sample];
+	p = channel->samples + sample * sizeof(int16_t);
+	return (int16_t)(p[1] << 8 | p[0]);
+}
+
+double owon_channel_volts_per_count(const CHANNEL_st *channel)
+{
+	return 2.0 * channel->voltsdiv / 5.0;
+}
+
+float owon_channel_volt(const CHANNEL_st *channel, size_t sample)
+{
+	return owon_channel_sample(channel, sample) * owon_channel_volts_per_count(channel);
+}
+
+double owon_channel_time(const CHANNEL_st *channel, size_t sample)
+{
+	return channel->timediv * 10.0 * sample / channel->samples_count;
+}
+
+void owon_channel_volts(const CHANNEL_st *channel, size_t first, size_t count, float *destination)
+{
+	double scale = owon_channel_volts_per_count(channel);
+
+	if (channel->datatype == 2)
+		owon_decode_s16_f32(channel->samples + first * sizeof(int16_t), count, scale, destination);
+	else
+		owon_decode_s8_f32(channel->samples + first, count, scale, destination);
+}
+
+static float sample_id_to_time(const HEADER_st *header, uint32_t sample)
+{
+	if (!header->channels_count)
 		return -1.0;
 
-	val = header->channels[channel]->data[sample];
-	return val * 2.0 * header->channels[channel]->voltsdiv / 5.0;
+	return owon_channel_time(header->channels[0], sample);
 }
 
 static void volt_scale_to_string(float volt_scale, uint32_t *val, const char **unit)
@@ -398,8 +1238,81 @@ static void time_scale_to_string(double time_scale, uint32_t *val, const char **
 	}
 }
 
+// Format count rows starting at first into out.
+// volts must hold OWON_CSV_BLOCK floats per channel.
+
+static void csv_format_rows(const HEADER_st *header, size_t first, size_t count,
+			    int precision, float *volts, OUTBUF_st *out)
+{
+	size_t block, sample, channel, available;
+	CHANNEL_st *chan;
+
+	for (block = first; block < first + count; block += OWON_CSV_BLOCK) {
+		size_t rows = first + count - block;
+		if (rows > OWON_CSV_BLOCK)
+			rows = OWON_CSV_BLOCK;
+
+		for (channel = 0; channel < header->channels_count; channel++) {
+			float *destination = volts + channel * OWON_CSV_BLOCK;
+			chan = header->channels[channel];
+			available = 0;
+			if (block < chan->samples_file)
+				available = chan->samples_file - block < rows ? chan->samples_file - block : rows;
+			owon_channel_volts(chan, block, available, destination);
+			memset(destination + available, 0, (rows - available) * sizeof(float));
+		}
+
+		for (sample = 0; sample < rows; sample++) {
+			owon_outbuf_fixed(out, sample_id_to_time(header, block + sample), precision);
+			for (channel = 0; channel < header->channels_count; channel++) {
+				owon_outbuf_char(out, ',');
+				owon_outbuf_fixed(out, volts[channel * OWON_CSV_BLOCK + sample], precision);
+			}
+			owon_outbuf_char(out, '\n');
+		}
+	}
+}
+
+static void csv_write_header(const HEADER_st *header, OUTBUF_st *out)
+{
+	char line[128];
+	size_t channel;
+
+	owon_outbuf_string(out, "time");
+	for (channel = 0; channel < header->channels_count; channel++) {
+		const char *time_unit, *volt_unit;
+		uint32_t time_val, volt_val;
+
+		time_scale_to_string(header->channels[channel]->timediv, &time_val, &time_unit);
+		volt_scale_to_string(header->channels[channel]->voltsdiv, &volt_val, &volt_unit);
+		snprintf(line, sizeof(line), ",channel %i (Att %u, %u %s/div, %u %s/div)",
+			 (int)channel + 1, header->channels[channel]->attenuation,
+			 volt_val, volt_unit, time_val, time_unit);
+		owon_outbuf_string(out, line);
+	}
+	owon_outbuf_char(out, '\n');
+}
+
 int owon_output_csv(HEADER_st *header, FILE *file ) {
-	size_t sample, channel, channels_count, samples_count;
+	return owon_output_csv_precision(header, file, OWON_CSV_PRECISION);
+}
+
+int owon_output_csv_precision(HEADER_st *header, FILE *file, int precision) {
+	OUTBUF_st out;
+	int ret;
+
+	if (owon_outbuf_init(&out, file, OWON_OUTBUF_SIZE) != 0)
+		return OWON_ERROR_MEMORY;
+	ret = owon_output_csv_outbuf(header, &out, precision);
+	if (ret == 0)
+		ret = owon_outbuf_flush(&out);
+	owon_outbuf_free(&out);
+	return ret;
+}
+
+int owon_output_csv_outbuf(HEADER_st *header, OUTBUF_st *out, int precision) {
+	size_t channels_count, samples_count;
+	float *volts;
 
 #ifdef DEBUG_UNKNOWN
 	printf("Debug Unknown activated\n");
@@ -411,7 +1324,7 @@ int owon_output_csv(HEADER_st *header, FILE *file ) {
  
 	channels_count = header->channels_count;
 	if (channels_count < 1) {
-#ifdef DEBUG_UNKNOWN || DEBUG_KNOWN
+#if defined(DEBUG_UNKNOWN) || defined(DEBUG_KNOWN)
     printf("No channels found\n");
 #endif
 
@@ -419,37 +1332,175 @@ int owon_output_csv(HEADER_st *header, FILE *file ) {
   }
 	samples_count = header->channels[0]->samples_file;
 
+	volts = malloc(channels_count * OWON_CSV_BLOCK * sizeof(float));
+	if (volts == NULL)
+		return OWON_ERROR_MEMORY;
 
 	/* add the header to the CSV */
-	fprintf(file, "time");
-	for (channel = 0; channel < channels_count; channel++) {
-		const char *time_unit, *volt_unit;
-		uint32_t time_val, volt_val;
+	csv_write_header(header, out);
 
-		time_scale_to_string(header->channels[channel]->timediv, &time_val, &time_unit);
-		volt_scale_to_string(header->channels[channel]->voltsdiv, &volt_val, &volt_unit);
-		fprintf(file, ",channel %i (Att %u, %u %s/div, %u %s/div)",
-			channel + 1, header->channels[channel]->attenuation,
-			volt_val, volt_unit, time_val, time_unit);
+	/* add the actual data */
+	csv_format_rows(header, 0, samples_count, precision, volts, out);
+
+	free(volts);
+	return out->error;
+}
+
+// Parallel CSV output
+// Workers format chunks of OWON_CSV_CHUNK rows into their own buffer while the
+// calling thread writes the finished chunks in order. A chunk can only be
+// formatted once the one slots chunks before it has been written, which bounds
+// the memory to slots buffers.
+
+struct csv_slot {
+	OUTBUF_st out;
+	size_t chunk;
+	int ready;
+};
+
+struct csv_job {
+	const HEADER_st *header;
+	int precision;
+	size_t samples_count;
+	size_t chunks;
+	size_t next;    // next chunk to format
+	size_t written; // chunks already written
+	size_t slots_count;
+	struct csv_slot *slots;
+	pthread_mutex_t lock;
+	pthread_cond_t formatted;
+	pthread_cond_t consumed;
+};
+
+static void *csv_worker(void *arg)
+{
+	struct csv_job *job = arg;
+	struct csv_slot *slot;
+	size_t chunk, first, count;
+	float *volts;
+
+	volts = malloc(job->header->channels_count * OWON_CSV_BLOCK * sizeof(float));
+
+	pthread_mutex_lock(&job->lock);
+	while (job->next < job->chunks) {
+		chunk = job->next++;
+		slot = &job->slots[chunk % job->slots_count];
+		while (chunk >= job->written + job->slots_count)
+			pthread_cond_wait(&job->consumed, &job->lock);
+		pthread_mutex_unlock(&job->lock);
+
+		slot->out.len = 0;
+		if (volts == NULL) {
+			slot->out.error = OWON_ERROR_MEMORY;
+		} else {
+			first = chunk * OWON_CSV_CHUNK;
+			count = job->samples_count - first < OWON_CSV_CHUNK ? job->samples_count - first : OWON_CSV_CHUNK;
+			csv_format_rows(job->header, first, count, job->precision, volts, &slot->out);
+		}
+
+		pthread_mutex_lock(&job->lock);
+		slot->chunk = chunk;
+		slot->ready = 1;
+		pthread_cond_broadcast(&job->formatted);
 	}
-	fprintf(file, "\n");
+	pthread_mutex_unlock(&job->lock);
 
-	/* add the actual data */
-	for (sample = 0; sample < samples_count; sample++) {
-		fprintf(file, "%f", sample_id_to_time(header, sample));
+	free(volts);
+	return NULL;
+}
+
+int owon_output_csv_parallel(HEADER_st *header, FILE *file, int precision, int threads)
+{
+	struct csv_job job;
+	struct csv_slot *slot;
+	pthread_t *workers;
+	size_t chunk, i;
+	int started = 0, ret = 0;
+
+	if (threads <= 1 || header->channels_count < 1)
+		return owon_output_csv_precision(header, file, precision);
+
+	memset(&job, 0, sizeof(job));
+	job.header = header;
+	job.precision = precision;
+	job.samples_count = header->channels[0]->samples_file;
+	job.chunks = (job.samples_count + OWON_CSV_CHUNK - 1) / OWON_CSV_CHUNK;
+	job.slots_count = 2 * threads;
+	job.slots = calloc(job.slots_count, sizeof(struct csv_slot));
+	workers = calloc(threads, sizeof(pthread_t));
+	if (job.slots == NULL || workers == NULL) {
+		free(job.slots);
+		free(workers);
+		return OWON_ERROR_MEMORY;
+	}
+	// The slot buffers have no file: they grow to hold a chunk and are reused
+	pthread_mutex_init(&job.lock, NULL);
+	pthread_cond_init(&job.formatted, NULL);
+	pthread_cond_init(&job.consumed, NULL);
+
+	for (i = 0; i < (size_t)threads; i++)
+		if (pthread_create(&workers[started], NULL, csv_worker, &job) == 0)
+			started++;
+
+	if (started == 0) {
+		ret = owon_output_csv_precision(header, file, precision);
+		job.chunks = 0;
+	} else {
+		OUTBUF_st out = { NULL, 0, 0, file, 0 };
+		csv_write_header(header, &out);
+		ret = owon_outbuf_flush(&out);
+		owon_outbuf_free(&out);
+	}
+
+	for (chunk = 0; chunk < job.chunks; chunk++) {
+		slot = &job.slots[chunk % job.slots_count];
+
+		pthread_mutex_lock(&job.lock);
+		while (!slot->ready || slot->chunk != chunk)
+			pthread_cond_wait(&job.formatted, &job.lock);
+		pthread_mutex_unlock(&job.lock);
 
-		for(channel=0; channel<channels_count; channel++)
-			fprintf(file, ",%f", sample_to_volt(header, channel, sample));
+		if (slot->out.error)
+			ret = slot->out.error;
+		else if (fwrite(slot->out.buf, 1, slot->out.len, file) != slot->out.len)
+			ret = OWON_ERROR;
 
-		fprintf(file,"\n");
+		pthread_mutex_lock(&job.lock);
+		slot->ready = 0;
+		job.written++;
+		pthread_cond_broadcast(&job.consumed);
+		pthread_mutex_unlock(&job.lock);
 	}
+
+	for (i = 0; i < (size_t)started; i++)
+		pthread_join(workers[i], NULL);
+
+	for (i = 0; i < job.slots_count; i++)
+		owon_outbuf_free(&job.slots[i].out);
+	pthread_cond_destroy(&job.consumed);
+	pthread_cond_destroy(&job.formatted);
+	pthread_mutex_destroy(&job.lock);
+	free(job.slots);
+	free(workers);
+	return ret;
 }
 
 void owon_free_header(HEADER_st *header) {
 	int i;
-	for (i=0;i<header->channels_count;i++) {
-		free(header->channels[i]->data);
-		free(header->channels[i]);
+	if (header->arena != NULL) {
+		// A second free mustn't reset what the arena holds by then
+		owon_arena_reset(header->arena);
+		header->arena = NULL;
+	} else {
+		for (i=0;i<header->channels_count;i++)
+			free(header->channels[i]);
+		free(header->channels);
+	}
+	header->channels = NULL;
+	header->channels_count = 0;
+	if (header->map != NULL) {
+		MAP_st map = { header->map, header->map_len };
+		owon_unmap_file(&map);
+		header->map = NULL;
 	}
-	free(header->channels);
 }
@@ -1,12 +1,15 @@
 #ifndef _PARSE_H_
 #define _PARSE_H_
 
+#include <stdio.h>
 #include <stdint.h>
+#include "format.h"
 
 typedef struct {
   const unsigned char *data;
   const unsigned char *data_p;
   size_t len;
+  int error; // First failed read, reads past the end of data never happen
 } DATA_st;
 
 typedef struct {
@@ -25,9 +28,24 @@ typedef struct {
   float frequency;
   float period;
   float volts_mul;
-  double *data;
+  // Raw little-endian samples, int16_t when datatype is 2 and int8_t otherwise.
+  // They point into the parsed buffer, which must outlive the header.
+  const unsigned char *samples;
+  uint64_t samples_offset; // Where the samples are from the start of the capture
 } CHANNEL_st;
 
+// Memory for the channels of one parsed header at a time. Allocating moves
+// a pointer in a block, owon_free_header gives everything back at once and
+// the next capture reuses the block: after the first captures a long
+// running loop doesn't call the allocator to parse.
+typedef struct {
+  unsigned char *block;     // where allocations come from
+  size_t size;
+  size_t used;
+  unsigned char *full;      // blocks filled by this capture, freed on reset
+  size_t total;             // size of all the blocks, that of the next one
+} OWON_ARENA_st;
+
 typedef struct {
   uint32_t length;
   int32_t unknown1;
@@ -42,11 +60,118 @@ typedef struct {
   unsigned char unknown3[8];
   size_t channels_count;
   CHANNEL_st **channels;
+  const unsigned char *map; // Set when the header owns a mapped file
+  size_t map_len;
+  OWON_ARENA_st *arena;     // Set when the channels come from an arena
 } HEADER_st;
 
+typedef struct {
+  const unsigned char *data;
+  size_t len;
+} MAP_st;
+
 
+// Returns OWON_ERROR_HEADER when the data is truncated or inconsistent,
+// in that case nothing is left allocated in header
 int owon_parse(const char * const buf, size_t len, HEADER_st *header);
+// Same, the channels come from arena, which the header holds until it is freed
+int owon_parse_arena(const char * const buf, size_t len, HEADER_st *header, OWON_ARENA_st *arena);
+
+void owon_arena_init(OWON_ARENA_st *arena);
+// Zeroed and aligned for any type, NULL when out of memory
+void *owon_arena_alloc(OWON_ARENA_st *arena, size_t size);
+// Makes the current block at least size bytes, before a capture
+int owon_arena_reserve(OWON_ARENA_st *arena, size_t size);
+// Everything allocated is given back, done by owon_free_header
+void owon_arena_reset(OWON_ARENA_st *arena);
+void owon_arena_free(OWON_ARENA_st *arena);
+
+// Incremental parser, fed the capture in chunks of any size as it arrives.
+// It gives the same result as owon_parse on the whole capture, and tells
+// about the header, each channel and blocks of whole samples as soon as
+// they are complete. The callbacks may be NULL.
+typedef struct {
+  void (*header)(void *user, const HEADER_st *header);
+  // The header of a channel was read, its samples come next
+  void (*channel)(void *user, const HEADER_st *header, const CHANNEL_st *channel);
+  // count raw samples of channel starting at sample first
+  void (*samples)(void *user, const CHANNEL_st *channel, size_t first,
+                  const unsigned char *data, size_t count);
+  void *user;
+} OWON_STREAM_EVENTS_st;
+
+// Largest header of a part (with the USB prefix) and of a channel
+#define OWON_STREAM_HOLD 72
+
+typedef struct {
+  HEADER_st *header;
+  OWON_STREAM_EVENTS_st events;
+  int persistent;        // The chunks fed stay valid and in place
+  int state;
+  int error;
+  uint64_t offset;       // Bytes of capture consumed
+  uint64_t part_end;     // Offset where the current part ends
+  uint64_t skip_end;     // Offset where skipping unknown data stops
+  CHANNEL_st *channel;   // Channel receiving its samples
+  uint64_t payload_left;
+  size_t samples_done;
+  const unsigned char *next_sample; // Where samples must follow to stay in place
+  // Bytes kept until a header or a sample is complete
+  unsigned char hold[OWON_STREAM_HOLD];
+  size_t hold_len;
+  const unsigned char *pending; // Same, left in place in persistent chunks
+  size_t pending_len;
+  unsigned char carry[2];
+  size_t carry_len;
+} OWON_STREAM_st;
+
+// With persistent, the chunks must stay valid until the header is freed,
+// the channels then point at their samples when these arrived contiguous
+// in memory, as they do from a single buffer. Otherwise samples is NULL
+// and they are only seen through the events.
+void owon_stream_init(OWON_STREAM_st *stream, HEADER_st *header,
+                      const OWON_STREAM_EVENTS_st *events, int persistent);
+// Returns 0, or the error of the capture. Once an error is returned,
+// nothing is left allocated in header and further chunks are refused.
+int owon_stream_feed(OWON_STREAM_st *stream, const unsigned char *data, size_t len);
+// The capture is complete: returns 0 when header is filled
+int owon_stream_finish(OWON_STREAM_st *stream);
+// Drops a capture that won't be finished
+void owon_stream_abort(OWON_STREAM_st *stream);
+// After owon_stream_init, the channels of the capture come from arena
+void owon_stream_set_arena(OWON_STREAM_st *stream, OWON_ARENA_st *arena);
+// Points the samples of every channel into data, a copy of the whole capture
+void owon_rebase_header(HEADER_st *header, const unsigned char *data);
+
+// Map a file read-only, its content stays valid until owon_unmap_file
+int owon_map_file(const char *path, MAP_st *map);
+void owon_unmap_file(MAP_st *map);
+// Map and parse a file, the mapping is released by owon_free_header
+int owon_parse_file(const char *path, HEADER_st *header);
+int owon_parse_file_arena(const char *path, HEADER_st *header, OWON_ARENA_st *arena);
+// Only the headers of the capture and of its channels, read from the file
+// without its samples: samples is NULL in the channels and samples_offset
+// tells where they are. Fails as owon_parse_file would on the same file.
+int owon_probe_file(const char *path, HEADER_st *header);
+int owon_probe_file_arena(const char *path, HEADER_st *header, OWON_ARENA_st *arena);
+// Digits after the decimal point in CSV files
+#define OWON_CSV_PRECISION 6
+
 int owon_output_csv(HEADER_st *header, FILE *file);
+int owon_output_csv_precision(HEADER_st *header, FILE *file, int precision);
+// Format into a caller owned buffer, which is not flushed at the end
+int owon_output_csv_outbuf(HEADER_st *header, OUTBUF_st *out, int precision);
+// Same output, formatted by threads workers
+int owon_output_csv_parallel(HEADER_st *header, FILE *file, int precision, int threads);
+
+// Sample accessors, conversion to volts and seconds is done on demand
+size_t owon_channel_sample_size(const CHANNEL_st *channel);
+int16_t owon_channel_sample(const CHANNEL_st *channel, size_t sample);
+double owon_channel_volts_per_count(const CHANNEL_st *channel);
+float owon_channel_volt(const CHANNEL_st *channel, size_t sample);
+double owon_channel_time(const CHANNEL_st *channel, size_t sample);
+// Convert count samples starting at first into volts
+void owon_channel_volts(const CHANNEL_st *channel, size_t first, size_t count, float *destination);
 void owon_free_header(HEADER_st *header);
 
 #endif
@@ -0,0 +1,222 @@
+/*
+ * pyramid - min/max overview of the channels for waveform display
+ * Copyright (c) 2014 Jonathan Bisson <bjonnh-owon@bjonnh.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pyramid.h"
+#include "owon.h"
+
+// Samples and nodes gathered for one bucket
+typedef struct {
+	int16_t min;
+	int16_t max;
+	int64_t sum;
+	size_t count;
+} SPAN_st;
+
+void owon_pyramid_init(OWON_PYRAMID_st *pyramid, const CHANNEL_st *channel, int flags)
+{
+	memset(pyramid, 0, sizeof(OWON_PYRAMID_st));
+	pyramid->channel = channel;
+	pyramid->flags = flags;
+}
+
+// Level 0, straight from the samples
+static void build_base(const CHANNEL_st *channel, OWON_PYRAMID_NODE_st *nodes, int64_t *sums)
+{
+	size_t samples = channel->samples_file;
+	size_t node, i, end;
+	int16_t value, min, max;
+	int64_t sum;
+
+	for (node = 0; node * OWON_PYRAMID_BASE < samples; node++) {
+		i = node * OWON_PYRAMID_BASE;
+		end = i + OWON_PYRAMID_BASE < samples ? i + OWON_PYRAMID_BASE : samples;
+		min = INT16_MAX;
+		max = INT16_MIN;
+		sum = 0;
+		if (channel->datatype == 2) {
+			const unsigned char *p = channel->samples + i * sizeof(int16_t);
+			for (; i < end; i++, p += 2) {
+				value = (int16_t)(p[1] << 8 | p[0]);
+				min = value < min ? value : min;
+				max = value > max ? value : max;
+				sum += value;
+			}
+		} else {
+			const int8_t *p = (const int8_t *)channel->samples + i;
+			for (; i < end; i++, p++) {
+				value = *p;
+				min = value < min ? value : min;
+				max = value > max ? value : max;
+				sum += value;
+			}
+		}
+		nodes[node].min = min;
+		nodes[node].max = max;
+		if (sums != NULL)
+			sums[node] = sum;
+	}
+}
+
+int owon_pyramid_build(OWON_PYRAMID_st *pyramid)
+{
+	const CHANNEL_st *channel = pyramid->channel;
+	size_t count, total = 0, node, child;
+	int level, levels;
+
+	if (pyramid->levels > 0)
+		return OWON_SUCCESS;
+	if (channel->samples == NULL && channel->samples_file > 0)
+		return OWON_ERROR;
+
+	// Every level halves the one below, down to a single node
+	count = (channel->samples_file + OWON_PYRAMID_BASE - 1) / OWON_PYRAMID_BASE;
+	for (levels = 0; levels < OWON_PYRAMID_MAX_LEVELS; levels++) {
+		pyramid->nodes_count[levels] = count;
+		total += count;
+		if (count <= 1) {
+			levels++;
+			break;
+		}
+		count = (count + 1) / 2;
+	}
+
+	pyramid->nodes_storage = malloc((total ? total : 1) * sizeof(OWON_PYRAMID_NODE_st));
+	if (pyramid->flags & OWON_PYRAMID_MEAN)
+		pyramid->sums_storage = malloc((total ? total : 1) * sizeof(int64_t));
+	if (pyramid->nodes_storage == NULL ||
+	    ((pyramid->flags & OWON_PYRAMID_MEAN) && pyramid->sums_storage == NULL)) {
+		owon_pyramid_free(pyramid);
+		return OWON_ERROR_MEMORY;
+	}
+
+	total = 0;
+	for (level = 0; level < levels; level++) {
+		pyramid->nodes[level] = pyramid->nodes_storage + total;
+		if (pyramid->sums_storage != NULL)
+			pyramid->sums[level] = pyramid->sums_storage + total;
+		total += pyramid->nodes_count[level];
+	}
+
+	build_base(channel, pyramid->nodes[0], pyramid->sums[0]);
+	for (level = 1; level < levels; level++) {
+		const OWON_PYRAMID_NODE_st *below = pyramid->nodes[level - 1];
+		OWON_PYRAMID_NODE_st *nodes = pyramid->nodes[level];
+
+		for (node = 0; node < pyramid->nodes_count[level]; node++) {
+			child = 2 * node;
+			nodes[node] = below[child];
+			if (pyramid->sums_storage != NULL)
+				pyramid->sums[level][node] = pyramid->sums[level - 1][child];
+			if (++child >= pyramid->nodes_count[level - 1])
+				continue;
+			if (below[child].min < nodes[node].min)
+				nodes[node].min = below[child].min;
+			if (below[child].max > nodes[node].max)
+				nodes[node].max = below[child].max;
+			if (pyramid->sums_storage != NULL)
+				pyramid->sums[level][node] += pyramid->sums[level - 1][child];
+		}
+	}
+	pyramid->levels = levels;
+	return OWON_SUCCESS;
+}
+
+// The samples from first to end: whole nodes, as large as they come, and the
+// samples before the first node and after the last one
+static void pyramid_span(const OWON_PYRAMID_st *pyramid, size_t first, size_t end, SPAN_st *span)
+{
+	const OWON_PYRAMID_NODE_st *node;
+	size_t position = first, size;
+	int16_t value;
+	int level;
+
+	span->min = INT16_MAX;
+	span->max = INT16_MIN;
+	span->sum = 0;
+	span->count = end - first;
+
+	while (position < end) {
+		if (position % OWON_PYRAMID_BASE != 0 || end - position < OWON_PYRAMID_BASE) {
+			value = owon_channel_sample(pyramid->channel, position++);
+			span->min = value < span->min ? value : span->min;
+			span->max = value > span->max ? value : span->max;
+			span->sum += value;
+			continue;
+		}
+
+		level = 0;
+		size = OWON_PYRAMID_BASE;
+		while (level + 1 < pyramid->levels && position % (2 * size) == 0 && end - position >= 2 * size) {
+			level++;
+			size *= 2;
+		}
+		node = &pyramid->nodes[level][position / size];
+		span->min = node->min < span->min ? node->min : span->min;
+		span->max = node->max > span->max ? node->max : span->max;
+		if (pyramid->sums_storage != NULL)
+			span->sum += pyramid->sums[level][position / size];
+		position += size;
+	}
+}
+
+int owon_pyramid_query(OWON_PYRAMID_st *pyramid, size_t first, size_t count,
+		       size_t buckets_count, OWON_PYRAMID_BUCKET_st *buckets)
+{
+	size_t samples = pyramid->channel->samples_file;
+	double scale = owon_channel_volts_per_count(pyramid->channel);
+	size_t i, start, end;
+	SPAN_st span;
+	int ret;
+
+	if (count == 0 || buckets_count == 0 || first > samples || count > samples - first)
+		return OWON_ERROR;
+	ret = owon_pyramid_build(pyramid);
+	if (ret < 0)
+		return ret;
+
+	for (i = 0; i < buckets_count; i++) {
+		start = first + (uint64_t) i * count / buckets_count;
+		end = first + (uint64_t)(i + 1) * count / buckets_count;
+		if (end <= start)
+			end = start + 1;
+		pyramid_span(pyramid, start, end, &span);
+
+		// The scale is positive, the order of min and max holds in volts
+		buckets[i].min = span.min * scale;
+		buckets[i].max = span.max * scale;
+		buckets[i].mean = 0;
+		if (pyramid->flags & OWON_PYRAMID_MEAN)
+			buckets[i].mean = (double) span.sum / span.count * scale;
+		buckets[i].samples = span.count;
+	}
+	return OWON_SUCCESS;
+}
+
+void owon_pyramid_free(OWON_PYRAMID_st *pyramid)
+{
+	free(pyramid->nodes_storage);
+	free(pyramid->sums_storage);
+	memset(pyramid->nodes, 0, sizeof(pyramid->nodes));
+	memset(pyramid->sums, 0, sizeof(pyramid->sums));
+	pyramid->nodes_storage = NULL;
+	pyramid->sums_storage = NULL;
+	pyramid->levels = 0;
+}
@@ -0,0 +1,73 @@
+/*
+ * pyramid - min/max overview of the channels for waveform display
+ * Copyright (c) 2014 Jonathan Bisson <bjonnh-owon@bjonnh.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef _PYRAMID_H_
+#define _PYRAMID_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include "parse.h"
+
+// Level 0 keeps the min and max of every OWON_PYRAMID_BASE samples, each
+// level above of two nodes of the one below. A display bucket is made of
+// the largest nodes that fit in it plus the raw samples at its edges, so a
+// query of N buckets costs O(N log n) whatever the number of samples.
+// A 10M samples channel takes about 5 MB, 15 MB with the means.
+
+#define OWON_PYRAMID_BASE 16
+#define OWON_PYRAMID_MAX_LEVELS 48
+
+// Flags
+#define OWON_PYRAMID_MEAN 1 // Keep the sums for the mean of the buckets
+
+typedef struct {
+	int16_t min;
+	int16_t max;
+} OWON_PYRAMID_NODE_st;
+
+typedef struct {
+	const CHANNEL_st *channel;
+	int flags;
+	int levels;                 // 0 until built
+	size_t nodes_count[OWON_PYRAMID_MAX_LEVELS];
+	OWON_PYRAMID_NODE_st *nodes[OWON_PYRAMID_MAX_LEVELS];
+	int64_t *sums[OWON_PYRAMID_MAX_LEVELS];    // with OWON_PYRAMID_MEAN
+	OWON_PYRAMID_NODE_st *nodes_storage;
+	int64_t *sums_storage;
+} OWON_PYRAMID_st;
+
+// A display bucket, in volts
+typedef struct {
+	float min;
+	float max;
+	float mean;                 // 0 without OWON_PYRAMID_MEAN
+	uint32_t samples;
+} OWON_PYRAMID_BUCKET_st;
+
+// Nothing is computed before owon_pyramid_build or the first query.
+// The channel samples must stay in place while the pyramid is used.
+void owon_pyramid_init(OWON_PYRAMID_st *pyramid, const CHANNEL_st *channel, int flags);
+int owon_pyramid_build(OWON_PYRAMID_st *pyramid);
+// Splits count samples from first in buckets_count buckets of the same size
+// (give or take a sample). When there are fewer samples than buckets, a
+// bucket holds the sample it falls on.
+int owon_pyramid_query(OWON_PYRAMID_st *pyramid, size_t first, size_t count,
+		       size_t buckets_count, OWON_PYRAMID_BUCKET_st *buckets);
+void owon_pyramid_free(OWON_PYRAMID_st *pyramid);
+
+#endif
@@ -0,0 +1,87 @@
+/*
+ * queue - bounded blocking queue used to connect processing stages
+ * Copyright (c) 2014 Jonathan Bisson <bjonnh-owon@bjonnh.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>
+ */
+
+#include <stdlib.h>
+#include "queue.h"
+#include "owon.h"
+
+int owon_queue_init(QUEUE_st *queue, size_t capacity)
+{
+	queue->items = calloc(capacity, sizeof(void *));
+	if (queue->items == NULL)
+		return OWON_ERROR_MEMORY;
+	queue->capacity = capacity;
+	queue->head = 0;
+	queue->count = 0;
+	queue->closed = 0;
+	pthread_mutex_init(&queue->lock, NULL);
+	pthread_cond_init(&queue->not_empty, NULL);
+	pthread_cond_init(&queue->not_full, NULL);
+	return OWON_SUCCESS;
+}
+
+int owon_queue_push(QUEUE_st *queue, void *item)
+{
+	pthread_mutex_lock(&queue->lock);
+	while (queue->count == queue->capacity && !queue->closed)
+		pthread_cond_wait(&queue->not_full, &queue->lock);
+	if (queue->closed) {
+		pthread_mutex_unlock(&queue->lock);
+		return OWON_ERROR;
+	}
+	queue->items[(queue->head + queue->count) % queue->capacity] = item;
+	queue->count++;
+	pthread_cond_signal(&queue->not_empty);
+	pthread_mutex_unlock(&queue->lock);
+	return OWON_SUCCESS;
+}
+
+void *owon_queue_pop(QUEUE_st *queue)
+{
+	void *item = NULL;
+
+	pthread_mutex_lock(&queue->lock);
+	while (queue->count == 0 && !queue->closed)
+		pthread_cond_wait(&queue->not_empty, &queue->lock);
+	if (queue->count > 0) {
+		item = queue->items[queue->head];
+		queue->head = (queue->head + 1) % queue->capacity;
+		queue->count--;
+		pthread_cond_signal(&queue->not_full);
+	}
+	pthread_mutex_unlock(&queue->lock);
+	return item;
+}
+
+void owon_queue_close(QUEUE_st *queue)
+{
+	pthread_mutex_lock(&queue->lock);
+	queue->closed = 1;
+	pthread_cond_broadcast(&queue->not_empty);
+	pthread_cond_broadcast(&queue->not_full);
+	pthread_mutex_unlock(&queue->lock);
+}
+
+void owon_queue_destroy(QUEUE_st *queue)
+{
+	pthread_cond_destroy(&queue->not_full);
+	pthread_cond_destroy(&queue->not_empty);
+	pthread_mutex_destroy(&queue->lock);
+	free(queue->items);
+	queue->items = NULL;
+}
@@ -0,0 +1,45 @@
+/*
+ * queue - bounded blocking queue used to connect processing stages
+ * Copyright (c) 2014 Jonathan Bisson <bjonnh-owon@bjonnh.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef _QUEUE_H_
+#define _QUEUE_H_
+
+#include <stddef.h>
+#include <pthread.h>
+
+typedef struct {
+  void **items;
+  size_t capacity;
+  size_t head;
+  size_t count;
+  int closed;
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+} QUEUE_st;
+
+int owon_queue_init(QUEUE_st *queue, size_t capacity);
+// Blocks while the queue is full, fails once the queue is closed
+int owon_queue_push(QUEUE_st *queue, void *item);
+// Blocks while the queue is empty, returns NULL once closed and drained
+void *owon_queue_pop(QUEUE_st *queue);
+// Wakes up every waiter, pending items can still be popped
+void owon_queue_close(QUEUE_st *queue);
+void owon_queue_destroy(QUEUE_st *queue);
+
+#endif
@@ -0,0 +1,291 @@
+/*
+ * shm - shared memory ring of captures for local consumers
+ * Copyright (c) 2014 Jonathan Bisson <bjonnh-owon@bjonnh.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "shm.h"
+#include "owon.h"
+
+static uint64_t align_up(uint64_t offset)
+{
+	return (offset + OWON_SHM_ALIGN - 1) & ~(uint64_t)(OWON_SHM_ALIGN - 1);
+}
+
+static OWON_SHM_SLOT_st *slot_at(const OWON_SHM_st *shm, uint64_t sequence)
+{
+	const OWON_SHM_HEADER_st *header = shm->header;
+	return (OWON_SHM_SLOT_st *)(shm->map + header->slots_offset +
+				    (sequence % header->slots_count) * header->slot_stride);
+}
+
+static unsigned char *slot_data(OWON_SHM_SLOT_st *slot)
+{
+	return (unsigned char *)slot + align_up(sizeof(OWON_SHM_SLOT_st));
+}
+
+// A ring whose publisher is gone is removed. One still published, or an
+// object that can't be checked, is left alone.
+static int remove_stale(const char *name)
+{
+	const OWON_SHM_HEADER_st *header;
+	struct stat stbuf;
+	pid_t pid = 0;
+	int fd;
+
+	fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0)
+		return errno == ENOENT ? 0 : -1;
+	if (fstat(fd, &stbuf) != 0) {
+		close(fd);
+		return -1;
+	}
+	// Too short or without its magic, its publisher died creating it
+	if ((size_t) stbuf.st_size >= sizeof(OWON_SHM_HEADER_st)) {
+		header = mmap(NULL, sizeof(OWON_SHM_HEADER_st), PROT_READ, MAP_SHARED, fd, 0);
+		if (header == MAP_FAILED) {
+			close(fd);
+			return -1;
+		}
+		if (memcmp(header->magic, OWON_SHM_MAGIC, sizeof(OWON_SHM_MAGIC)) == 0)
+			pid = header->pid;
+		munmap((void *) header, sizeof(OWON_SHM_HEADER_st));
+	}
+	close(fd);
+
+	if (pid > 0 && (kill(pid, 0) == 0 || errno == EPERM)) {
+		fprintf(stderr, "%s is already published by process %d\n", name, (int) pid);
+		errno = EEXIST;
+		return -1;
+	}
+	return shm_unlink(name) == 0 || errno == ENOENT ? 0 : -1;
+}
+
+int owon_shm_create(const char *name, uint32_t slots_count, uint64_t slot_size, OWON_SHM_st *shm)
+{
+	OWON_SHM_HEADER_st *header;
+	uint64_t stride, slots_offset;
+	int fd;
+
+	memset(shm, 0, sizeof(OWON_SHM_st));
+	if (slots_count < 2 || slot_size == 0 || strlen(name) >= sizeof(shm->name))
+		return OWON_ERROR;
+
+	slots_offset = align_up(sizeof(OWON_SHM_HEADER_st));
+	stride = align_up(sizeof(OWON_SHM_SLOT_st)) + align_up(slot_size);
+	shm->map_len = slots_offset + slots_count * stride;
+
+	// A ring left by a publisher that died is replaced, a live one isn't
+	fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if (fd < 0 && errno == EEXIST && remove_stale(name) == 0)
+		fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "Unable to create %s: %s\n", name, strerror(errno));
+		return OWON_ERROR;
+	}
+	if (ftruncate(fd, shm->map_len) != 0) {
+		close(fd);
+		shm_unlink(name);
+		return OWON_ERROR_MEMORY;
+	}
+	shm->map = mmap(NULL, shm->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (shm->map == MAP_FAILED) {
+		shm->map = NULL;
+		shm_unlink(name);
+		return OWON_ERROR_MEMORY;
+	}
+
+	// ftruncate gave zeros, every slot is free
+	header = shm->header = (OWON_SHM_HEADER_st *) shm->map;
+	header->version = OWON_SHM_VERSION;
+	header->slots_count = slots_count;
+	header->slot_size = slot_size;
+	header->slot_stride = stride;
+	header->slots_offset = slots_offset;
+	header->pid = getpid();
+	// Readers check the magic, it goes last
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(header->magic, OWON_SHM_MAGIC, sizeof(OWON_SHM_MAGIC));
+
+	shm->writer = 1;
+	strcpy(shm->name, name);
+	return OWON_SUCCESS;
+}
+
+int owon_shm_publish(OWON_SHM_st *shm, const unsigned char *buffer, size_t length,
+		     const HEADER_st *header)
+{
+	OWON_SHM_HEADER_st *ring = shm->header;
+	uint64_t sequence = ring->head;
+	OWON_SHM_SLOT_st *slot = slot_at(shm, sequence);
+	struct timespec now;
+	size_t i;
+
+	if (length > ring->slot_size) {
+		fprintf(stderr, "Capture of %zu bytes doesn't fit in a %llu bytes slot\n",
+			length, (unsigned long long) ring->slot_size);
+		return OWON_ERROR_MEMORY;
+	}
+
+	// Readers still on the previous capture of this slot will see it change
+	__atomic_store_n(&slot->state, 2 * sequence + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	slot->sequence = sequence;
+	slot->length = length;
+	slot->time_ns = (int64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+	memset(slot->model, 0, sizeof(slot->model));
+	memset(slot->serial, 0, sizeof(slot->serial));
+	slot->channels_count = 0;
+	if (header != NULL) {
+		strncpy(slot->model, header->model, sizeof(slot->model) - 1);
+		strncpy(slot->serial, header->serial, sizeof(slot->serial) - 1);
+		for (i = 0; i < header->channels_count && i < OWON_SHM_MAX_CHANNELS; i++) {
+			const CHANNEL_st *channel = header->channels[i];
+			owon_columnar_describe(channel, &slot->channels[i]);
+			slot->channels[i].data_offset = channel->samples - buffer;
+		}
+		slot->channels_count = i;
+	}
+	memcpy(slot_data(slot), buffer, length);
+
+	__atomic_store_n(&slot->state, 2 * sequence + 2, __ATOMIC_RELEASE);
+	__atomic_store_n(&ring->head, sequence + 1, __ATOMIC_RELEASE);
+	__atomic_add_fetch(&ring->futex, 1, __ATOMIC_RELEASE);
+	syscall(SYS_futex, &ring->futex, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+	return OWON_SUCCESS;
+}
+
+int owon_shm_open(const char *name, OWON_SHM_st *shm)
+{
+	const OWON_SHM_HEADER_st *header;
+	struct stat stbuf;
+	int fd;
+
+	memset(shm, 0, sizeof(OWON_SHM_st));
+	fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0)
+		return OWON_ERROR_READ;
+	if (fstat(fd, &stbuf) != 0 || (size_t) stbuf.st_size < sizeof(OWON_SHM_HEADER_st)) {
+		close(fd);
+		return OWON_ERROR_READ;
+	}
+	shm->map_len = stbuf.st_size;
+	shm->map = mmap(NULL, shm->map_len, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (shm->map == MAP_FAILED) {
+		shm->map = NULL;
+		return OWON_ERROR_MEMORY;
+	}
+
+	header = (const OWON_SHM_HEADER_st *) shm->map;
+	if (memcmp(header->magic, OWON_SHM_MAGIC, sizeof(OWON_SHM_MAGIC)) != 0 ||
+	    header->version != OWON_SHM_VERSION || header->slots_count < 2 ||
+	    header->slot_stride < align_up(sizeof(OWON_SHM_SLOT_st)) + header->slot_size ||
+	    header->slots_offset < sizeof(OWON_SHM_HEADER_st) ||
+	    header->slots_offset + (uint64_t) header->slots_count * header->slot_stride > shm->map_len) {
+		owon_shm_close(shm);
+		return OWON_ERROR_HEADER;
+	}
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+	shm->header = (OWON_SHM_HEADER_st *) header;
+	shm->next = __atomic_load_n(&shm->header->head, __ATOMIC_ACQUIRE);
+	return OWON_SUCCESS;
+}
+
+int owon_shm_wait(OWON_SHM_st *shm, int timeout_ms)
+{
+	struct timespec timeout = { timeout_ms / 1000, (timeout_ms % 1000) * 1000000L };
+	uint32_t futex;
+
+	for (;;) {
+		futex = __atomic_load_n(&shm->header->futex, __ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&shm->header->head, __ATOMIC_ACQUIRE) > shm->next)
+			return 1;
+		// Returns at once if a capture was published since futex was read
+		if (syscall(SYS_futex, &shm->header->futex, FUTEX_WAIT, futex,
+			    timeout_ms < 0 ? NULL : &timeout, NULL, 0) != 0 &&
+		    errno == ETIMEDOUT)
+			return __atomic_load_n(&shm->header->head, __ATOMIC_ACQUIRE) > shm->next;
+	}
+}
+
+int owon_shm_next(OWON_SHM_st *shm, const OWON_SHM_SLOT_st **slot, const unsigned char **data)
+{
+	OWON_SHM_HEADER_st *header = shm->header;
+	OWON_SHM_SLOT_st *current;
+	uint64_t head;
+
+	for (;;) {
+		head = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+		if (head <= shm->next)
+			return 0;
+		// Lapped: resume at the oldest capture still in the ring
+		if (head - shm->next > header->slots_count) {
+			shm->overruns += head - header->slots_count - shm->next;
+			shm->next = head - header->slots_count;
+		}
+
+		current = slot_at(shm, shm->next);
+		if (__atomic_load_n(&current->state, __ATOMIC_ACQUIRE) == 2 * shm->next + 2 &&
+		    current->length <= header->slot_size) {
+			*slot = current;
+			*data = slot_data(current);
+			return 1;
+		}
+		// Being overwritten already
+		shm->overruns++;
+		shm->next++;
+	}
+}
+
+int owon_shm_done(OWON_SHM_st *shm)
+{
+	OWON_SHM_SLOT_st *current = slot_at(shm, shm->next);
+	uint64_t sequence = shm->next++;
+
+	// The reads of the slot happen before the check of its state
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&current->state, __ATOMIC_RELAXED) != 2 * sequence + 2) {
+		shm->overruns++;
+		return OWON_ERROR_OVERRUN;
+	}
+	return OWON_SUCCESS;
+}
+
+void owon_shm_close(OWON_SHM_st *shm)
+{
+	if (shm->map != NULL)
+		munmap(shm->map, shm->map_len);
+	if (shm->writer)
+		shm_unlink(shm->name);
+	memset(shm, 0, sizeof(OWON_SHM_st));
+}
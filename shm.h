@@ -0,0 +1,104 @@
+/*
+ * shm - shared memory ring of captures for local consumers
+ * Copyright (c) 2014 Jonathan Bisson <bjonnh-owon@bjonnh.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef _SHM_H_
+#define _SHM_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include "parse.h"
+#include "columnar.h"
+
+// One publisher writes the captures in a ring of fixed size slots in a
+// POSIX shared memory object, any number of readers map it read-only.
+// Nothing is locked: every slot carries a sequence number, odd while the
+// publisher writes it, that a reader checks before and after using the
+// slot in place. A reader too slow for the ring loses the captures that
+// were overwritten and is told so.
+//
+//   OWON_SHM_HEADER_st    at offset 0
+//   slots                 slots_count of them, every slot_stride bytes
+//                         from slots_offset: an OWON_SHM_SLOT_st record,
+//                         then the raw capture at OWON_SHM_ALIGN
+
+#define OWON_SHM_MAGIC "OWONSHM"
+#define OWON_SHM_VERSION 1
+#define OWON_SHM_ALIGN 64
+#define OWON_SHM_MAX_CHANNELS 8
+
+// Defaults of the publisher
+#define OWON_SHM_SLOTS 8
+#define OWON_SHM_SLOT_SIZE (32 << 20)
+
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t slots_count;
+	uint64_t slot_size;     // largest capture a slot holds
+	uint64_t slot_stride;
+	uint64_t slots_offset;
+	int32_t pid;            // of the publisher, to tell a ring left behind
+	uint32_t reserved;
+	uint64_t head __attribute__((aligned(OWON_SHM_ALIGN))); // captures published
+	uint32_t futex;         // bumped at each capture, readers sleep on it
+} OWON_SHM_HEADER_st;
+
+typedef struct {
+	uint64_t state;         // 2 * sequence + 1 while written, + 2 once done
+	uint64_t sequence;
+	uint64_t length;        // bytes of raw capture
+	int64_t time_ns;        // CLOCK_REALTIME of the capture
+	char model[8];
+	char serial[32];
+	uint32_t channels_count; // 0 when the capture wasn't parsed
+	uint32_t reserved;
+	// Parsed summary, data_offset is relative to the raw capture
+	COLUMNAR_CHANNEL_st channels[OWON_SHM_MAX_CHANNELS];
+} OWON_SHM_SLOT_st;
+
+typedef struct {
+	int writer;
+	char name[256];
+	unsigned char *map;
+	size_t map_len;
+	OWON_SHM_HEADER_st *header;
+	uint64_t next;          // reader: next sequence wanted
+	uint64_t overruns;      // reader: captures lost so far
+} OWON_SHM_st;
+
+// Publisher, name is a shm_open name such as "/owon"
+int owon_shm_create(const char *name, uint32_t slots_count, uint64_t slot_size, OWON_SHM_st *shm);
+// header may be NULL when the capture wasn't parsed
+int owon_shm_publish(OWON_SHM_st *shm, const unsigned char *buffer, size_t length,
+		     const HEADER_st *header);
+
+// Reader, starts with the next capture published
+int owon_shm_open(const char *name, OWON_SHM_st *shm);
+// Waits up to timeout_ms (-1 forever) for a capture, returns 1 if one is there
+int owon_shm_wait(OWON_SHM_st *shm, int timeout_ms);
+// Returns 1 and points slot and data into the ring, 0 when there is no new
+// capture. Captures skipped because they were overwritten count in overruns.
+int owon_shm_next(OWON_SHM_st *shm, const OWON_SHM_SLOT_st **slot, const unsigned char **data);
+// Ends the use of the capture given by owon_shm_next, OWON_ERROR_OVERRUN
+// means it was overwritten meanwhile and what was read must be dropped
+int owon_shm_done(OWON_SHM_st *shm);
+
+// Both sides, the publisher also removes the object
+void owon_shm_close(OWON_SHM_st *shm);
+
+#endif
@@ -0,0 +1,455 @@
+/*
+ * spectrum - windowed FFT of the channels, averaged over captures
+ * Copyright (c) 2014 Jonathan Bisson <bjonnh-owon@bjonnh.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <math.h>
+#include "spectrum.h"
+#include "decode.h"
+#include "format.h"
+#include "owon.h"
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+// Digits after the decimal point in owon_output_spectrum
+#define SPECTRUM_FREQUENCY_PRECISION 6
+#define SPECTRUM_DBV_PRECISION 3
+
+static const char *window_names[OWON_WINDOW_COUNT] = {
+	"rect", "hann", "blackman", "flattop"
+};
+
+// Fills factors with radix, length below pairs, returns 0 when length is
+// not made of 2, 3 and 5. The radix 5 and 3 passes go first, the last
+// passes on contiguous blocks are then the cheap radix 4 and 2 ones.
+static int factorize(size_t length, size_t *factors)
+{
+	static const size_t radices[] = { 5, 3, 4, 2 };
+	size_t i, n = 0;
+
+	if (length == 0)
+		return 0;
+	for (i = 0; i < sizeof(radices) / sizeof(radices[0]); i++) {
+		while (length % radices[i] == 0 && length > 1) {
+			if (n == OWON_SPECTRUM_MAX_FACTORS)
+				return 0;
+			length /= radices[i];
+			factors[2 * n] = radices[i];
+			factors[2 * n + 1] = length;
+			n++;
+		}
+	}
+	if (length != 1)
+		return 0;
+	// A single point transform is a copy
+	if (n == 0) {
+		factors[0] = 1;
+		factors[1] = 1;
+	}
+	return 1;
+}
+
+size_t owon_spectrum_size(size_t samples)
+{
+	size_t factors[2 * OWON_SPECTRUM_MAX_FACTORS];
+	size_t size;
+
+	for (size = samples & ~(size_t) 1; size >= 2; size -= 2)
+		if (factorize(size / 2, factors))
+			return size;
+	return 0;
+}
+
+int owon_spectrum_window(const char *name)
+{
+	int i;
+
+	for (i = 0; i < OWON_WINDOW_COUNT; i++)
+		if (strcasecmp(name, window_names[i]) == 0)
+			return i;
+	return -1;
+}
+
+// Periodic windows, the transform sees them as repeating
+static double window_coefficient(int window, size_t i, size_t size)
+{
+	double x = 2.0 * M_PI * i / size;
+
+	switch (window) {
+	case OWON_WINDOW_HANN:
+		return 0.5 - 0.5 * cos(x);
+	case OWON_WINDOW_BLACKMAN:
+		return 0.42 - 0.5 * cos(x) + 0.08 * cos(2 * x);
+	case OWON_WINDOW_FLATTOP:
+		return 0.21557895 - 0.41663158 * cos(x) + 0.277263158 * cos(2 * x)
+			- 0.083578947 * cos(3 * x) + 0.006947368 * cos(4 * x);
+	default:
+		return 1.0;
+	}
+}
+
+int owon_spectrum_init(OWON_SPECTRUM_st *spectrum, size_t size, int window, unsigned int averages)
+{
+	size_t half = size / 2, i;
+	double angle;
+
+	memset(spectrum, 0, sizeof(OWON_SPECTRUM_st));
+	if (size < 2 || size % 2 != 0 || window < 0 || window >= OWON_WINDOW_COUNT ||
+	    !factorize(half, spectrum->factors))
+		return OWON_ERROR;
+	spectrum->size = size;
+	spectrum->window = window;
+	spectrum->averages = averages;
+
+	spectrum->coefficients = malloc(size * sizeof(double));
+	spectrum->twiddles = malloc(half * sizeof(OWON_COMPLEX_st));
+	spectrum->split = malloc(half * sizeof(OWON_COMPLEX_st));
+	spectrum->input = malloc(half * sizeof(OWON_COMPLEX_st));
+	spectrum->output = malloc(half * sizeof(OWON_COMPLEX_st));
+	spectrum->power = calloc(half + 1, sizeof(double));
+	if (spectrum->coefficients == NULL || spectrum->twiddles == NULL || spectrum->split == NULL ||
+	    spectrum->input == NULL || spectrum->output == NULL || spectrum->power == NULL) {
+		owon_spectrum_free(spectrum);
+		return OWON_ERROR_MEMORY;
+	}
+
+	for (i = 0; i < size; i++) {
+		spectrum->coefficients[i] = window_coefficient(window, i, size);
+		spectrum->window_sum += spectrum->coefficients[i];
+	}
+	for (i = 0; i < half; i++) {
+		angle = -2.0 * M_PI * i / half;
+		spectrum->twiddles[i].re = cos(angle);
+		spectrum->twiddles[i].im = sin(angle);
+		angle = -2.0 * M_PI * i / size;
+		spectrum->split[i].re = cos(angle);
+		spectrum->split[i].im = sin(angle);
+	}
+	return OWON_SUCCESS;
+}
+
+void owon_spectrum_reset(OWON_SPECTRUM_st *spectrum)
+{
+	spectrum->count = 0;
+	spectrum->sample_rate = 0;
+	if (spectrum->power != NULL)
+		memset(spectrum->power, 0, owon_spectrum_bins(spectrum) * sizeof(double));
+}
+
+void owon_spectrum_free(OWON_SPECTRUM_st *spectrum)
+{
+	free(spectrum->coefficients);
+	free(spectrum->twiddles);
+	free(spectrum->split);
+	free(spectrum->input);
+	free(spectrum->output);
+	free(spectrum->power);
+	memset(spectrum, 0, sizeof(OWON_SPECTRUM_st));
+}
+
+// The butterflies combine p transforms of m points, their twiddles are
+// every stride of the table
+
+static void butterfly2(OWON_COMPLEX_st *out, const OWON_COMPLEX_st *twiddles, size_t stride, size_t m)
+{
+	OWON_COMPLEX_st *out2 = out + m, t;
+	const OWON_COMPLEX_st *tw = twiddles;
+	size_t k;
+
+	for (k = 0; k < m; k++) {
+		t.re = out2[k].re * tw->re - out2[k].im * tw->im;
+		t.im = out2[k].re * tw->im + out2[k].im * tw->re;
+		out2[k].re = out[k].re - t.re;
+		out2[k].im = out[k].im - t.im;
+		out[k].re += t.re;
+		out[k].im += t.im;
+		tw += stride;
+	}
+}
+
+static inline OWON_COMPLEX_st complex_mul(OWON_COMPLEX_st a, OWON_COMPLEX_st b)
+{
+	OWON_COMPLEX_st r = { a.re * b.re - a.im * b.im, a.re * b.im + a.im * b.re };
+	return r;
+}
+
+static void butterfly4(OWON_COMPLEX_st *out, const OWON_COMPLEX_st *twiddles, size_t stride, size_t m)
+{
+	OWON_COMPLEX_st s0, s1, s2, s3, s4, s5;
+	size_t k;
+
+	for (k = 0; k < m; k++) {
+		s0 = complex_mul(out[k + m], twiddles[k * stride]);
+		s1 = complex_mul(out[k + 2 * m], twiddles[2 * k * stride]);
+		s2 = complex_mul(out[k + 3 * m], twiddles[3 * k * stride]);
+
+		s5.re = out[k].re - s1.re;
+		s5.im = out[k].im - s1.im;
+		out[k].re += s1.re;
+		out[k].im += s1.im;
+		s3.re = s0.re + s2.re;
+		s3.im = s0.im + s2.im;
+		s4.re = s0.re - s2.re;
+		s4.im = s0.im - s2.im;
+
+		out[k + 2 * m].re = out[k].re - s3.re;
+		out[k + 2 * m].im = out[k].im - s3.im;
+		out[k].re += s3.re;
+		out[k].im += s3.im;
+		out[k + m].re = s5.re + s4.im;
+		out[k + m].im = s5.im - s4.re;
+		out[k + 3 * m].re = s5.re - s4.im;
+		out[k + 3 * m].im = s5.im + s4.re;
+	}
+}
+
+static void butterfly3(OWON_COMPLEX_st *out, const OWON_COMPLEX_st *twiddles, size_t stride, size_t m)
+{
+	OWON_COMPLEX_st s0, s1, s2, s3;
+	double epi3 = twiddles[stride * m].im;
+	size_t k;
+
+	for (k = 0; k < m; k++) {
+		s1 = complex_mul(out[k + m], twiddles[k * stride]);
+		s2 = complex_mul(out[k + 2 * m], twiddles[2 * k * stride]);
+		s3.re = s1.re + s2.re;
+		s3.im = s1.im + s2.im;
+		s0.re = (s1.re - s2.re) * epi3;
+		s0.im = (s1.im - s2.im) * epi3;
+
+		out[k + m].re = out[k].re - s3.re / 2;
+		out[k + m].im = out[k].im - s3.im / 2;
+		out[k].re += s3.re;
+		out[k].im += s3.im;
+		out[k + 2 * m].re = out[k + m].re + s0.im;
+		out[k + 2 * m].im = out[k + m].im - s0.re;
+		out[k + m].re -= s0.im;
+		out[k + m].im += s0.re;
+	}
+}
+
+static void butterfly5(OWON_COMPLEX_st *out, const OWON_COMPLEX_st *twiddles, size_t stride, size_t m)
+{
+	OWON_COMPLEX_st s0, s1, s2, s3, s4, s5, s6, s7, s8, s9, s10, s11, s12;
+	OWON_COMPLEX_st ya = twiddles[stride * m], yb = twiddles[2 * stride * m];
+	size_t k;
+
+	for (k = 0; k < m; k++) {
+		s0 = out[k];
+		s1 = complex_mul(out[k + m], twiddles[k * stride]);
+		s2 = complex_mul(out[k + 2 * m], twiddles[2 * k * stride]);
+		s3 = complex_mul(out[k + 3 * m], twiddles[3 * k * stride]);
+		s4 = complex_mul(out[k + 4 * m], twiddles[4 * k * stride]);
+
+		s7.re = s1.re + s4.re;
+		s7.im = s1.im + s4.im;
+		s10.re = s1.re - s4.re;
+		s10.im = s1.im - s4.im;
+		s8.re = s2.re + s3.re;
+		s8.im = s2.im + s3.im;
+		s9.re = s2.re - s3.re;
+		s9.im = s2.im - s3.im;
+
+		out[k].re = s0.re + s7.re + s8.re;
+		out[k].im = s0.im + s7.im + s8.im;
+
+		s5.re = s0.re + s7.re * ya.re + s8.re * yb.re;
+		s5.im = s0.im + s7.im * ya.re + s8.im * yb.re;
+		s6.re = s10.im * ya.im + s9.im * yb.im;
+		s6.im = -s10.re * ya.im - s9.re * yb.im;
+		out[k + m].re = s5.re - s6.re;
+		out[k + m].im = s5.im - s6.im;
+		out[k + 4 * m].re = s5.re + s6.re;
+		out[k + 4 * m].im = s5.im + s6.im;
+
+		s11.re = s0.re + s7.re * yb.re + s8.re * ya.re;
+		s11.im = s0.im + s7.im * yb.re + s8.im * ya.re;
+		s12.re = -s10.im * yb.im + s9.im * ya.im;
+		s12.im = s10.re * yb.im - s9.re * ya.im;
+		out[k + 2 * m].re = s11.re + s12.re;
+		out[k + 2 * m].im = s11.im + s12.im;
+		out[k + 3 * m].re = s11.re - s12.re;
+		out[k + 3 * m].im = s11.im - s12.im;
+	}
+}
+
+// Decimation in time: the p interleaved sub-sequences of in are transformed
+// into consecutive blocks of out, which the butterflies then combine
+static void fft(const OWON_SPECTRUM_st *spectrum, OWON_COMPLEX_st *out, const OWON_COMPLEX_st *in,
+		size_t stride, const size_t *factors)
+{
+	size_t p = factors[0], m = factors[1], q;
+	OWON_COMPLEX_st *begin = out;
+
+	if (m == 1) {
+		for (q = 0; q < p; q++, in += stride)
+			out[q] = *in;
+	} else {
+		for (q = 0; q < p; q++, in += stride, out += m)
+			fft(spectrum, out, in, stride * p, factors + 2);
+	}
+
+	switch (p) {
+	case 1:
+		break;
+	case 2:
+		butterfly2(begin, spectrum->twiddles, stride, m);
+		break;
+	case 3:
+		butterfly3(begin, spectrum->twiddles, stride, m);
+		break;
+	case 4:
+		butterfly4(begin, spectrum->twiddles, stride, m);
+		break;
+	case 5:
+		butterfly5(begin, spectrum->twiddles, stride, m);
+		break;
+	}
+}
+
+int owon_spectrum_add(OWON_SPECTRUM_st *spectrum, const CHANNEL_st *channel)
+{
+	size_t half = spectrum->size / 2, k;
+	double sample_time, sample_rate, weight, power;
+	double *volts = (double *) spectrum->input;
+	OWON_COMPLEX_st *z = spectrum->output, even, odd, x;
+
+	if (spectrum->power == NULL || channel->samples == NULL || channel->samples_file < spectrum->size)
+		return OWON_ERROR;
+
+	sample_time = owon_channel_time(channel, 1) - owon_channel_time(channel, 0);
+	sample_rate = sample_time > 0 ? 1.0 / sample_time : 0;
+	if (spectrum->count > 0 && sample_rate != spectrum->sample_rate)
+		owon_spectrum_reset(spectrum);
+	spectrum->sample_rate = sample_rate;
+
+	if (channel->datatype == 2)
+		owon_decode_s16_f64(channel->samples, spectrum->size, owon_channel_volts_per_count(channel), volts);
+	else
+		owon_decode_s8_f64(channel->samples, spectrum->size, owon_channel_volts_per_count(channel), volts);
+	for (k = 0; k < spectrum->size; k++)
+		volts[k] *= spectrum->coefficients[k];
+
+	fft(spectrum, z, spectrum->input, 1, spectrum->factors);
+
+	spectrum->count++;
+	weight = 1.0 / (spectrum->averages > 0 && spectrum->count > spectrum->averages ?
+			spectrum->averages : spectrum->count);
+
+	// The even samples went in the real parts, the odd ones in the
+	// imaginary parts: X[k] = E[k] + W^k O[k]
+	power = (z[0].re + z[0].im) * (z[0].re + z[0].im);
+	spectrum->power[0] += (power - spectrum->power[0]) * weight;
+	power = (z[0].re - z[0].im) * (z[0].re - z[0].im);
+	spectrum->power[half] += (power - spectrum->power[half]) * weight;
+	for (k = 1; k < half; k++) {
+		even.re = (z[k].re + z[half - k].re) / 2;
+		even.im = (z[k].im - z[half - k].im) / 2;
+		odd.re = (z[k].im + z[half - k].im) / 2;
+		odd.im = (z[half - k].re - z[k].re) / 2;
+		x = complex_mul(odd, spectrum->split[k]);
+		x.re += even.re;
+		x.im += even.im;
+		power = x.re * x.re + x.im * x.im;
+		spectrum->power[k] += (power - spectrum->power[k]) * weight;
+	}
+	return OWON_SUCCESS;
+}
+
+int owon_spectrum_add_header(OWON_SPECTRUM_st *spectra, size_t count, const HEADER_st *header,
+			     int window, unsigned int averages)
+{
+	size_t i, size;
+	int ret;
+
+	if (count > header->channels_count)
+		count = header->channels_count;
+	for (i = 0; i < count; i++) {
+		size = owon_spectrum_size(header->channels[i]->samples_file);
+		if (spectra[i].size != size || spectra[i].window != window ||
+		    spectra[i].averages != averages) {
+			owon_spectrum_free(&spectra[i]);
+			ret = owon_spectrum_init(&spectra[i], size, window, averages);
+			if (ret < 0)
+				return ret;
+		}
+		ret = owon_spectrum_add(&spectra[i], header->channels[i]);
+		if (ret < 0)
+			return ret;
+	}
+	return count;
+}
+
+double owon_spectrum_frequency(const OWON_SPECTRUM_st *spectrum, size_t bin)
+{
+	return spectrum->sample_rate * bin / spectrum->size;
+}
+
+double owon_spectrum_dbv(const OWON_SPECTRUM_st *spectrum, size_t bin)
+{
+	double power = spectrum->power[bin] / (spectrum->window_sum * spectrum->window_sum);
+
+	// A sine puts half its power in the negative frequencies
+	if (bin > 0 && bin < spectrum->size / 2)
+		power *= 2;
+	if (power <= 0)
+		return OWON_SPECTRUM_FLOOR;
+	power = 10 * log10(power);
+	return power > OWON_SPECTRUM_FLOOR ? power : OWON_SPECTRUM_FLOOR;
+}
+
+int owon_output_spectrum(const HEADER_st *header, const OWON_SPECTRUM_st *spectra,
+			 size_t count, FILE *file)
+{
+	OUTBUF_st out;
+	size_t bin, bins, i;
+	int ret;
+
+	if (count == 0)
+		return OWON_ERROR;
+	for (i = 1; i < count; i++)
+		if (spectra[i].size != spectra[0].size || spectra[i].sample_rate != spectra[0].sample_rate)
+			return OWON_ERROR;
+	if (owon_outbuf_init(&out, file, OWON_OUTBUF_SIZE) != 0)
+		return OWON_ERROR_MEMORY;
+
+	owon_outbuf_string(&out, "frequency");
+	for (i = 0; i < count; i++) {
+		owon_outbuf_char(&out, ',');
+		if (i < header->channels_count)
+			owon_outbuf_string(&out, (const char *) header->channels[i]->name);
+	}
+	owon_outbuf_char(&out, '\n');
+
+	bins = owon_spectrum_bins(&spectra[0]);
+	for (bin = 0; bin < bins; bin++) {
+		owon_outbuf_fixed(&out, owon_spectrum_frequency(&spectra[0], bin), SPECTRUM_FREQUENCY_PRECISION);
+		for (i = 0; i < count; i++) {
+			owon_outbuf_char(&out, ',');
+			owon_outbuf_fixed(&out, owon_spectrum_dbv(&spectra[i], bin), SPECTRUM_DBV_PRECISION);
+		}
+		owon_outbuf_char(&out, '\n');
+	}
+
+	ret = owon_outbuf_flush(&out);
+	owon_outbuf_free(&out);
+	return ret;
+}
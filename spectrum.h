@@ -0,0 +1,98 @@
+/*
+ * spectrum - windowed FFT of the channels, averaged over captures
+ * Copyright (c) 2014 Jonathan Bisson <bjonnh-owon@bjonnh.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef _SPECTRUM_H_
+#define _SPECTRUM_H_
+
+#include <stdio.h>
+#include <stddef.h>
+#include "parse.h"
+
+// The real samples go, two by two, through a complex FFT of half their
+// number with radix 4, 2, 3 and 5 butterflies, so the transform takes any
+// even size whose half is made of those factors: the usual memory depths
+// (1k, 10k... 10M samples) are transformed whole. The window, the twiddles
+// and the work buffers are computed once by owon_spectrum_init and reused
+// by every capture added.
+
+enum owon_spectrum_window {
+	OWON_WINDOW_RECTANGULAR = 0,
+	OWON_WINDOW_HANN,
+	OWON_WINDOW_BLACKMAN,
+	OWON_WINDOW_FLATTOP,     // amplitude accurate to 0.01 dB between bins
+	OWON_WINDOW_COUNT
+};
+
+// What owon_spectrum_dbv gives for an empty bin
+#define OWON_SPECTRUM_FLOOR (-200.0)
+#define OWON_SPECTRUM_MAX_FACTORS 40
+
+typedef struct {
+	double re;
+	double im;
+} OWON_COMPLEX_st;
+
+typedef struct {
+	size_t size;                 // samples per transform
+	int window;
+	unsigned int averages;       // 0 to average every capture added
+	unsigned int count;          // captures in the average so far
+	double sample_rate;          // Hz, of the captures in the average
+	double window_sum;
+	size_t factors[2 * OWON_SPECTRUM_MAX_FACTORS]; // radix, then length below
+	double *coefficients;        // the window
+	OWON_COMPLEX_st *twiddles;   // size / 2, of the complex FFT
+	OWON_COMPLEX_st *split;      // size / 2, separate the real transform
+	OWON_COMPLEX_st *input;      // windowed volts, two samples each
+	OWON_COMPLEX_st *output;
+	double *power;               // size / 2 + 1 bins, averaged
+} OWON_SPECTRUM_st;
+
+// Largest size up to samples the transform takes, 0 if there is none
+size_t owon_spectrum_size(size_t samples);
+// OWON_WINDOW_* of "rect", "hann", "blackman" or "flattop", -1 otherwise
+int owon_spectrum_window(const char *name);
+
+// With averages > 0 the average is exponential over about that many
+// captures, else every capture added weighs the same.
+int owon_spectrum_init(OWON_SPECTRUM_st *spectrum, size_t size, int window, unsigned int averages);
+// Transforms the first size samples of channel into the average. A capture
+// at another sample rate starts a new average.
+int owon_spectrum_add(OWON_SPECTRUM_st *spectrum, const CHANNEL_st *channel);
+// Adds each channel of header to its spectrum in spectra, of count entries,
+// a spectrum of another size (or zeroed, never initialized) is initialized
+// for the channel first. Returns how many spectra were added to.
+int owon_spectrum_add_header(OWON_SPECTRUM_st *spectra, size_t count, const HEADER_st *header,
+			     int window, unsigned int averages);
+void owon_spectrum_reset(OWON_SPECTRUM_st *spectrum);
+void owon_spectrum_free(OWON_SPECTRUM_st *spectrum);
+
+static inline size_t owon_spectrum_bins(const OWON_SPECTRUM_st *spectrum)
+{
+	return spectrum->size / 2 + 1;
+}
+double owon_spectrum_frequency(const OWON_SPECTRUM_st *spectrum, size_t bin);
+// RMS level of the bin in dB relative to 1 V
+double owon_spectrum_dbv(const OWON_SPECTRUM_st *spectrum, size_t bin);
+
+// CSV of frequency then dBV of each channel, the count spectra must have the
+// same size and sample rate. header gives the channel names.
+int owon_output_spectrum(const HEADER_st *header, const OWON_SPECTRUM_st *spectra,
+			 size_t count, FILE *file);
+
+#endif
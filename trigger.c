@@ -0,0 +1,583 @@
+/*
+ * trigger - software trigger, events searched in the channel samples
+ * Copyright (c) 2014 Jonathan Bisson <bjonnh-owon@bjonnh.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include "trigger.h"
+#include "decode.h"
+#include "owon.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define TRIGGER_X86
+#include <immintrin.h>
+#endif
+
+// Thresholds of a side a state doesn't wait on
+#define SCAN_NEVER_ABOVE INT32_MAX
+#define SCAN_NEVER_BELOW INT32_MIN
+// Longest spec owon_trigger_parse takes
+#define TRIGGER_SPEC_MAX 256
+
+static inline int16_t load_s16(const unsigned char *p)
+{
+	return (int16_t)(p[1] << 8 | p[0]);
+}
+
+// The scan: first sample from i over above or under below, count if none.
+// Scalar versions also do the tails of the vector ones.
+
+static size_t scan_s8_scalar(const unsigned char *src, size_t i, size_t count, int32_t above, int32_t below)
+{
+	int32_t value;
+
+	for (; i < count; i++) {
+		value = (int8_t) src[i];
+		if (value > above || value < below)
+			break;
+	}
+	return i;
+}
+
+static size_t scan_s16_scalar(const unsigned char *src, size_t i, size_t count, int32_t above, int32_t below)
+{
+	int32_t value;
+
+	for (; i < count; i++) {
+		value = load_s16(src + 2 * i);
+		if (value > above || value < below)
+			break;
+	}
+	return i;
+}
+
+#ifdef TRIGGER_X86
+
+__attribute__((target("sse2")))
+static size_t scan_s8_sse2(const unsigned char *src, size_t i, size_t count, int32_t above, int32_t below)
+{
+	__m128i a = _mm_set1_epi8((char) above), b = _mm_set1_epi8((char) below), v;
+	unsigned int mask;
+
+	for (; i + 16 <= count; i += 16) {
+		v = _mm_loadu_si128((const __m128i *)(src + i));
+		mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpgt_epi8(v, a), _mm_cmpgt_epi8(b, v)));
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+	return scan_s8_scalar(src, i, count, above, below);
+}
+
+// A 16 bits lane sets two bits of the byte mask
+__attribute__((target("sse2")))
+static size_t scan_s16_sse2(const unsigned char *src, size_t i, size_t count, int32_t above, int32_t below)
+{
+	__m128i a = _mm_set1_epi16((short) above), b = _mm_set1_epi16((short) below), v;
+	unsigned int mask;
+
+	for (; i + 8 <= count; i += 8) {
+		v = _mm_loadu_si128((const __m128i *)(src + 2 * i));
+		mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpgt_epi16(v, a), _mm_cmpgt_epi16(b, v)));
+		if (mask)
+			return i + __builtin_ctz(mask) / 2;
+	}
+	return scan_s16_scalar(src, i, count, above, below);
+}
+
+__attribute__((target("avx2")))
+static size_t scan_s8_avx2(const unsigned char *src, size_t i, size_t count, int32_t above, int32_t below)
+{
+	__m256i a = _mm256_set1_epi8((char) above), b = _mm256_set1_epi8((char) below), v;
+	unsigned int mask;
+
+	for (; i + 32 <= count; i += 32) {
+		v = _mm256_loadu_si256((const __m256i *)(src + i));
+		mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpgt_epi8(v, a), _mm256_cmpgt_epi8(b, v)));
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+	return scan_s8_scalar(src, i, count, above, below);
+}
+
+__attribute__((target("avx2")))
+static size_t scan_s16_avx2(const unsigned char *src, size_t i, size_t count, int32_t above, int32_t below)
+{
+	__m256i a = _mm256_set1_epi16((short) above), b = _mm256_set1_epi16((short) below), v;
+	unsigned int mask;
+
+	for (; i + 16 <= count; i += 16) {
+		v = _mm256_loadu_si256((const __m256i *)(src + 2 * i));
+		mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpgt_epi16(v, a), _mm256_cmpgt_epi16(b, v)));
+		if (mask)
+			return i + __builtin_ctz(mask) / 2;
+	}
+	return scan_s16_scalar(src, i, count, above, below);
+}
+
+#endif
+
+// Runtime selection
+
+struct trigger_kernels {
+	size_t (*s8)(const unsigned char *, size_t, size_t, int32_t, int32_t);
+	size_t (*s16)(const unsigned char *, size_t, size_t, int32_t, int32_t);
+};
+
+// Indexed by owon_cpu_level
+static const struct trigger_kernels implementations[] = {
+	{ scan_s8_scalar, scan_s16_scalar },
+#ifdef TRIGGER_X86
+	{ scan_s8_sse2, scan_s16_sse2 },
+	{ scan_s8_avx2, scan_s16_avx2 },
+#endif
+};
+
+static const struct trigger_kernels *kernels = &implementations[OWON_CPU_SCALAR];
+static pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+
+static void select_kernels(void)
+{
+	kernels = &implementations[owon_cpu_level()];
+}
+
+const char *owon_trigger_implementation(void)
+{
+	pthread_once(&kernels_once, select_kernels);
+	return owon_cpu_level_name(kernels - implementations);
+}
+
+// A channel being searched and the events found so far
+
+typedef struct {
+	const OWON_TRIGGER_st *trigger;
+	const CHANNEL_st *channel;
+	int index;
+	const unsigned char *samples;
+	size_t count;
+	int wide;
+	int32_t min, max;          // of the samples type
+	double scale;              // volts per count
+	OWON_TRIGGER_EVENT_st *events;
+	size_t max_events;
+	size_t found;
+} SEARCH_st;
+
+static size_t scan(const SEARCH_st *search, size_t i, int32_t above, int32_t below)
+{
+	if (i >= search->count)
+		return search->count;
+	// Every sample is over or under, none can be
+	if (above < search->min || below > search->max)
+		return i;
+	if (above > search->max)
+		above = search->max;
+	if (below < search->min)
+		below = search->min;
+	if (search->wide)
+		return kernels->s16(search->samples, i, search->count, above, below);
+	return kernels->s8(search->samples, i, search->count, above, below);
+}
+
+static inline int32_t sample_at(const SEARCH_st *search, size_t i)
+{
+	return search->wide ? load_s16(search->samples + 2 * i) : (int8_t) search->samples[i];
+}
+
+// Volts to the thresholds of scan, the samples being whole counts
+static int32_t counts(double value)
+{
+	if (value > 1 << 20)
+		return 1 << 20;
+	if (value < -(1 << 20))
+		return -(1 << 20);
+	return (int32_t) value;
+}
+
+// value >= volts when the sample is over the result
+static int32_t at_or_over(const SEARCH_st *search, double volts)
+{
+	return counts(ceil(volts / search->scale) - 1);
+}
+
+// value > volts
+static int32_t over(const SEARCH_st *search, double volts)
+{
+	return counts(floor(volts / search->scale));
+}
+
+// value < volts when the sample is under the result
+static int32_t under(const SEARCH_st *search, double volts)
+{
+	return counts(ceil(volts / search->scale));
+}
+
+// NULL when the slope isn't searched or there is no more room
+static OWON_TRIGGER_EVENT_st *found(SEARCH_st *search, int slope, size_t sample, size_t length)
+{
+	OWON_TRIGGER_EVENT_st *event;
+
+	if (!(search->trigger->slope & slope) || search->found >= search->max_events)
+		return NULL;
+	event = &search->events[search->found++];
+	event->channel = search->index;
+	event->slope = slope;
+	event->sample = sample;
+	event->length = length;
+	event->time = owon_channel_time(search->channel, sample);
+	return event;
+}
+
+// Edges and pulses: high from the first sample at or over upper, low from
+// the first one under lower
+static void search_levels(SEARCH_st *search)
+{
+	const OWON_TRIGGER_st *trigger = search->trigger;
+	double upper = trigger->level, lower = trigger->level;
+	int32_t over_upper, under_lower;
+	size_t i = 0, start = 0, limit = 0;
+	int state = 0, known = 0, high;
+
+	if (trigger->slope == OWON_TRIGGER_RISING) {
+		lower -= trigger->hysteresis;
+	} else if (trigger->slope == OWON_TRIGGER_FALLING) {
+		upper += trigger->hysteresis;
+	} else {
+		upper += trigger->hysteresis / 2;
+		lower -= trigger->hysteresis / 2;
+	}
+	over_upper = at_or_over(search, upper);
+	under_lower = under(search, lower);
+	if (trigger->type == OWON_TRIGGER_PULSE) {
+		double sample_time = owon_channel_time(search->channel, 1) - owon_channel_time(search->channel, 0);
+		// In samples: a pulse of n lasts n * sample_time, longer than width
+		// when n > floor(width / sample_time), shorter when n < ceil()
+		if (sample_time > 0)
+			limit = trigger->longer ? (size_t) floor(trigger->width / sample_time) :
+				(size_t) ceil(trigger->width / sample_time);
+	}
+
+	while (search->found < search->max_events) {
+		i = scan(search, i, state > 0 ? SCAN_NEVER_ABOVE : over_upper,
+			 state < 0 ? SCAN_NEVER_BELOW : under_lower);
+		if (i >= search->count)
+			break;
+		high = sample_at(search, i) > over_upper;
+
+		// A pulse is timed from a transition, not from the first sample
+		if (trigger->type == OWON_TRIGGER_EDGE && state != 0) {
+			found(search, high ? OWON_TRIGGER_RISING : OWON_TRIGGER_FALLING, i, 0);
+		} else if (trigger->type == OWON_TRIGGER_PULSE && known) {
+			if (trigger->longer ? i - start > limit : i - start < limit)
+				found(search, state > 0 ? OWON_TRIGGER_RISING : OWON_TRIGGER_FALLING,
+				      start, i - start);
+		}
+		known = state != 0;
+		state = high ? 1 : -1;
+		start = i;
+	}
+
+	// Still going at the end of the capture, it is already too long
+	if (trigger->type == OWON_TRIGGER_PULSE && trigger->longer && known &&
+	    search->count - start > limit)
+		found(search, state > 0 ? OWON_TRIGGER_RISING : OWON_TRIGGER_FALLING,
+		      start, search->count - start);
+}
+
+// Runts: a positive one crosses low and goes back under low - hysteresis
+// without reaching high, a negative one the other way around
+enum runt_state {
+	RUNT_MIDDLE,    // waiting to be clearly under low or over high
+	RUNT_LOW,
+	RUNT_UP,        // crossed low from under
+	RUNT_HIGH,
+	RUNT_DOWN       // crossed high from over
+};
+
+static void search_runts(SEARCH_st *search)
+{
+	const OWON_TRIGGER_st *trigger = search->trigger;
+	int32_t over_low = at_or_over(search, trigger->low);
+	int32_t over_high = at_or_over(search, trigger->high);
+	int32_t over_armed = over(search, trigger->high + trigger->hysteresis);
+	int32_t under_low = under(search, trigger->low);
+	int32_t under_high = under(search, trigger->high);
+	int32_t under_armed = under(search, trigger->low - trigger->hysteresis);
+	enum runt_state state = RUNT_MIDDLE;
+	size_t i = 0, start = 0;
+	int32_t value;
+
+	while (search->found < search->max_events) {
+		switch (state) {
+		case RUNT_MIDDLE:
+			i = scan(search, i, over_armed, under_armed);
+			break;
+		case RUNT_LOW:
+			i = scan(search, i, over_low, SCAN_NEVER_BELOW);
+			break;
+		case RUNT_UP:
+			i = scan(search, i, over_high, under_armed);
+			break;
+		case RUNT_HIGH:
+			i = scan(search, i, SCAN_NEVER_ABOVE, under_high);
+			break;
+		case RUNT_DOWN:
+			i = scan(search, i, over_armed, under_low);
+			break;
+		}
+		if (i >= search->count)
+			break;
+		value = sample_at(search, i);
+
+		switch (state) {
+		case RUNT_MIDDLE:
+			state = value > over_armed ? RUNT_HIGH : RUNT_LOW;
+			break;
+		case RUNT_LOW:
+			state = RUNT_UP;
+			start = i;
+			break;
+		case RUNT_UP:
+			if (value > over_high) {
+				state = RUNT_MIDDLE;
+			} else {
+				found(search, OWON_TRIGGER_RISING, start, i - start);
+				state = RUNT_LOW;
+			}
+			break;
+		case RUNT_HIGH:
+			state = RUNT_DOWN;
+			start = i;
+			break;
+		case RUNT_DOWN:
+			if (value < under_low) {
+				state = RUNT_MIDDLE;
+			} else {
+				found(search, OWON_TRIGGER_FALLING, start, i - start);
+				state = RUNT_HIGH;
+			}
+			break;
+		}
+	}
+}
+
+// Windows: an event when the signal leaves [low, high], the next one once
+// it is back hysteresis inside
+static void search_window(SEARCH_st *search)
+{
+	const OWON_TRIGGER_st *trigger = search->trigger;
+	int32_t over_high = over(search, trigger->high);
+	int32_t under_low = under(search, trigger->low);
+	int32_t back_from_high = under(search, trigger->high - trigger->hysteresis);
+	int32_t back_from_low = over(search, trigger->low + trigger->hysteresis);
+	OWON_TRIGGER_EVENT_st *pending = NULL;
+	size_t i = 0, start = 0;
+	int32_t value;
+	int state;     // 1 over, -1 under, 0 inside
+
+	if (search->count == 0)
+		return;
+	value = sample_at(search, 0);
+	state = value > over_high ? 1 : value < under_low ? -1 : 0;
+
+	// The length of the last event is only known once back inside
+	while (search->found < search->max_events || pending != NULL) {
+		if (state > 0)
+			i = scan(search, i, SCAN_NEVER_ABOVE, back_from_high);
+		else if (state < 0)
+			i = scan(search, i, back_from_low, SCAN_NEVER_BELOW);
+		else
+			i = scan(search, i, over_high, under_low);
+		if (i >= search->count)
+			break;
+
+		if (state != 0) {
+			if (pending != NULL)
+				pending->length = i - start;
+			pending = NULL;
+			state = 0;
+		} else {
+			state = sample_at(search, i) > over_high ? 1 : -1;
+			start = i;
+			pending = found(search, state > 0 ? OWON_TRIGGER_RISING : OWON_TRIGGER_FALLING, i, 0);
+		}
+	}
+	if (pending != NULL)
+		pending->length = search->count - start;
+}
+
+long owon_trigger_search(const OWON_TRIGGER_st *trigger, const CHANNEL_st *channel, int index,
+			 OWON_TRIGGER_EVENT_st *events, size_t max)
+{
+	SEARCH_st search;
+
+	memset(&search, 0, sizeof(SEARCH_st));
+	search.trigger = trigger;
+	search.channel = channel;
+	search.index = index;
+	search.samples = channel->samples;
+	search.count = channel->samples_file;
+	search.wide = channel->datatype == 2;
+	search.min = search.wide ? INT16_MIN : INT8_MIN;
+	search.max = search.wide ? INT16_MAX : INT8_MAX;
+	search.scale = owon_channel_volts_per_count(channel);
+	search.events = events;
+	search.max_events = max;
+
+	if (search.count > 0 && (search.samples == NULL || search.scale <= 0))
+		return OWON_ERROR;
+	if (max == 0 || search.count == 0)
+		return 0;
+
+	pthread_once(&kernels_once, select_kernels);
+	switch (trigger->type) {
+	case OWON_TRIGGER_EDGE:
+	case OWON_TRIGGER_PULSE:
+		search_levels(&search);
+		break;
+	case OWON_TRIGGER_RUNT:
+		search_runts(&search);
+		break;
+	case OWON_TRIGGER_WINDOW:
+		search_window(&search);
+		break;
+	default:
+		return OWON_ERROR;
+	}
+	return search.found;
+}
+
+long owon_trigger_search_header(const OWON_TRIGGER_st *trigger, const HEADER_st *header,
+				OWON_TRIGGER_EVENT_st *events, size_t max)
+{
+	size_t channel, found = 0;
+	long ret;
+
+	for (channel = 0; channel < header->channels_count && found < max; channel++) {
+		if (trigger->channel >= 0 && (size_t) trigger->channel != channel)
+			continue;
+		ret = owon_trigger_search(trigger, header->channels[channel], channel,
+					  events + found, max - found);
+		if (ret < 0)
+			return ret;
+		found += ret;
+	}
+	return found;
+}
+
+// Spec parsing
+
+static const char *type_names[OWON_TRIGGER_TYPE_COUNT] = {
+	"edge", "pulse", "runt", "window"
+};
+
+static const char *slope_names[] = { "", "rising", "falling", "both" };
+
+const char *owon_trigger_slope_name(int slope)
+{
+	return slope >= OWON_TRIGGER_RISING && slope <= OWON_TRIGGER_BOTH ? slope_names[slope] : "";
+}
+
+static int parse_double(const char *text, double *value)
+{
+	char *end;
+
+	*value = strtod(text, &end);
+	return end != text && *end == 0 && isfinite(*value) ? 0 : OWON_ERROR;
+}
+
+int owon_trigger_parse(const char *spec, OWON_TRIGGER_st *trigger)
+{
+	char copy[TRIGGER_SPEC_MAX], *token, *value, *save, *end;
+	int has_level = 0, has_low = 0, has_high = 0, has_width = 0, i;
+	long channel;
+
+	memset(trigger, 0, sizeof(OWON_TRIGGER_st));
+	trigger->channel = -1;
+	if (strlen(spec) >= sizeof(copy))
+		return OWON_ERROR;
+	strcpy(copy, spec);
+
+	token = strtok_r(copy, ",", &save);
+	if (token == NULL)
+		return OWON_ERROR;
+	for (i = 0; i < OWON_TRIGGER_TYPE_COUNT && strcmp(token, type_names[i]) != 0; i++)
+		;
+	if (i == OWON_TRIGGER_TYPE_COUNT)
+		return OWON_ERROR;
+	trigger->type = i;
+
+	while ((token = strtok_r(NULL, ",", &save)) != NULL) {
+		value = strchr(token, '=');
+		if (value == NULL)
+			return OWON_ERROR;
+		*value++ = 0;
+
+		if (strcmp(token, "ch") == 0) {
+			if (strcmp(value, "all") == 0)
+				continue;
+			channel = strtol(value, &end, 10);
+			if (end == value || *end != 0 || channel < 1 || channel > 64)
+				return OWON_ERROR;
+			trigger->channel = channel - 1;
+		} else if (strcmp(token, "slope") == 0) {
+			for (i = OWON_TRIGGER_RISING; i <= OWON_TRIGGER_BOTH && strcmp(value, slope_names[i]) != 0; i++)
+				;
+			if (i > OWON_TRIGGER_BOTH)
+				return OWON_ERROR;
+			trigger->slope = i;
+		} else if (strcmp(token, "level") == 0) {
+			if (parse_double(value, &trigger->level) != 0)
+				return OWON_ERROR;
+			has_level = 1;
+		} else if (strcmp(token, "low") == 0) {
+			if (parse_double(value, &trigger->low) != 0)
+				return OWON_ERROR;
+			has_low = 1;
+		} else if (strcmp(token, "high") == 0) {
+			if (parse_double(value, &trigger->high) != 0)
+				return OWON_ERROR;
+			has_high = 1;
+		} else if (strcmp(token, "hyst") == 0) {
+			if (parse_double(value, &trigger->hysteresis) != 0 || trigger->hysteresis < 0)
+				return OWON_ERROR;
+		} else if (strcmp(token, "width") == 0) {
+			if (*value == '<' || *value == '>')
+				trigger->longer = *value++ == '>';
+			if (parse_double(value, &trigger->width) != 0 || trigger->width <= 0)
+				return OWON_ERROR;
+			has_width = 1;
+		} else {
+			return OWON_ERROR;
+		}
+	}
+
+	if (trigger->slope == 0)
+		trigger->slope = trigger->type == OWON_TRIGGER_EDGE ? OWON_TRIGGER_RISING : OWON_TRIGGER_BOTH;
+	switch (trigger->type) {
+	case OWON_TRIGGER_PULSE:
+		if (!has_width)
+			return OWON_ERROR;
+		// fall through
+	case OWON_TRIGGER_EDGE:
+		return has_level ? OWON_SUCCESS : OWON_ERROR;
+	default:
+		return has_low && has_high && trigger->low < trigger->high ? OWON_SUCCESS : OWON_ERROR;
+	}
+}
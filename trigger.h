@@ -0,0 +1,87 @@
+/*
+ * trigger - software trigger, events searched in the channel samples
+ * Copyright (c) 2014 Jonathan Bisson <bjonnh-owon@bjonnh.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef _TRIGGER_H_
+#define _TRIGGER_H_
+
+#include <stddef.h>
+#include "parse.h"
+
+// Every condition is a small state machine whose states each wait for the
+// first sample over or under a threshold. That wait is the only loop over
+// the samples: it compares them at their native width, 16 or 32 at a time
+// with SSE2 or AVX2, and finds the one in the comparison bitmask, so the
+// search goes at memory speed between the events.
+//
+// Hysteresis: the signal is high from the sample at or over the upper
+// threshold and low from the sample under the lower one. A single slope
+// fires on the level and re-arms hysteresis away from it, both slopes use
+// level +/- hysteresis/2.
+
+enum owon_trigger_type {
+	OWON_TRIGGER_EDGE = 0,   // crossings of level
+	OWON_TRIGGER_PULSE,      // high (rising) or low (falling) for shorter or longer than width
+	OWON_TRIGGER_RUNT,       // crosses low without reaching high, or the other way
+	OWON_TRIGGER_WINDOW,     // goes over high (rising) or under low (falling)
+	OWON_TRIGGER_TYPE_COUNT
+};
+
+// Slopes, for pulses and runts the first edge: rising for positive ones
+#define OWON_TRIGGER_RISING 1
+#define OWON_TRIGGER_FALLING 2
+#define OWON_TRIGGER_BOTH 3
+
+typedef struct {
+	int type;
+	int channel;             // index in the header, -1 for every channel
+	int slope;
+	double level;            // volts, edges and pulses
+	double low;              // volts, runts and windows
+	double high;
+	double hysteresis;       // volts
+	double width;            // seconds, pulses
+	int longer;              // pulses longer than width instead of shorter
+} OWON_TRIGGER_st;
+
+typedef struct {
+	int channel;
+	int slope;               // OWON_TRIGGER_RISING or OWON_TRIGGER_FALLING
+	size_t sample;           // the edge, the start of a pulse or runt, the exit of the window
+	size_t length;           // samples, of a pulse, runt or stay out of the window
+	double time;             // seconds from the first sample
+} OWON_TRIGGER_EVENT_st;
+
+// "edge,level=1.5,slope=falling", "pulse,level=0.8,width=<1e-6,ch=2",
+// "runt,low=0.5,high=2.5,hyst=0.05", "window,low=-1,high=1".
+// Keys: ch (1 to 4, default all), slope (rising, falling or both, default
+// rising for edges and both otherwise), level, low, high, hyst and width
+// ("<" shorter, the default, or ">" longer).
+int owon_trigger_parse(const char *spec, OWON_TRIGGER_st *trigger);
+
+// Stores up to max events of channel in order, returns how many
+long owon_trigger_search(const OWON_TRIGGER_st *trigger, const CHANNEL_st *channel, int index,
+			 OWON_TRIGGER_EVENT_st *events, size_t max);
+// The channels trigger is about one after the other
+long owon_trigger_search_header(const OWON_TRIGGER_st *trigger, const HEADER_st *header,
+				OWON_TRIGGER_EVENT_st *events, size_t max);
+
+const char *owon_trigger_slope_name(int slope);
+// Name of the selected threshold scan ("scalar", "sse2" or "avx2")
+const char *owon_trigger_implementation(void);
+
+#endif
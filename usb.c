@@ -26,6 +26,9 @@
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #include "usb.h"
 #include "owon.h"
@@ -48,97 +51,336 @@ struct owon_start_response {
 
 struct libusb_context *ctx = NULL;
 
+static void cache_start(void);
+static void cache_stop(void);
+
+// Shared event thread, see owon_usb_start_events
+static pthread_t event_thread;
+static int events_running = 0;
+static int events_stop = 0;
+
 void owon_usb_init() {
+	if (NULL != ctx)
+		return;
 	libusb_init(&ctx);
 	libusb_set_debug(ctx, USB_DEBUG);
+	cache_start();
 }
 
-size_t owon_usb_get_device_count() {
-	size_t count = 0;
+// Returns 1 if the device is managed, from its descriptor only: no device
+// is opened, so unrelated devices on the bus are left alone
+// TODO: Add other Product_ID (testers needed)
+int owon_usb_is_managed(void *device) {
+	struct libusb_device_descriptor desc;
 
-	struct libusb_device **list;
-        struct libusb_device *found = NULL;
-	ssize_t cnt = libusb_get_device_list(NULL, &list);
-	ssize_t i = 0;
-	int err = 0;
-	if (cnt < 0)
-		fprintf(stderr,"Error getting the device count\n");
+	if (libusb_get_device_descriptor(device, &desc) < 0)
 		return -1;
-
-	for (i = 0; i < cnt; i++) {
-		struct libusb_device *device = list[i];
-		err = owon_usb_is_managed(device);
-		if (err>0)
-			count++;
-		if (err<0) {
-			fprint(stderr,"Failed to list devices CODE=%d\n",err);
-			libusb_free_device_list(list, 1);
-			return -1;
-		}
-		
-	}
-	libusb_free_device_list(list, 1);
-	return count;
+	return desc.idVendor == OWON_USB_VENDOR_ID && desc.idProduct == OWON_USB_PRODUCT_ID;
 }
 
-
-// Returns 1 if the device is managed
-// TODO: Add other Product_ID (testers needed)
-int owon_usb_is_managed(void *device) {
+// Reads the iSerialNumber string of an opened device, falls back to the
+// bus and address when the device has none
+int owon_usb_get_serial(struct libusb_device_handle *dev_handle, char *serial, size_t len)
+{
+	struct libusb_device *device = libusb_get_device(dev_handle);
 	struct libusb_device_descriptor desc;
-	struct libusb_device_handle *handle = NULL;
-	
-	int ret=0,err=0;
+	int ret;
 
 	ret = libusb_get_device_descriptor(device, &desc);
-	if (ret < 0) 
-		return -1;
-	err = libusb_open(device,&handle);
-	if (err < 0) {
-		libusb_close(handle);
-		return -2;
+	if (ret < 0)
+		return OWON_ERROR_USB;
+	ret = -1;
+	if (desc.iSerialNumber != 0)
+		ret = libusb_get_string_descriptor_ascii(dev_handle, desc.iSerialNumber,
+							 (unsigned char *) serial, len);
+	if (ret <= 0)
+		snprintf(serial, len, "%d-%d", libusb_get_bus_number(device),
+			 libusb_get_device_address(device));
+	return OWON_SUCCESS;
+}
+
+// Device table
+// The managed devices are kept sorted by bus and address, each one with a
+// reference. When libusb supports hotplug the table is filled once at
+// registration and then kept current by the callbacks, which run wherever
+// the events are handled; otherwise it is rebuilt from the descriptors at
+// each lookup. Serial numbers are read the first time they are needed.
+
+struct owon_usb_entry {
+	struct libusb_device *device;
+	uint8_t bus;
+	uint8_t address;
+	char serial[OWON_USB_SERIAL_LENGTH]; // empty until read
+};
+
+static struct {
+	struct owon_usb_entry *entries;
+	int count;
+	int size;
+	int hotplug;
+	libusb_hotplug_callback_handle callback;
+	pthread_mutex_t lock;
+} cache = { NULL, 0, 0, 0, 0, PTHREAD_MUTEX_INITIALIZER };
+
+// Called with the cache locked
+static int cache_add(struct libusb_device *device)
+{
+	struct owon_usb_entry *entries;
+	uint8_t bus = libusb_get_bus_number(device);
+	uint8_t address = libusb_get_device_address(device);
+	int i;
+
+	for (i = 0; i < cache.count; i++)
+		if (cache.entries[i].device == device)
+			return OWON_SUCCESS;
+
+	if (cache.count == cache.size) {
+		entries = realloc(cache.entries, (cache.size + 8) * sizeof(struct owon_usb_entry));
+		if (NULL == entries)
+			return OWON_ERROR_MEMORY;
+		cache.entries = entries;
+		cache.size += 8;
 	}
-	if (desc.idVendor == OWON_USB_VENDOR_ID && desc.idProduct == OWON_USB_PRODUCT_ID) {
-		libusb_close(handle);
-		return 1;
+
+	for (i = cache.count; i > 0; i--) {
+		struct owon_usb_entry *previous = &cache.entries[i - 1];
+		if (previous->bus < bus || (previous->bus == bus && previous->address < address))
+			break;
+		cache.entries[i] = *previous;
 	}
-	libusb_close(handle);
-	return 0;
+	cache.entries[i].device = libusb_ref_device(device);
+	cache.entries[i].bus = bus;
+	cache.entries[i].address = address;
+	cache.entries[i].serial[0] = 0;
+	cache.count++;
+	return OWON_SUCCESS;
 }
 
-struct libusb_device_handle *owon_usb_get_device(int dnum) {
-	size_t count = 0;
+// Called with the cache locked
+static void cache_remove(struct libusb_device *device)
+{
+	int i;
+
+	for (i = 0; i < cache.count; i++)
+		if (cache.entries[i].device == device)
+			break;
+	if (i == cache.count)
+		return;
+	libusb_unref_device(device);
+	memmove(&cache.entries[i], &cache.entries[i + 1],
+		(cache.count - i - 1) * sizeof(struct owon_usb_entry));
+	cache.count--;
+}
+
+// Called with the cache locked
+static void cache_clear(void)
+{
+	int i;
+
+	for (i = 0; i < cache.count; i++)
+		libusb_unref_device(cache.entries[i].device);
+	cache.count = 0;
+}
+
+static int LIBUSB_CALL owon_usb_hotplug(struct libusb_context *context, struct libusb_device *device,
+					libusb_hotplug_event event, void *user_data)
+{
+	pthread_mutex_lock(&cache.lock);
+	if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED)
+		cache_add(device);
+	else if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT)
+		cache_remove(device);
+	pthread_mutex_unlock(&cache.lock);
+	return 0;
+}
 
+// Rebuilds the table from the bus when hotplug isn't available
+static int cache_refresh(void)
+{
 	struct libusb_device **list;
-        struct libusb_device *found = NULL;
-	struct libusb_device_handle *dev_handle = NULL;
-	ssize_t cnt = libusb_get_device_list(NULL, &list);
-	ssize_t i = 0;
-	int err = 0;
+	ssize_t cnt, i;
+	int ret = OWON_SUCCESS;
+
+	if (cache.hotplug)
+		return OWON_SUCCESS;
+
+	cnt = libusb_get_device_list(ctx, &list);
 	if (cnt < 0) {
-		fprintf(stderr,"Error getting the device count\n");
-		return 0;
-	}
-	
-	for (i = 0; i < cnt; i++) {
-		struct libusb_device *device = list[i];
-		if (owon_usb_is_managed(device)) // TODO: Manage multiple oscilloscopes on the same computer
-			found = device;
+		fprintf(stderr,"Error getting the device list\n");
+		return OWON_ERROR_USB;
 	}
+
+	pthread_mutex_lock(&cache.lock);
+	cache_clear();
+	for (i = 0; i < cnt && ret == OWON_SUCCESS; i++)
+		if (owon_usb_is_managed(list[i]) > 0)
+			ret = cache_add(list[i]);
+	pthread_mutex_unlock(&cache.lock);
+
 	libusb_free_device_list(list, 1);
-	
-	if (NULL != found) {
-		err = libusb_open(found,&dev_handle);
-		if (err != 0) {
-			return NULL;
+	return ret;
+}
+
+static void cache_start(void)
+{
+	int ret;
+
+	if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+		ret = libusb_hotplug_register_callback(ctx,
+			LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+			LIBUSB_HOTPLUG_ENUMERATE, OWON_USB_VENDOR_ID, OWON_USB_PRODUCT_ID,
+			LIBUSB_HOTPLUG_MATCH_ANY, owon_usb_hotplug, NULL, &cache.callback);
+		if (ret == LIBUSB_SUCCESS) {
+			cache.hotplug = 1;
+			return;
+		}
+		fprintf(stderr,"Hotplug registration failed ret=%d, scanning the bus instead\n",ret);
+	}
+	cache_refresh();
+}
+
+static void cache_stop(void)
+{
+	if (cache.hotplug)
+		libusb_hotplug_deregister_callback(ctx, cache.callback);
+	cache.hotplug = 0;
+
+	pthread_mutex_lock(&cache.lock);
+	cache_clear();
+	free(cache.entries);
+	cache.entries = NULL;
+	cache.size = 0;
+	pthread_mutex_unlock(&cache.lock);
+}
+
+// Gives the entry index with a reference on its device, and its serial
+// number when serial isn't NULL. The device is only opened, outside of the
+// lock, the first time its serial is asked for.
+static struct libusb_device *cache_entry(int index, char *serial, size_t len)
+{
+	struct libusb_device *device = NULL;
+	struct libusb_device_handle *dev_handle;
+	char read[OWON_USB_SERIAL_LENGTH];
+	int i;
+
+	pthread_mutex_lock(&cache.lock);
+	if (index >= 0 && index < cache.count) {
+		device = libusb_ref_device(cache.entries[index].device);
+		strcpy(read, cache.entries[index].serial);
+	}
+	pthread_mutex_unlock(&cache.lock);
+
+	if (NULL == device || NULL == serial)
+		return device;
+
+	if (read[0] == 0) {
+		if (libusb_open(device, &dev_handle) == 0) {
+			owon_usb_get_serial(dev_handle, read, sizeof(read));
+			libusb_close(dev_handle);
+		} else {
+			snprintf(read, sizeof(read), "%d-%d", libusb_get_bus_number(device),
+				 libusb_get_device_address(device));
+		}
+		pthread_mutex_lock(&cache.lock);
+		for (i = 0; i < cache.count; i++)
+			if (cache.entries[i].device == device)
+				strcpy(cache.entries[i].serial, read);
+		pthread_mutex_unlock(&cache.lock);
+	}
+	snprintf(serial, len, "%s", read);
+	return device;
+}
+
+size_t owon_usb_get_device_count() {
+	size_t count;
+
+	if (cache_refresh() != OWON_SUCCESS)
+		return -1;
+	pthread_mutex_lock(&cache.lock);
+	count = cache.count;
+	pthread_mutex_unlock(&cache.lock);
+	return count;
+}
+
+// Finds the device number dnum among the managed ones, in bus order, or the
+// one whose serial matches when serial isn't NULL.
+// The returned device holds a reference, released with libusb_unref_device.
+static struct libusb_device *owon_usb_find(int dnum, const char *serial)
+{
+	struct libusb_device *device;
+	char device_serial[OWON_USB_SERIAL_LENGTH];
+	int i;
+
+	if (cache_refresh() != OWON_SUCCESS)
+		return NULL;
+	if (NULL == serial)
+		return cache_entry(dnum, NULL, 0);
+
+	for (i = 0; (device = cache_entry(i, device_serial, sizeof(device_serial))) != NULL; i++) {
+		if (strcmp(device_serial, serial) == 0)
+			return device;
+		libusb_unref_device(device);
+	}
+	return NULL;
+}
+
+// Fills devices with the managed devices, returns their count or an error.
+// The array is allocated and must be freed by the caller.
+int owon_usb_list_devices(OWON_USB_DEVICE_st **devices)
+{
+	struct libusb_device *device;
+	OWON_USB_DEVICE_st *result = NULL, *grown;
+	int count = 0, ret;
+
+	ret = cache_refresh();
+	if (ret != OWON_SUCCESS)
+		return ret;
+
+	for (;;) {
+		grown = realloc(result, (count + 1) * sizeof(OWON_USB_DEVICE_st));
+		if (NULL == grown) {
+			free(result);
+			return OWON_ERROR_MEMORY;
 		}
-	} else {
+		result = grown;
+		device = cache_entry(count, result[count].serial, sizeof(result[count].serial));
+		if (NULL == device)
+			break;
+		result[count].index = count;
+		result[count].bus = libusb_get_bus_number(device);
+		result[count].address = libusb_get_device_address(device);
+		libusb_unref_device(device);
+		count++;
+	}
+	*devices = result;
+	return count;
+}
+
+static struct libusb_device_handle *owon_usb_open_device(struct libusb_device *found)
+{
+	struct libusb_device_handle *dev_handle = NULL;
+	int err;
+
+	if (NULL == found) {
 		fprintf(stderr, "Device not found\n");
 		return NULL;
 	}
+	err = libusb_open(found,&dev_handle);
+	libusb_unref_device(found);
+	if (err != 0)
+		return NULL;
 	return dev_handle;
 }
 
+// dnum is the index of the device among the managed ones, in bus order
+struct libusb_device_handle *owon_usb_get_device(int dnum) {
+	return owon_usb_open_device(owon_usb_find(dnum, NULL));
+}
+
+struct libusb_device_handle *owon_usb_get_device_serial(const char *serial) {
+	return owon_usb_open_device(owon_usb_find(0, serial));
+}
+
 struct libusb_device_handle *owon_usb_open(struct libusb_device_handle *dev_handle) {
 	int ret=0;
 	int cfg;
@@ -169,6 +411,53 @@ struct libusb_device_handle *owon_usb_easy_open(int dnum) {
 	return dev_handle;
 }
 
+struct libusb_device_handle *owon_usb_easy_open_serial(const char *serial) {
+	owon_usb_init();
+	
+	struct libusb_device_handle *dev_handle = owon_usb_get_device_serial(serial);
+       
+	if (NULL == dev_handle) {
+		fprintf(stderr, "Unable to open device %s\n", serial);
+		return NULL;
+	}
+	dev_handle = owon_usb_open(dev_handle);
+
+	return dev_handle;
+}
+
+// Several devices downloading at once share one thread running the libusb
+// event loop; the readers then only wait for their own transfers.
+static void *owon_usb_event_loop(void *arg)
+{
+	struct timeval tv = { 0, 100000 };
+
+	while (!events_stop)
+		libusb_handle_events_timeout_completed(ctx, &tv, &events_stop);
+	return NULL;
+}
+
+int owon_usb_start_events(void)
+{
+	if (events_running)
+		return OWON_SUCCESS;
+	events_stop = 0;
+	if (pthread_create(&event_thread, NULL, owon_usb_event_loop, NULL) != 0) {
+		fprintf(stderr,"Can't start the USB event thread\n");
+		return OWON_ERROR;
+	}
+	events_running = 1;
+	return OWON_SUCCESS;
+}
+
+void owon_usb_stop_events(void)
+{
+	if (!events_running)
+		return;
+	events_stop = 1;
+	pthread_join(event_thread, NULL);
+	events_running = 0;
+}
+
 int owon_get_response(struct owon_start_command *cmd, struct libusb_device_handle *dev_handle, struct owon_start_response *start_response)
 {
 	int ret=-255;
@@ -197,17 +486,302 @@ int owon_get_response(struct owon_start_command *cmd, struct libusb_device_handl
 	return 0;
 }
 
-int owon_usb_read(struct libusb_device_handle *dev_handle, unsigned char **buffer,
-		  enum owon_start_command_type type) {
+// Asynchronous bulk-IN download.
+// A ring of OWON_USB_ASYNC_TRANSFERS transfers is kept in flight, each one
+// reading directly at its place in the destination buffer, so the pipe never
+// idles waiting for the next request. Completions arrive in submission order;
+// if one ends short, the following ones are moved down when they complete and
+// no new transfer is submitted until the ring has drained.
+// The callbacks run either in the reading thread, which then handles the
+// events itself, or in the shared event thread; the ring is locked for both.
+
+struct owon_usb_ring;
+
+struct owon_usb_slot {
+	struct libusb_transfer *transfer;
+	struct owon_usb_ring *ring;
+	int busy;
+};
+
+struct owon_usb_ring {
+	unsigned char *buffer;
+	uint32_t length;    // bytes expected
+	uint32_t submitted; // bytes covered by submitted transfers
+	uint32_t completed; // bytes received and in place
+	int in_flight;
+	int draining;
+	int error;
+	pthread_mutex_t lock;
+	pthread_cond_t done;
+	struct owon_usb_slot slots[OWON_USB_ASYNC_TRANSFERS];
+};
+
+static void LIBUSB_CALL owon_usb_ring_callback(struct libusb_transfer *transfer)
+{
+	struct owon_usb_slot *slot = transfer->user_data;
+	struct owon_usb_ring *ring = slot->ring;
+	unsigned char *destination;
+
+	pthread_mutex_lock(&ring->lock);
+	destination = ring->buffer + ring->completed;
+	slot->busy = 0;
+	ring->in_flight--;
+
+	if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+		if (transfer->status != LIBUSB_TRANSFER_CANCELLED) {
+			fprintf(stderr,"Transfer error status=%d\n",transfer->status);
+			ring->error = OWON_ERROR_USB;
+		}
+	} else if (!ring->error) {
+		if (transfer->buffer != destination)
+			memmove(destination, transfer->buffer, transfer->actual_length);
+		ring->completed += transfer->actual_length;
+		if (transfer->actual_length < transfer->length) {
+			ring->submitted -= transfer->length - transfer->actual_length;
+			ring->draining = 1;
+		}
+	}
+
+	if (ring->in_flight == 0)
+		ring->draining = 0;
+	pthread_cond_signal(&ring->done);
+	pthread_mutex_unlock(&ring->lock);
+}
+
+static double owon_usb_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1.0e9;
+}
+
+// Read length bytes from the IN endpoint into buffer.
+// Returns the number of bytes read or a negative error, elapsed is set to the
+// transfer time in seconds.
+// The transfers come from the capture buffer, they are reused from one
+// read to the next.
+// The bytes in place are fed to stream, when there is one, by the reading
+// thread while the next transfers are in flight: the parse ends right after
+// the last transfer.
+static int owon_usb_bulk_read(struct libusb_device_handle *dev_handle, struct libusb_transfer **transfers,
+			      unsigned char *buffer, uint32_t length, OWON_STREAM_st *stream, double *elapsed)
+{
+	struct owon_usb_ring ring;
+	struct timeval tv = { 1, 0 };
+	uint32_t fed = 0, completed;
+	double start;
+	int i, ret, cancelled = 0;
+
+	memset(&ring, 0, sizeof(ring));
+	ring.buffer = buffer;
+	ring.length = length;
+	pthread_mutex_init(&ring.lock, NULL);
+	pthread_cond_init(&ring.done, NULL);
+
+	for (i = 0; i < OWON_USB_ASYNC_TRANSFERS; i++) {
+		ring.slots[i].ring = &ring;
+		ring.slots[i].transfer = transfers[i];
+	}
+
+	start = owon_usb_now();
+	pthread_mutex_lock(&ring.lock);
+	while (ring.in_flight > 0 || (!ring.error && ring.completed < ring.length)) {
+		// Keep the ring full
+		for (i = 0; i < OWON_USB_ASYNC_TRANSFERS && !ring.error && !ring.draining; i++) {
+			struct owon_usb_slot *slot = &ring.slots[i];
+			uint32_t size = ring.length - ring.submitted;
+
+			if (size == 0)
+				break;
+			if (slot->busy)
+				continue;
+			if (size > OWON_USB_ASYNC_TRANSFER_SIZE)
+				size = OWON_USB_ASYNC_TRANSFER_SIZE;
+
+			libusb_fill_bulk_transfer(slot->transfer, dev_handle, OWON_USB_ENDPOINT_IN,
+						  buffer + ring.submitted, size,
+						  owon_usb_ring_callback, slot, OWON_USB_ASYNC_TIMEOUT);
+			ret = libusb_submit_transfer(slot->transfer);
+			if (ret < 0) {
+				fprintf(stderr,"Submit error ret=%d\n",ret);
+				ring.error = OWON_ERROR_USB;
+				break;
+			}
+			slot->busy = 1;
+			ring.in_flight++;
+			ring.submitted += size;
+		}
+
+		// Nothing moves below completed, the callbacks only write after it
+		if (stream != NULL && !ring.error && ring.completed > fed) {
+			completed = ring.completed;
+			pthread_mutex_unlock(&ring.lock);
+			owon_stream_feed(stream, buffer + fed, completed - fed);
+			pthread_mutex_lock(&ring.lock);
+			fed = completed;
+			continue;
+		}
+
+		if (ring.in_flight == 0)
+			continue;
+
+		if (ring.error && !cancelled) {
+			for (i = 0; i < OWON_USB_ASYNC_TRANSFERS; i++)
+				if (ring.slots[i].busy)
+					libusb_cancel_transfer(ring.slots[i].transfer);
+			cancelled = 1;
+		}
+
+		if (events_running) {
+			struct timespec deadline;
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_sec += tv.tv_sec;
+			pthread_cond_timedwait(&ring.done, &ring.lock, &deadline);
+			continue;
+		}
+
+		pthread_mutex_unlock(&ring.lock);
+		ret = libusb_handle_events_timeout_completed(ctx, &tv, NULL);
+		pthread_mutex_lock(&ring.lock);
+		if (ret < 0 && ret != LIBUSB_ERROR_INTERRUPTED) {
+			fprintf(stderr,"Event handling error ret=%d\n",ret);
+			ring.error = OWON_ERROR_USB;
+		}
+	}
+	pthread_mutex_unlock(&ring.lock);
+	if (stream != NULL && !ring.error && ring.completed > fed)
+		owon_stream_feed(stream, buffer + fed, ring.completed - fed);
+	*elapsed = owon_usb_now() - start;
+
+	pthread_cond_destroy(&ring.done);
+	pthread_mutex_destroy(&ring.lock);
+
+	if (ring.error)
+		return ring.error;
+	return ring.completed;
+}
+
+// Capture buffers
+// Every part of a multipart capture lands in its own segment. Segments and
+// transfers stay allocated from one capture to the next and only grow,
+// doubling, so a buffer reused for captures of the same size allocates
+// nothing after the first one.
+
+void owon_usb_buffer_init(OWON_USB_BUFFER_st *buffer)
+{
+	memset(buffer, 0, sizeof(OWON_USB_BUFFER_st));
+}
+
+void owon_usb_buffer_free(OWON_USB_BUFFER_st *buffer)
+{
+	size_t i;
+
+	for (i = 0; i < buffer->size; i++)
+		free(buffer->segments[i].data);
+	free(buffer->segments);
+	free(buffer->flat);
+	for (i = 0; i < OWON_USB_ASYNC_TRANSFERS; i++)
+		if (NULL != buffer->transfers[i])
+			libusb_free_transfer(buffer->transfers[i]);
+	memset(buffer, 0, sizeof(OWON_USB_BUFFER_st));
+}
+
+static size_t owon_usb_grow(size_t capacity, size_t length)
+{
+	if (capacity == 0)
+		capacity = OWON_USB_ASYNC_TRANSFER_SIZE;
+	while (capacity < length)
+		capacity *= 2;
+	return capacity;
+}
+
+// Makes the segment index ready to receive length bytes
+static OWON_USB_SEGMENT_st *owon_usb_segment(OWON_USB_BUFFER_st *buffer, size_t index, uint32_t length)
+{
+	OWON_USB_SEGMENT_st *segment;
+	size_t capacity;
+
+	if (index >= buffer->size) {
+		size_t size = buffer->size ? 2 * buffer->size : 4;
+		segment = realloc(buffer->segments, size * sizeof(OWON_USB_SEGMENT_st));
+		if (NULL == segment)
+			return NULL;
+		memset(segment + buffer->size, 0, (size - buffer->size) * sizeof(OWON_USB_SEGMENT_st));
+		buffer->segments = segment;
+		buffer->size = size;
+	}
+
+	segment = &buffer->segments[index];
+	if (segment->capacity < length) {
+		// Nothing to keep, no need for realloc to copy it
+		capacity = owon_usb_grow(segment->capacity, length);
+		free(segment->data);
+		segment->data = malloc(capacity);
+		segment->capacity = NULL == segment->data ? 0 : capacity;
+		if (NULL == segment->data)
+			return NULL;
+	}
+	segment->length = 0;
+	return segment;
+}
+
+static int owon_usb_transfers(OWON_USB_BUFFER_st *buffer)
+{
+	int i;
+
+	for (i = 0; i < OWON_USB_ASYNC_TRANSFERS; i++) {
+		if (NULL != buffer->transfers[i])
+			continue;
+		buffer->transfers[i] = libusb_alloc_transfer(0);
+		if (NULL == buffer->transfers[i]) {
+			fprintf(stderr,"Error allocating transfer %d\n",i);
+			return OWON_ERROR_MEMORY;
+		}
+	}
+	return OWON_SUCCESS;
+}
+
+const unsigned char *owon_usb_buffer_data(OWON_USB_BUFFER_st *buffer)
+{
+	size_t i, capacity, position = 0;
+
+	if (buffer->count == 0)
+		return NULL;
+	if (buffer->count == 1)
+		return buffer->segments[0].data;
+
+	if (buffer->flat_capacity < buffer->length) {
+		capacity = owon_usb_grow(buffer->flat_capacity, buffer->length);
+		free(buffer->flat);
+		buffer->flat = malloc(capacity);
+		buffer->flat_capacity = NULL == buffer->flat ? 0 : capacity;
+		if (NULL == buffer->flat)
+			return NULL;
+	}
+	for (i = 0; i < buffer->count; i++) {
+		memcpy(buffer->flat + position, buffer->segments[i].data, buffer->segments[i].length);
+		position += buffer->segments[i].length;
+	}
+	return buffer->flat;
+}
+
+long owon_usb_read_into(struct libusb_device_handle *dev_handle, OWON_USB_BUFFER_st *buffer,
+			enum owon_start_command_type type) {
 	struct owon_start_command *cmd;
 	struct owon_start_response start_response;
+	OWON_USB_SEGMENT_st *segment;
 	int multipart = 0;
-	uint32_t allocated = 0, downloaded = 0;
+	size_t expected = 0;
 	uint32_t transferred = 0;
+	double elapsed, total_time = 0;
 	if (type >= DUMP_COUNT)
 		return -1;
 
 	cmd = &commands[type];
+	buffer->count = 0;
+	buffer->length = 0;
+	if (owon_usb_transfers(buffer) != OWON_SUCCESS)
+		return OWON_ERROR_MEMORY;
 
 	// Send the START command.
 	int ret;
@@ -229,10 +803,10 @@ int owon_usb_read(struct libusb_device_handle *dev_handle, unsigned char **buffe
 		fprintf(stderr,"\n");
 		if (ret == -1) {
 			if (multipart==1 && start_response.length==0) {
-				return downloaded;
+				return buffer->length;
 			}
-			if (allocated==downloaded) {
-				return downloaded;
+			if (expected == buffer->length) {
+				return buffer->length;
 			}
 			return -1;
 		}
@@ -243,56 +817,67 @@ int owon_usb_read(struct libusb_device_handle *dev_handle, unsigned char **buffe
 			multipart=0;
 		}
 
-		// Allocate enough memory to hold the data from the ocilloscope.
-		if (allocated == 0) {
-			fprintf(stderr,"Allocating %d\n",start_response.length);
-			*buffer = malloc(start_response.length);
-			if (NULL == *buffer) {
-				fprintf(stderr,"Error allocating %d\n",start_response.length);
-				return OWON_ERROR_MEMORY;
-			}
-			allocated = start_response.length;
-		} else {
-			fprintf(stderr,"Reallocating %d\n",start_response.length+allocated);
-			*buffer = realloc(*buffer, start_response.length + allocated);
-			if (*buffer == NULL) {
-				fprintf(stderr,"Error reallocating %d\n",start_response.length+allocated);
-				return OWON_ERROR_MEMORY;
-			}
-			allocated += start_response.length;
+		// Each part gets its own segment, nothing already read is moved
+		segment = owon_usb_segment(buffer, buffer->count, start_response.length);
+		if (NULL == segment) {
+			fprintf(stderr,"Error allocating %d\n",start_response.length);
+			return OWON_ERROR_MEMORY;
 		}
+		buffer->count++;
+		expected += start_response.length;
      
 	// Read data from the ocilloscope.
-		int forloop;
-		forloop=start_response.length;
-	do {
-		int tries=3;
-		ret=-255;
-		do {
-			ret = libusb_bulk_transfer(dev_handle, OWON_USB_ENDPOINT_IN, *buffer + downloaded,
-						   131072,&transferred, 50000);
-			if (ret<0) {
-				fprintf(stderr,"Try %d ret=%d transf=%d\n",3-tries,ret,transferred);
-				usleep(100);
-			}
-		} while (tries-->0 && ret<0);
-
-		forloop -= transferred;
-		downloaded += transferred;
-
-		if (ret==-1)
-			return -1;
-		fprintf(stderr,"%d/%d %d %% (rest=%d) ret=%d transferred=%d\n",downloaded,allocated,100*downloaded/allocated,forloop,ret,transferred);
-	} while (allocated > downloaded);
-//	fprintf(stderr,"%d/%d %d %% (rest=%d) ret=%d\n",downloaded,allocated,100*downloaded/allocated,forloop,ret);
+		ret = owon_usb_bulk_read(dev_handle, buffer->transfers, segment->data, start_response.length,
+					 buffer->stream, &elapsed);
+		if (ret < 0)
+			return ret;
+		segment->length = ret;
+		buffer->length += ret;
+		total_time += elapsed;
+		fprintf(stderr,"%zu part %zu: %d/%d ret=%d\n",buffer->length,buffer->count,ret,start_response.length,ret);
 	} while (multipart != 0);
-	fprintf(stderr,"Downloaded: %d\n",downloaded);
-	return downloaded; 
+	if (total_time > 0)
+		fprintf(stderr,"Downloaded: %zu in %.3f s (%.2f MB/s)\n",buffer->length,total_time,buffer->length/total_time/1.0e6);
+	else
+		fprintf(stderr,"Downloaded: %zu\n",buffer->length);
+	return buffer->length;
+}
+
+// One shot read, buffer is allocated and must be freed by the caller
+int owon_usb_read(struct libusb_device_handle *dev_handle, unsigned char **buffer,
+		  enum owon_start_command_type type) {
+	OWON_USB_BUFFER_st capture;
+	long length;
+
+	owon_usb_buffer_init(&capture);
+	length = owon_usb_read_into(dev_handle, &capture, type);
+	if (length > 0 && capture.count == 1) {
+		// Hand the only segment over
+		*buffer = capture.segments[0].data;
+		capture.segments[0].data = NULL;
+	} else if (length > 0) {
+		*buffer = malloc(length);
+		if (NULL == *buffer)
+			length = OWON_ERROR_MEMORY;
+		else
+			memcpy(*buffer, owon_usb_buffer_data(&capture), length);
+	}
+	owon_usb_buffer_free(&capture);
+	return length;
 }
 
 void owon_usb_close(struct libusb_device_handle *dev_handle) {
 	libusb_release_interface(dev_handle, OWON_USB_INTERFACE);
 	libusb_close(dev_handle);
+}
+
+// Once every device is closed
+void owon_usb_exit(void) {
+	owon_usb_stop_events();
+	if (NULL == ctx)
+		return;
+	cache_stop();
 	libusb_exit(ctx);
+	ctx = NULL;
 }
 
@@ -24,7 +24,9 @@
 #ifndef __OWON__USB_H__
 #define __OWON__USB_H__
 
+#include <stdint.h>
 #include <libusb.h>
+#include "parse.h"
 
 #ifndef USB_DEBUG
 #define USB_DEBUG 3
@@ -45,6 +47,42 @@
 // Transfer timout in milliseconds
 #define OWON_USB_TRANSFER_TIMEOUT 1000
 
+// Bulk download: number of transfers kept in flight, size and timeout of each
+#define OWON_USB_ASYNC_TRANSFERS 8
+#define OWON_USB_ASYNC_TRANSFER_SIZE 131072
+#define OWON_USB_ASYNC_TIMEOUT 50000
+
+// Longest serial number kept, with its terminating zero
+#define OWON_USB_SERIAL_LENGTH 64
+
+typedef struct {
+	int index;
+	uint8_t bus;
+	uint8_t address;
+	char serial[OWON_USB_SERIAL_LENGTH];
+} OWON_USB_DEVICE_st;
+
+// A part of a capture
+typedef struct {
+	unsigned char *data;
+	size_t length;
+	size_t capacity;
+} OWON_USB_SEGMENT_st;
+
+// Reusable capture buffer, see owon_usb_read_into
+typedef struct {
+	OWON_USB_SEGMENT_st *segments;
+	size_t count;          // segments used by the last capture
+	size_t size;           // segments allocated
+	size_t length;         // bytes of the last capture
+	unsigned char *flat;   // contiguous copy of a multipart capture
+	size_t flat_capacity;
+	struct libusb_transfer *transfers[OWON_USB_ASYNC_TRANSFERS];
+	// When set, the capture is fed to it while it downloads. It has to be
+	// initialized persistent, the parsed samples point into the segments.
+	OWON_STREAM_st *stream;
+} OWON_USB_BUFFER_st;
+
 enum owon_start_command_type {
 	DUMP_BMP = 0,
 	DUMP_BIN,
@@ -56,15 +94,31 @@ enum owon_start_command_type {
 enum owon_output_type {
 	DUMP_OUTPUT_RAW = 0,
 	DUMP_OUTPUT_CSV,
+	DUMP_OUTPUT_COLUMNAR,
+	DUMP_OUTPUT_SPECTRUM,
+	DUMP_OUTPUT_ARCHIVE,
 	DUMP_OUTPUT_COUNT
 };
 
 void owon_usb_init(void);
+void owon_usb_exit(void);
 struct libusb_device_handle *owon_usb_get_device(int dnum);
+struct libusb_device_handle *owon_usb_get_device_serial(const char *serial);
 size_t owon_usb_get_device_count();
+int owon_usb_list_devices(OWON_USB_DEVICE_st **devices);
+int owon_usb_get_serial(struct libusb_device_handle *dev_handle, char *serial, size_t len);
 struct libusb_device_handle *owon_usb_easy_open(int dnum);
+struct libusb_device_handle *owon_usb_easy_open_serial(const char *serial);
 struct libusb_device_handle *owon_usb_open(struct libusb_device_handle *dev);
+int owon_usb_start_events(void);
+void owon_usb_stop_events(void);
 int owon_usb_read(struct libusb_device_handle *dev_handle, unsigned char **buffer, enum owon_start_command_type type);
+void owon_usb_buffer_init(OWON_USB_BUFFER_st *buffer);
+void owon_usb_buffer_free(OWON_USB_BUFFER_st *buffer);
+// Reads a capture into buffer, reusing the memory of the previous ones
+long owon_usb_read_into(struct libusb_device_handle *dev_handle, OWON_USB_BUFFER_st *buffer, enum owon_start_command_type type);
+// The capture in one piece: the single segment, or a reused copy when multipart
+const unsigned char *owon_usb_buffer_data(OWON_USB_BUFFER_st *buffer);
 void owon_usb_close(struct libusb_device_handle *dev_handle);
 int owon_usb_is_managed(void *device);
 #endif // __OWON__USB_H__